@@ -3,9 +3,14 @@
 
 #include <arch/x86_64/acpi/acpi.h>
 #include <arch/x86_64/mm/vmm.h>
+#include <klib/memory.h>
 
 extern uint64_t hhdm_offset;
 
+// private copies made before ACPI-reclaimable memory goes back to the PMM
+static struct madt *madt_copy;
+static struct hpet *hpet_copy;
+
 struct xsdt* acpi_get_xsdt(void* rsdp_ptr) {
     struct rsdp2* rsdp = (struct rsdp2*)rsdp_ptr;
 
@@ -31,6 +36,8 @@ struct acpi_sdt_header* acpi_find_table(struct xsdt* xsdt, const char* signature
 }
 
 struct madt* acpi_get_madt(void* rsdp_ptr) {
+    if (madt_copy) return madt_copy;
+
     struct xsdt* xsdt = acpi_get_xsdt(rsdp_ptr);
     if (!xsdt) return NULL;
 
@@ -38,8 +45,26 @@ struct madt* acpi_get_madt(void* rsdp_ptr) {
 }
 
 struct hpet *acpi_get_hpet(void *rsdp_ptr) {
+    if (hpet_copy) return hpet_copy;
+
     struct xsdt *xsdt = acpi_get_xsdt(rsdp_ptr);
     if (!xsdt) return NULL;
 
     return (struct hpet *)acpi_find_table(xsdt, "HPET");
+}
+
+static void *copy_table(struct acpi_sdt_header *table) {
+    if (!table) return NULL;
+
+    void *copy_phys = pmm_alloc_aligned(table->length, PAGE_SIZE);
+    if (!copy_phys) return NULL;
+
+    void *copy = (void *)phys_to_virt((uint64_t)copy_phys);
+    memcpy(copy, table, table->length);
+    return copy;
+}
+
+void acpi_preserve_tables(void *rsdp_ptr) {
+    if (!madt_copy) madt_copy = copy_table((struct acpi_sdt_header *)acpi_get_madt(rsdp_ptr));
+    if (!hpet_copy) hpet_copy = copy_table((struct acpi_sdt_header *)acpi_get_hpet(rsdp_ptr));
 }
\ No newline at end of file
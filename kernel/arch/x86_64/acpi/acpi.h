@@ -152,6 +152,9 @@ struct acpi_sdt_header* acpi_find_table(struct xsdt* xsdt, const char* signature
 struct madt* acpi_get_madt(void* rsdp_ptr);
 struct hpet *acpi_get_hpet(void *rsdp_ptr);
 
+// copy the MADT and HPET out of firmware memory; later lookups return the copies
+void acpi_preserve_tables(void *rsdp_ptr);
+
 extern volatile struct limine_rsdp_request rsdp_request;
 
 #endif
\ No newline at end of file
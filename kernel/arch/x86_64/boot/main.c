@@ -7,6 +7,8 @@
 #include <klib/memory.h>
 #include <klib/string.h>
 #include <arch/x86_64/cpu/gdt.h>
+#include <arch/x86_64/cpu/percpu.h>
+#include <arch/x86_64/cpu/smp.h>
 #include <arch/x86_64/interrupts/idt.h>
 #include <arch/x86_64/acpi/acpi.h>
 #include <arch/x86_64/interrupts/apic.h>
@@ -15,6 +17,11 @@
 #include <drivers/serial.h>
 #include <drivers/keyboard.h>
 #include <mm/pmm.h>
+#include <mm/zeropool.h>
+#include <mm/page.h>
+#include <mm/slab.h>
+#include <mm/vmalloc.h>
+#include <mm/vma.h>
 #include <arch/x86_64/mm/vmm.h>
 #include <colors.h>
 #include <shell_kspace/kernelshell.h>
@@ -23,9 +30,21 @@
 #include <arch/x86_64/usermode/usermode.h>
 #include <arch/x86_64/usermode/scheduler.h>
 #include <fs/cpio/cpio.h>
+#include <bench/bench.h>
 
 #define ESTELLA_VERSION "Estella v0.9.0-dev"
 
+// Limine's stack is in bootloader-reclaimable memory, so we bring our own
+#define BOOT_STACK_SIZE (64 * 1024)
+#define BOOT_MAX_MODULES 8
+
+static uint8_t boot_stack[BOOT_STACK_SIZE] __attribute__((aligned(16)));
+
+// copies of the limine responses still used after reclaim
+static struct limine_framebuffer boot_fb;
+static struct limine_file boot_modules[BOOT_MAX_MODULES];
+static size_t boot_module_count;
+
 __attribute__((used, section(".limine_requests")))
 static volatile uint64_t limine_base_revision[] = LIMINE_BASE_REVISION(4);
 
@@ -71,6 +90,13 @@ volatile struct limine_rsdp_request rsdp_request = {
     .revision = 0
 };
 
+__attribute__((used, section(".limine_requests")))
+static volatile struct limine_mp_request mp_request = {
+    .id = LIMINE_MP_REQUEST_ID,
+    .revision = 0,
+    .flags = LIMINE_MP_REQUEST_X86_64_X2APIC
+};
+
 __attribute__((used, section(".limine_requests")))
 volatile struct limine_date_at_boot_request date_at_boot_request = {
     .id = LIMINE_DATE_AT_BOOT_REQUEST_ID,
@@ -83,7 +109,7 @@ static volatile uint64_t limine_requests_start_marker[] = LIMINE_REQUESTS_START_
 __attribute__((used, section(".limine_requests_end")))
 static volatile uint64_t limine_requests_end_marker[] = LIMINE_REQUESTS_END_MARKER;
 
-void hcf(void) {
+__attribute__((noreturn)) void hcf(void) {
     for (;;) {
         asm ("hlt");
     }
@@ -176,6 +202,7 @@ static void print_memory_info(void) {
     size_t usable = pmm_get_usable_frames();
     size_t free = pmm_get_free_frames();
     size_t used = pmm_get_used_frames();
+    size_t reclaimed = pmm_get_reclaimed_frames();
 
     fb_print("Memory Overview\n", COL_SECTION_TITLE);
 
@@ -201,7 +228,13 @@ static void print_memory_info(void) {
     fb_print_number(free * PAGE_SIZE / 1024 / 1024, COL_FREE);
     fb_print(" MiB (", COL_FREE);
     fb_print_number(free, COL_FREE);
-    fb_print(" pages)\n\n", COL_FREE);
+    fb_print(" pages)\n", COL_FREE);
+
+    fb_print("> Reclaimed ", COL_LABEL);
+    fb_print_number(reclaimed * PAGE_SIZE / 1024, COL_FREE);
+    fb_print(" KiB (", COL_FREE);
+    fb_print_number(reclaimed, COL_FREE);
+    fb_print(" pages) from bootloader/ACPI\n\n", COL_FREE);
 
     char buf[80];
     serial_puts("Memory: total ");
@@ -222,9 +255,29 @@ static void print_memory_info(void) {
     serial_puts(" MiB (");
     u64_to_dec(free, buf);
     serial_puts(buf);
+    serial_puts(" pages), reclaimed ");
+    u64_to_dec(reclaimed * PAGE_SIZE / 1024, buf);
+    serial_puts(buf);
+    serial_puts(" KiB (");
+    u64_to_dec(reclaimed, buf);
+    serial_puts(buf);
     serial_puts(" pages)\n");
+
+    serial_puts("Zero pool: ");
+    u64_to_dec(zero_pool_count(), buf);
+    serial_puts(buf);
+    serial_puts(" frames, ");
+    u64_to_dec(zero_pool_hits(), buf);
+    serial_puts(buf);
+    serial_puts(" hits, ");
+    u64_to_dec(zero_pool_misses(), buf);
+    serial_puts(buf);
+    serial_puts(" misses\n");
 }
 
+// 8 B .. 4 KiB: every kmalloc class plus one whole-frame allocation
+#define KMALLOC_CLASSES_TESTED 10
+
 int memorymanagers_tests(void) {
     // PMM
     void *p1 = pmm_alloc();
@@ -244,20 +297,145 @@ int memorymanagers_tests(void) {
     if (*(uint64_t*)phys_to_virt((uint64_t)p4) != 0) goto pmm_fail;
     pmm_free(p4);
 
+    // buddy: natural alignment, exact accounting for odd sizes, merge back on free
+    size_t free_before = pmm_get_free_frames();
+    void *p5 = pmm_alloc_frames(8);
+    if (!p5 || ((uintptr_t)p5 % (PAGE_SIZE * 8) != 0)) goto pmm_fail;
+    void *p6 = pmm_alloc_frames(3);
+    if (!p6 || pmm_get_free_frames() != free_before - 11) goto pmm_fail;
+    if ((uintptr_t)p6 < (uintptr_t)p5 + 8 * PAGE_SIZE && (uintptr_t)p5 < (uintptr_t)p6 + 3 * PAGE_SIZE) goto pmm_fail;
+    pmm_free_frames(p6, 3);
+    pmm_free_frames(p5, 8);
+    if (pmm_get_free_frames() != free_before) goto pmm_fail;
+
+    size_t max_blocks = pmm_get_free_blocks(PMM_MAX_ORDER);
+    void *p7 = pmm_alloc_frames(2);
+    if (!p7) goto pmm_fail;
+    pmm_free_frames(p7, 2);
+    if (pmm_get_free_blocks(PMM_MAX_ORDER) != max_blocks) goto pmm_fail;
+
+    void *p8 = pmm_alloc_frames_linear(5, PAGE_SIZE * 2);
+    if (!p8 || ((uintptr_t)p8 % (PAGE_SIZE * 2) != 0)) goto pmm_fail;
+    pmm_free_frames(p8, 5);
+    if (pmm_get_free_frames() != free_before) goto pmm_fail;
+
+    // frame database: refcounts, compound heads
+    void *p9 = pmm_alloc();
+    struct page *pg9 = p9 ? phys_to_page((uint64_t)p9) : NULL;
+    if (!pg9 || pg9->refcount != 1 || (pg9->flags & PG_RESERVED)) goto pmm_fail;
+    page_get(pg9);
+    if (page_put(pg9) || !page_put(pg9)) goto pmm_fail;
+
+    void *p10 = pmm_alloc_frames(4);
+    struct page *pg10 = p10 ? phys_to_page((uint64_t)p10) : NULL;
+    if (!pg10 || !(pg10->flags & PG_COMPOUND) || pg10->order != 2) goto pmm_fail;
+    if (!page_put(pg10) || pmm_get_free_frames() != free_before) goto pmm_fail;
+    if (!(phys_to_page(0)->flags & PG_RESERVED)) goto pmm_fail;
+
+
+    // slab: every size class, distinct objects, large allocations, kfree back to zero in use
+    void *objs[KMALLOC_CLASSES_TESTED];
+    size_t obj_size = 8;
+    for (int i = 0; i < KMALLOC_CLASSES_TESTED; i++, obj_size <<= 1) {
+        objs[i] = kzalloc(obj_size);
+        if (!objs[i] || ((uintptr_t)objs[i] % 8) != 0) goto slab_fail;
+        memset(objs[i], 0xAB, obj_size);
+    }
+    for (int i = 0; i < KMALLOC_CLASSES_TESTED; i++) kfree(objs[i]);
+
+    kmem_cache_t *test_cache = kmem_cache_create("selftest", 48, 16);
+    if (!test_cache) goto slab_fail;
+    void *o1 = kmem_cache_alloc(test_cache);
+    void *o2 = kmem_cache_alloc(test_cache);
+    if (!o1 || !o2 || o1 == o2 || ((uintptr_t)o1 % 16) != 0) goto slab_fail;
+    kmem_cache_free(test_cache, o1);
+    kmem_cache_free(test_cache, o2);
+    struct kmem_cache_stats stats;
+    kmem_cache_get_stats(test_cache, &stats);
+    if (stats.in_use != 0 || stats.allocs != 2) goto slab_fail;
+    if (!kmem_cache_destroy(test_cache)) goto slab_fail;
 
     // VMM
-    uint64_t vaddr = 0xFFFF900000000000ULL;
-    void *phys = pmm_alloc();
+    uint64_t phys = (uint64_t)pmm_alloc();
     if (!phys) goto vmm_fail;
 
-    if (!vmm_map(vaddr, (uint64_t)phys, PTE_KERNEL_RW)) {pmm_free(phys); goto vmm_fail;}
-
-    uint64_t *ptr = (uint64_t *)vaddr;
+    uint64_t *ptr = vmap(&phys, 1, PTE_KERNEL_RW_NX);
+    if (!ptr) {pmm_free((void *)phys); goto vmm_fail;}
     *ptr = 0xDEADBEEFCAFEBABELL;
-    if (*ptr != 0xDEADBEEFCAFEBABELL) {vmm_unmap(vaddr); goto vmm_fail;}
-
-    vmm_unmap(vaddr);
-    pmm_free(phys);
+    if (*(uint64_t *)phys_to_virt(phys) != 0xDEADBEEFCAFEBABELL) {vunmap(ptr); pmm_free((void *)phys); goto vmm_fail;}
+    vunmap(ptr);
+    pmm_free((void *)phys);
+
+    // vmalloc: virtually contiguous over scattered frames, guard page after it
+    uint8_t *vbuf = vzalloc(3 * PAGE_SIZE + 1);
+    if (!vbuf || vbuf[3 * PAGE_SIZE] != 0) goto vmm_fail;
+    memset(vbuf, 0x5A, 4 * PAGE_SIZE);
+    if (vmm_get_physical((uint64_t)vbuf + 4 * PAGE_SIZE) != 0) {vfree(vbuf); goto vmm_fail;}
+    vfree(vbuf);
+
+    // huge frames: one 2 MiB block mapped with a single pde
+    void *huge = pmm_alloc_huge_2mb();
+    if (!huge) goto pmm_fail;
+    if ((uintptr_t)huge % HUGE_2MB != 0) {
+        pmm_free_frames(huge, HUGE_2MB / PAGE_SIZE);
+        goto pmm_fail;
+    }
+    uint64_t huge_vaddr = (uint64_t)ioremap((uint64_t)huge, HUGE_2MB, IOREMAP_WB);
+    if (!huge_vaddr) {
+        pmm_free_frames(huge, HUGE_2MB / PAGE_SIZE);
+        goto vmm_fail;
+    }
+    if (!(vmm_get_flags(huge_vaddr) & PTE_HUGE)
+        || vmm_get_physical(huge_vaddr + 0x1234) != (uint64_t)huge + 0x1234) {
+        iounmap((void *)huge_vaddr);
+        pmm_free_frames(huge, HUGE_2MB / PAGE_SIZE);
+        goto vmm_fail;
+    }
+    // unmapping one page out of it splits the pde into 512 ptes, the rest stays mapped
+    if (!vmm_unmap(huge_vaddr + PAGE_SIZE) || vmm_get_physical(huge_vaddr + PAGE_SIZE)
+        || (vmm_get_flags(huge_vaddr) & PTE_PAT)
+        || vmm_get_physical(huge_vaddr + 2 * PAGE_SIZE + 8) != (uint64_t)huge + 2 * PAGE_SIZE + 8) {
+        iounmap((void *)huge_vaddr);
+        pmm_free_frames(huge, HUGE_2MB / PAGE_SIZE);
+        goto vmm_fail;
+    }
+    iounmap((void *)huge_vaddr);
+    pmm_free_frames(huge, HUGE_2MB / PAGE_SIZE);
+    vmalloc_purge_lazy();
+
+    // batched mapping: 64 MiB in a scratch address space takes one walk per 2 MiB
+    uint64_t scratch_phys = (uint64_t)pmm_alloc_zeroed();
+    uint64_t scratch_frame = (uint64_t)pmm_alloc();
+    if (!scratch_phys || !scratch_frame) {
+        if (scratch_phys) pmm_free((void *)scratch_phys);
+        if (scratch_frame) pmm_free((void *)scratch_frame);
+        goto vmm_fail;
+    }
+    vmm_batch_t batch;
+    vmm_batch_begin(&batch, (uint64_t *)phys_to_virt(scratch_phys));
+    bool batch_ok = true;
+    for (uint64_t off = 0; off < 64 * 1024 * 1024 && batch_ok; off += PAGE_SIZE) {
+        batch_ok = vmm_batch_map(&batch, 0x40000000 + off, scratch_frame, PTE_PRESENT | PTE_USER);
+    }
+    size_t map_walks = batch.walks;
+    batch_ok = batch_ok && vmm_batch_unmap(&batch, 0x40000000 + HUGE_2MB) != 0;
+    vmm_batch_end(&batch);
+    // the frame isn't PG_USER, so only the tables go
+    vmm_destroy_address_space(scratch_phys);
+    pmm_free((void *)scratch_frame);
+    if (!batch_ok || map_walks != 32) goto vmm_fail;
+
+    // vmas: neighbours merge, a hole in the middle splits one in two
+    mm_t *mm = mm_create();
+    if (!mm) goto vmm_fail;
+    struct vma *va = vma_create(0x400000, 0x402000, VMA_READ | VMA_WRITE);
+    if (!va || !mm_insert(mm, va)) {if (va) vma_free(va); mm_destroy(mm); goto vmm_fail;}
+    struct vma *vb = vma_create(0x402000, 0x404000, VMA_READ | VMA_WRITE);
+    if (!vb || !mm_insert(mm, vb)) {if (vb) vma_free(vb); mm_destroy(mm); goto vmm_fail;}
+    if (mm->vma_count != 1) {mm_destroy(mm); goto vmm_fail;}
+    if (!mm_remove_range(mm, 0x401000, 0x402000) || mm->vma_count != 2
+        || mm_find(mm, 0x401800) || !mm_find(mm, 0x403FFF)) {mm_destroy(mm); goto vmm_fail;}
+    mm_destroy(mm);
     return 0;
 
     pmm_fail:
@@ -268,10 +446,60 @@ int memorymanagers_tests(void) {
         serial_puts("VMM tests FAILED\n");
         return 1;
 
+    slab_fail:
+        serial_puts("slab tests FAILED\n");
+        return 1;
+
     return 0;
 } 
 
+// copy out what is still needed, move off limine's page tables, then free
+// bootloader- and ACPI-reclaimable memory. limine responses are dead after this
+static void reclaim_boot_memory(void) {
+    acpi_preserve_tables(rsdp_request.response->address);
+
+    bool relocated = vmm_relocate_boot_tables();
+    // the aps wait on limine's stacks and tables: start them once the kernel has its own
+    // tables, and before the memory they are parked in is handed to the pmm
+    bool aps_settled = smp_init(mp_request.response);
+    if (!relocated || !aps_settled) {
+        serial_puts("boot memory reclaim skipped\n");
+        return;
+    }
+    pmm_reclaim_boot_memory();
+}
+
+static void copy_boot_responses(void) {
+    boot_fb = *framebuffer_request.response->framebuffers[0];
+    boot_fb.edid = NULL;
+    boot_fb.edid_size = 0;
+    boot_fb.modes = NULL;
+    boot_fb.mode_count = 0;
+
+    struct limine_module_response *modules = module_request.response;
+    for (size_t i = 0; i < modules->module_count && i < BOOT_MAX_MODULES; i++) {
+        boot_modules[i] = *modules->modules[i];
+        // the path strings live in reclaimable memory too
+        boot_modules[i].path = NULL;
+        boot_modules[i].string = NULL;
+        boot_module_count++;
+    }
+}
+
+__attribute__((noreturn)) static void kernel_main(void);
+
 void EstellaEntry(void) {
+    // switch stacks before anything gets a chance to keep a pointer into limine's
+    asm volatile(
+        "mov %0, %%rsp\n"
+        "xor %%ebp, %%ebp\n"
+        "call *%1\n"
+        :: "r"(&boot_stack[BOOT_STACK_SIZE]), "r"(kernel_main)
+        : "memory");
+    __builtin_unreachable();
+}
+
+static void kernel_main(void) {
     // asm volatile("cli");
     // https://codeberg.org/Limine/limine-protocol/src/branch/trunk/PROTOCOL.md#x86-64-1
     // IF flag is cleared on entry
@@ -285,10 +513,12 @@ void EstellaEntry(void) {
     if (!framebuffer_request.response || framebuffer_request.response->framebuffer_count == 0) hcf();
     if (!hhdm_request.response || !memmap_request.response || !module_request.response || !rsdp_request.response) hcf();
 
+    copy_boot_responses();
+
     // load initrd cpio from module
-    int count_modules = module_request.response->module_count;
-    if(count_modules < 1) serial_puts("missing initrd\n");
-    struct limine_file *initrdcpio = module_request.response->modules[0]; 
+    if(boot_module_count < 1) serial_puts("missing initrd\n");
+    struct limine_file *initrdcpio = &boot_modules[0];
+    cpio_set_initrd(initrdcpio);
 
     // load font, init fbtext
     size_t font_size;
@@ -298,7 +528,9 @@ void EstellaEntry(void) {
         serial_puts("failed to load font?\n");
         hcf();
     }
-    font_t font = {
+    // fbtext keeps a pointer to it, and the bsp's idle loop reuses this stack
+    static font_t font;
+    font = (font_t){
         .is_psf2 = true,
         .hdr.psf2 = psf2,
         .glyphs = (const uint8_t *)fontfile + psf2->headersize,
@@ -307,7 +539,7 @@ void EstellaEntry(void) {
         .line_height = psf2->height + 1,
         .glyph_count = psf2->length
     };
-    struct limine_framebuffer *fb = framebuffer_request.response->framebuffers[0];
+    struct limine_framebuffer *fb = &boot_fb;
     fbtext_init(fb, &font);
 
     // system info & logo
@@ -316,20 +548,43 @@ void EstellaEntry(void) {
 
     // init everything
     gdt_init(); fb_print("GDT with TSS initialized;", COL_SUCCESS_INIT);
+    percpu_init(0);
+    // where the bsp idles once it runs out of tasks; kernel_main never comes back to it
+    this_cpu()->idle_stack = &boot_stack[BOOT_STACK_SIZE];
     idt_init(); fb_print(" IDT initialized;", COL_SUCCESS_INIT);
     syscalls_init(); fb_print(" Syscalls initialized;", COL_SUCCESS_INIT);
     pmm_init(); fb_print(" PMM initialized;", COL_SUCCESS_INIT); 
     vmm_init(); fb_print(" VMM initialized;", COL_SUCCESS_INIT); 
+    // the console only ever writes pixels, write-combining lets the cpu batch those stores
+    if (!fb_set_cache(PTE_CACHE_WC)) serial_puts("framebuffer: write-combining remap failed\n");
+    slab_init(); fb_print(" Slab initialized;", COL_SUCCESS_INIT);
+    vmalloc_init(); fb_print(" vmalloc initialized;", COL_SUCCESS_INIT);
+    vma_init();
     apic_init(); fb_print(" TSC & APIC initialized;", COL_SUCCESS_INIT);
     time_init(); fb_print(" RTC initialized;", COL_SUCCESS_INIT);
     keyboard_init(); fb_print(" PS/2 keyboard driver initialized\n", COL_SUCCESS_INIT);
 
-    if(memorymanagers_tests() == 0) fb_print("VMM & PMM tests ok\n\n", COL_SUCCESS_INIT);
+    if(memorymanagers_tests() == 0) fb_print("VMM, PMM & slab tests ok\n\n", COL_SUCCESS_INIT);
+    reclaim_boot_memory();
+    fb_print_number(smp_cpu_count(), COL_SUCCESS_INIT); fb_print(" CPUs online\n", COL_SUCCESS_INIT);
+    zero_pool_init();
     print_memory_info();
 
+    scheduler_init(); fb_print("Scheduler initialized\n", COL_SUCCESS_INIT);
+
+#if ESTELLA_BENCH
+    bench_run_all();
+    bench_task_churn(cpio_lookup(initrdcpio, "bin/task_a.elf", NULL));
+    bench_fork(cpio_lookup(initrdcpio, "bin/task_a.elf", NULL));
+    bench_context_switch(cpio_lookup(initrdcpio, "bin/task_a.elf", NULL));
+    bench_thp(cpio_lookup(initrdcpio, "bin/task_a.elf", NULL));
+    bench_framebuffer(fb);
+    bench_smp_scaling();
+    bench_fairness(cpio_lookup(initrdcpio, "bin/hog.elf", NULL));
+#endif
+
     // Enabling interrupts
     asm volatile("sti");
-    scheduler_init(); fb_print("Scheduler initialized\n", COL_SUCCESS_INIT);
 
     // create tasks, jump to ring3
     task_t *t1 = task_create_from_elf(cpio_lookup(initrdcpio, "bin/task_a.elf", NULL)); fb_print("TASK_A created! ", COL_TITLE);
@@ -339,9 +594,11 @@ void EstellaEntry(void) {
     scheduler_add_task(t2); fb_print("TASK_B in queue! ", COL_TITLE);
     scheduler_add_task(t3); fb_print("TASK_C in queue!\n", COL_TITLE);
 
-    fb_print("task_enter TASK_A\n", COL_TITLE);
-    task_enter(t1);
+    // the tasks went to the least loaded cpus' run queues; the bsp joins the scheduler
+    // here and, like the aps, steals from a busier queue when its own runs dry
+    fb_print("entering the scheduler\n", COL_TITLE);
+    scheduler_run_next();
 
     // launch_shell(); // kernelshell.h
-    // hcf();
+    hcf();
 }
\ No newline at end of file
@@ -1,16 +1,16 @@
 #include <arch/x86_64/cpu/gdt.h>
+#include <arch/x86_64/cpu/percpu.h>
 #include <drivers/serial.h>
 
 #define GDT_ENTRIES 7
 
-static struct gdt_entry gdt[GDT_ENTRIES] __attribute__((aligned(16))) = {0};
-static struct gdt_ptr gp;
-struct tss_struct tss;
+// every cpu needs its own tss, and with it its own gdt to hold the descriptor
+static struct gdt_entry gdts[MAX_CPUS][GDT_ENTRIES] __attribute__((aligned(16))) = {0};
+static struct gdt_ptr gp[MAX_CPUS];
+static struct tss_struct tss[MAX_CPUS];
 
-#define IST_STACK_SIZE 8192
-static uint8_t ist1_stack[IST_STACK_SIZE] __attribute__((aligned(16)));
-static uint8_t ist2_stack[IST_STACK_SIZE] __attribute__((aligned(16)));
-static uint8_t ist3_stack[IST_STACK_SIZE] __attribute__((aligned(16)));
+// the bsp's; the aps get theirs from smp_init
+static uint8_t ist_stacks[GDT_IST_STACKS_SIZE] __attribute__((aligned(16)));
 
 #define KERNEL_STACK_SIZE  (16 * 4096)
 static uint8_t kernel_main_stack[KERNEL_STACK_SIZE] __attribute__((aligned(16)));
@@ -34,7 +34,9 @@ static void load_gdt(uint64_t gdt_ptr_addr) {
     );
 }
 
-void gdt_init(void) {
+static void gdt_setup(uint32_t cpu, uint8_t *ist, uint64_t rsp0) {
+    struct gdt_entry *gdt = gdts[cpu];
+
     // 0: Null descriptor
     // 1: Kernel code
     // 2: Kernel data
@@ -70,10 +72,10 @@ void gdt_init(void) {
     gdt[4].granularity = 0x20;
     gdt[4].base_high = 0;
 
-    uint64_t tss_addr = (uint64_t)&tss;
+    uint64_t tss_addr = (uint64_t)&tss[cpu];
     struct gdt_system_entry *tss_desc = (struct gdt_system_entry*)&gdt[5];
 
-    tss_desc->limit_low    = sizeof(tss) - 1;
+    tss_desc->limit_low    = sizeof(struct tss_struct) - 1;
     tss_desc->base_low     = tss_addr & 0xFFFF;
     tss_desc->base_mid     = (tss_addr >> 16) & 0xFF;
     tss_desc->access       = 0x89;
@@ -82,19 +84,27 @@ void gdt_init(void) {
     tss_desc->base_upper   = tss_addr >> 32;
     tss_desc->reserved     = 0;
     
-    tss.rsp0 = (uint64_t)&kernel_main_stack[KERNEL_STACK_SIZE];
+    tss[cpu].rsp0 = rsp0;
 
-    tss.ist1 = (uint64_t)&ist1_stack[IST_STACK_SIZE];
-    tss.ist2 = (uint64_t)&ist2_stack[IST_STACK_SIZE];
-    tss.ist3 = (uint64_t)&ist3_stack[IST_STACK_SIZE];
+    tss[cpu].ist1 = (uint64_t)ist + 1 * IST_STACK_SIZE;
+    tss[cpu].ist2 = (uint64_t)ist + 2 * IST_STACK_SIZE;
+    tss[cpu].ist3 = (uint64_t)ist + 3 * IST_STACK_SIZE;
+    cpu_locals[cpu].tss = &tss[cpu];
 
-    gp.limit = sizeof(gdt) - 1;
-    gp.base  = (uint64_t)&gdt;
+    gp[cpu].limit = sizeof(gdts[cpu]) - 1;
+    gp[cpu].base  = (uint64_t)gdt;
 
-    load_gdt((uint64_t)&gp);
+    load_gdt((uint64_t)&gp[cpu]);
 
     uint16_t tss_sel = 0x28;
     asm volatile ("ltr %0" : : "r"(tss_sel) : "memory");
+}
 
+void gdt_init(void) {
+    gdt_setup(0, ist_stacks, (uint64_t)&kernel_main_stack[KERNEL_STACK_SIZE]);
     serial_puts("GDT with TSS initialized\n");
+}
+
+void gdt_init_ap(uint32_t cpu, uint8_t *ist_stacks, uint64_t rsp0) {
+    gdt_setup(cpu, ist_stacks, rsp0);
 }
\ No newline at end of file
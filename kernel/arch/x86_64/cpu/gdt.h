@@ -46,6 +46,12 @@ struct tss_struct {
     uint16_t iomap_base;
 } __attribute__((packed));
 
+#define IST_STACK_SIZE 8192
+// double fault, nmi and machine check each get one
+#define GDT_IST_STACKS_SIZE (3 * IST_STACK_SIZE)
+
 void gdt_init(void);
+// cpu's own gdt and tss; ist_stacks is GDT_IST_STACKS_SIZE bytes
+void gdt_init_ap(uint32_t cpu, uint8_t *ist_stacks, uint64_t rsp0);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,8 @@
+#include <arch/x86_64/cpu/idle.h>
+#include <mm/zeropool.h>
+
+void cpu_idle(void) {
+    if (zero_pool_refill(ZERO_POOL_BATCH) > 0) return;
+
+    asm volatile("sti; hlt");
+}
@@ -0,0 +1,7 @@
+#ifndef ESTELLA_ARCH_X86_64_CPU_IDLE_H
+#define ESTELLA_ARCH_X86_64_CPU_IDLE_H
+
+// one pass of an idle loop: run background work, halt until the next interrupt if there was none
+void cpu_idle(void);
+
+#endif
@@ -0,0 +1,13 @@
+#include <arch/x86_64/cpu/percpu.h>
+#include <arch/x86_64/cpu/msr.h>
+
+cpu_local_t cpu_locals[MAX_CPUS];
+
+void percpu_init(uint32_t id) {
+    cpu_local_t *cpu = &cpu_locals[id];
+    cpu->self = cpu;
+    cpu->id = id;
+
+    wrmsr(IA32_GS_BASE, (uint64_t)cpu);
+    wrmsr(IA32_KERNEL_GS_BASE, 0);
+}
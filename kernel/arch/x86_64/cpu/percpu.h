@@ -0,0 +1,52 @@
+#ifndef ESTELLA_ARCH_X86_64_CPU_PERCPU_H
+#define ESTELLA_ARCH_X86_64_CPU_PERCPU_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define MAX_CPUS 64
+
+#define IA32_GS_BASE        0xC0000101
+#define IA32_KERNEL_GS_BASE 0xC0000102
+
+struct task;
+struct tss_struct;
+
+// GS base points here while in ring 0; swapgs on every user <-> kernel transition
+typedef struct cpu_local {
+    struct cpu_local *self;
+    uint32_t id;
+    uint32_t lapic_id;
+    uint64_t user_rsp;      // syscall entry scratch, CPU_USER_RSP in syscall_entry.S
+    struct task *current;   // CPU_CURRENT in isr.S
+    struct tss_struct *tss; // CPU_TSS in isr.S and syscall_entry.S
+    struct task *prev;      // switched away from, released by schedule_tail once off its stack
+    void *idle_stack;       // top of the stack the idle loop runs on
+    uint64_t ticks;
+    volatile bool need_resched;   // a woken task may outrank the running one
+    volatile uint32_t tlb_flush_pending;
+    volatile bool idle;
+    void (*volatile work)(void *);   // posted by smp_call, run from the idle loop
+    void *work_arg;
+} __attribute__((aligned(64))) cpu_local_t;
+
+_Static_assert(offsetof(cpu_local_t, user_rsp) == 16, "syscall_entry.S hardcodes CPU_USER_RSP");
+_Static_assert(offsetof(cpu_local_t, current) == 24, "isr.S hardcodes CPU_CURRENT");
+_Static_assert(offsetof(cpu_local_t, tss) == 32, "isr.S and syscall_entry.S hardcode CPU_TSS");
+
+extern cpu_local_t cpu_locals[MAX_CPUS];
+
+void percpu_init(uint32_t id);
+
+static inline cpu_local_t *this_cpu(void) {
+    cpu_local_t *cpu;
+    asm volatile("mov %%gs:0, %0" : "=r"(cpu));
+    return cpu;
+}
+
+static inline uint32_t this_cpu_id(void) {
+    return this_cpu()->id;
+}
+
+#endif
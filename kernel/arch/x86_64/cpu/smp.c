@@ -0,0 +1,240 @@
+// application processor bring-up through the limine mp request, plus the ipis the cpus
+// use to talk to each other
+#include <arch/x86_64/cpu/smp.h>
+#include <arch/x86_64/cpu/percpu.h>
+#include <arch/x86_64/cpu/gdt.h>
+#include <arch/x86_64/cpu/spinlock.h>
+#include <arch/x86_64/interrupts/idt.h>
+#include <arch/x86_64/interrupts/lapic.h>
+#include <arch/x86_64/interrupts/apictimer.h>
+#include <arch/x86_64/syscalls/syscalls.h>
+#include <arch/x86_64/mm/vmm.h>
+#include <arch/x86_64/time/tsc.h>
+#include <arch/x86_64/usermode/scheduler.h>
+#include <mm/pmm.h>
+#include <drivers/serial.h>
+#include <klib/string.h>
+
+#define AP_STACK_SIZE (16 * 1024)
+#define AP_BOOT_TIMEOUT_MS 1000
+
+static volatile bool cpu_online[MAX_CPUS] = { true };
+static uint32_t cpu_slots = 1;              // ids handed out, the bsp is 0
+static volatile uint32_t cpus_online = 1;
+static uint8_t *ist_stacks[MAX_CPUS];
+
+// rdtsc when each ap entered the kernel and when it was ready to schedule
+static uint64_t boot_entry[MAX_CPUS];
+static uint64_t boot_done[MAX_CPUS];
+
+static spinlock_t shootdown_lock = SPINLOCK_INIT;
+static volatile uint64_t shootdown_start, shootdown_end;
+
+__attribute__((noreturn)) static void ap_main(uint64_t id) {
+    cpu_local_t *cpu = &cpu_locals[id];
+
+    gdt_init_ap(id, ist_stacks[id], (uint64_t)cpu->idle_stack);
+    percpu_init(id);
+    idt_load();
+    syscalls_init_ap();
+    lapic_init_ap();
+    apic_timer_init_ap();
+
+    boot_done[id] = rdtsc();
+    cpu_online[id] = true;
+    __atomic_add_fetch(&cpus_online, 1, __ATOMIC_RELEASE);
+
+    scheduler_run_next();
+}
+
+// limine jumps here on the ap, still on its own stack and page tables
+static void ap_entry(struct limine_mp_info *info) {
+    uint64_t entry = rdtsc();
+    uint64_t id = info->extra_argument;
+
+    vmm_init_ap();
+    boot_entry[id] = entry;
+    asm volatile(
+        "mov %0, %%rsp\n"
+        "xor %%ebp, %%ebp\n"
+        "call *%1\n"
+        :: "r"(cpu_locals[id].idle_stack), "r"(ap_main), "D"(id)
+        : "memory");
+    __builtin_unreachable();
+}
+
+static uint64_t cycles_to_us(uint64_t cycles) {
+    return tsc_frequency_hz ? cycles * 1000000 / tsc_frequency_hz : 0;
+}
+
+static void log_cpu(uint32_t id, uint64_t launch) {
+    char buf[32];
+    serial_puts("[smp] cpu ");
+    u64_to_dec(id, buf);
+    serial_puts(buf);
+    serial_puts(" (lapic ");
+    u64_to_dec(cpu_locals[id].lapic_id, buf);
+    serial_puts(buf);
+    if (!cpu_online[id]) {
+        serial_puts(") did not come up\n");
+        return;
+    }
+    serial_puts("): init ");
+    u64_to_dec(cycles_to_us(boot_done[id] - boot_entry[id]), buf);
+    serial_puts(buf);
+    serial_puts(" us, online ");
+    u64_to_dec(cycles_to_us(boot_done[id] - launch), buf);
+    serial_puts(buf);
+    serial_puts(" us after launch\n");
+}
+
+bool smp_init(struct limine_mp_response *mp) {
+    if (!mp || mp->cpu_count < 2) {
+        serial_puts("[smp] single cpu\n");
+        return true;
+    }
+    // the ipis and the aps' timers are only set up for x2apic
+    if (!x2apic_enabled) {
+        serial_puts("[smp] no x2APIC, staying on the bsp\n");
+        return true;
+    }
+
+    cpu_locals[0].lapic_id = mp->bsp_lapic_id;
+    uint64_t launch = rdtsc();
+
+    for (uint64_t i = 0; i < mp->cpu_count; i++) {
+        struct limine_mp_info *info = mp->cpus[i];
+        if (info->lapic_id == mp->bsp_lapic_id) continue;
+        if (cpu_slots == MAX_CPUS) {
+            serial_puts("[smp] more cpus than MAX_CPUS, the rest stay parked\n");
+            break;
+        }
+
+        void *stack = pmm_alloc_frames(AP_STACK_SIZE / PAGE_SIZE);
+        void *ist = pmm_alloc_frames(GDT_IST_STACKS_SIZE / PAGE_SIZE);
+        if (!stack || !ist) {
+            if (stack) pmm_free_frames(stack, AP_STACK_SIZE / PAGE_SIZE);
+            if (ist) pmm_free_frames(ist, GDT_IST_STACKS_SIZE / PAGE_SIZE);
+            serial_puts("[smp] out of memory for ap stacks\n");
+            break;
+        }
+
+        uint32_t id = cpu_slots++;
+        cpu_locals[id].lapic_id = info->lapic_id;
+        cpu_locals[id].idle_stack = (void *)(phys_to_virt((uint64_t)stack) + AP_STACK_SIZE);
+        ist_stacks[id] = (uint8_t *)phys_to_virt((uint64_t)ist);
+
+        info->extra_argument = id;
+        // the parked ap jumps as soon as it sees the address
+        __atomic_store_n(&info->goto_address, ap_entry, __ATOMIC_RELEASE);
+    }
+
+    uint64_t timeout = tsc_frequency_hz / 1000 * AP_BOOT_TIMEOUT_MS;
+    while (__atomic_load_n(&cpus_online, __ATOMIC_ACQUIRE) < cpu_slots) {
+        if (timeout && rdtsc() - launch > timeout) break;
+        asm volatile("pause");
+    }
+    uint64_t total = rdtsc() - launch;
+
+    for (uint32_t id = 1; id < cpu_slots; id++) log_cpu(id, launch);
+
+    char buf[32];
+    serial_puts("[smp] ");
+    u64_to_dec(cpus_online, buf);
+    serial_puts(buf);
+    serial_puts(" cpus online, bring-up took ");
+    u64_to_dec(cycles_to_us(total), buf);
+    serial_puts(buf);
+    serial_puts(" us\n");
+
+    bool all = __atomic_load_n(&cpus_online, __ATOMIC_ACQUIRE) == cpu_slots;
+    if (!all) serial_puts("[smp] an ap did not check in, it may still be on limine's stack\n");
+    return all;
+}
+
+uint32_t smp_cpu_count(void) {
+    return cpus_online;
+}
+
+bool smp_cpu_online(uint32_t cpu) {
+    return cpu < cpu_slots && cpu_online[cpu];
+}
+
+void smp_kick(uint32_t cpu) {
+    uint32_t self = this_cpu_id();
+    if (!smp_cpu_online(cpu)) return;
+    if (cpu_locals[cpu].idle) {
+        if (cpu != self) lapic_send_ipi(cpu_locals[cpu].lapic_id, IPI_WAKE_VECTOR);
+        return;
+    }
+    // on ourselves from a syscall or irq: the timer goes off as soon as we are back in
+    // user mode, and from within the timer handler its own re-arm overrides this
+    if (cpu == self) apic_timer_fire_now();
+    else lapic_send_ipi(cpu_locals[cpu].lapic_id, IPI_RESCHED_VECTOR);
+
+    for (uint32_t id = 0; id < cpu_slots; id++) {
+        if (id == self || !cpu_online[id] || !cpu_locals[id].idle) continue;
+        lapic_send_ipi(cpu_locals[id].lapic_id, IPI_WAKE_VECTOR);
+        return;
+    }
+}
+
+static void tlb_poll(void) {
+    cpu_local_t *cpu = this_cpu();
+    if (!__atomic_load_n(&cpu->tlb_flush_pending, __ATOMIC_ACQUIRE)) return;
+    vmm_flush_tlb_local(shootdown_start, shootdown_end);
+    __atomic_store_n(&cpu->tlb_flush_pending, 0, __ATOMIC_RELEASE);
+}
+
+void smp_tlb_shootdown(uint64_t start, uint64_t end) {
+    if (cpus_online < 2) return;
+
+    uint64_t flags = irq_save();
+    // the holder may be waiting for our answer, so keep giving it while we wait
+    while (__atomic_exchange_n(&shootdown_lock.locked, 1, __ATOMIC_ACQUIRE)) {
+        tlb_poll();
+        asm volatile("pause");
+    }
+
+    shootdown_start = start;
+    shootdown_end = end;
+    uint32_t self = this_cpu_id();
+    for (uint32_t id = 0; id < cpu_slots; id++) {
+        if (id == self || !cpu_online[id]) continue;
+        __atomic_store_n(&cpu_locals[id].tlb_flush_pending, 1, __ATOMIC_RELEASE);
+        lapic_send_ipi(cpu_locals[id].lapic_id, IPI_TLB_VECTOR);
+    }
+    for (uint32_t id = 0; id < cpu_slots; id++) {
+        while (__atomic_load_n(&cpu_locals[id].tlb_flush_pending, __ATOMIC_ACQUIRE)) asm volatile("pause");
+    }
+
+    spin_unlock(&shootdown_lock);
+    irq_restore(flags);
+}
+
+void smp_tlb_handler(void) {
+    tlb_poll();
+    lapic_eoi();
+}
+
+bool smp_call(uint32_t cpu, void (*fn)(void *), void *arg) {
+    if (cpu >= cpu_slots || !cpu_online[cpu] || cpu_locals[cpu].work) return false;
+
+    cpu_locals[cpu].work_arg = arg;
+    __atomic_store_n(&cpu_locals[cpu].work, fn, __ATOMIC_RELEASE);
+    lapic_send_ipi(cpu_locals[cpu].lapic_id, IPI_WAKE_VECTOR);
+    return true;
+}
+
+bool smp_call_done(uint32_t cpu) {
+    return !__atomic_load_n(&cpu_locals[cpu].work, __ATOMIC_ACQUIRE);
+}
+
+void smp_run_work(void) {
+    cpu_local_t *cpu = this_cpu();
+    void (*fn)(void *) = __atomic_load_n(&cpu->work, __ATOMIC_ACQUIRE);
+    if (!fn) return;
+
+    fn(cpu->work_arg);
+    __atomic_store_n(&cpu->work, NULL, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,33 @@
+#ifndef ESTELLA_ARCH_X86_64_CPU_SMP_H
+#define ESTELLA_ARCH_X86_64_CPU_SMP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <limine.h>
+
+// start every ap limine reports and wait until they have left its stacks and page tables.
+// runs after vmm_relocate_boot_tables and before the bootloader memory is reclaimed.
+// false if a launched ap didn't check in before the timeout; it may still be using that memory
+bool smp_init(struct limine_mp_response *mp);
+// cpus online, the bsp included
+uint32_t smp_cpu_count(void);
+bool smp_cpu_online(uint32_t cpu);
+
+// have cpu look at its run queue now: out of hlt if it idles, otherwise through its timer
+// handler, which reschedules and re-arms the deadline. a busy cpu also gets an idle one
+// woken that can steal the work
+void smp_kick(uint32_t cpu);
+
+// drop [start, end) from the tlb of every other online cpu, returns once all of them have
+void smp_tlb_shootdown(uint64_t start, uint64_t end);
+void smp_tlb_handler(void);
+
+// have an idle cpu run fn(arg) from its idle loop; false if it is offline or still busy
+// with earlier work. one caller at a time
+bool smp_call(uint32_t cpu, void (*fn)(void *), void *arg);
+bool smp_call_done(uint32_t cpu);
+// the idle loop's side of smp_call
+void smp_run_work(void);
+
+#endif
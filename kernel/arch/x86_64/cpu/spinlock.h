@@ -0,0 +1,45 @@
+#ifndef ESTELLA_ARCH_X86_64_CPU_SPINLOCK_H
+#define ESTELLA_ARCH_X86_64_CPU_SPINLOCK_H
+
+#include <stdint.h>
+
+typedef struct {
+    volatile uint32_t locked;
+} spinlock_t;
+
+#define SPINLOCK_INIT { 0 }
+
+#define RFLAGS_IF (1ULL << 9)
+
+static inline uint64_t irq_save(void) {
+    uint64_t flags;
+    asm volatile("pushfq\n pop %0\n cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint64_t flags) {
+    if (flags & RFLAGS_IF) asm volatile("sti" : : : "memory");
+}
+
+static inline void spin_lock(spinlock_t *lock) {
+    while (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE)) {
+        while (lock->locked) asm volatile("pause");
+    }
+}
+
+static inline void spin_unlock(spinlock_t *lock) {
+    __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+}
+
+static inline uint64_t spin_lock_irqsave(spinlock_t *lock) {
+    uint64_t flags = irq_save();
+    spin_lock(lock);
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t *lock, uint64_t flags) {
+    spin_unlock(lock);
+    irq_restore(flags);
+}
+
+#endif
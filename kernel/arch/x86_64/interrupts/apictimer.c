@@ -3,22 +3,36 @@
 #include <arch/x86_64/time/tsc.h>
 #include <arch/x86_64/cpu/msr.h>
 #include <arch/x86_64/cpu/cpuid.h>
+#include <arch/x86_64/cpu/percpu.h>
 #include <drivers/serial.h>
 #include <arch/x86_64/usermode/scheduler.h>
 
-#define SCHED_QUANTUM 10
+static bool use_tsc_deadline;
 
-void lapic_timer_handler(void) {
-    if (x2apic_enabled) {
-        uint64_t next_deadline = rdtsc() + tsc_ticks_per_10ms;
-        wrmsr(IA32_TSC_DEADLINE, next_deadline);
-    }
+void lapic_timer_handler(bool from_user) {
     lapic_eoi();
-    lapic_ticks++;
 
-    if (lapic_ticks % SCHED_QUANTUM == 0) {
-        schedule();
+    cpu_local_t *cpu = this_cpu();
+    cpu->ticks++;
+    if (cpu->id == 0) lapic_ticks++;
+
+    scheduler_wake_sleepers();
+    // the idle loop is not a task to switch away from, it picks up what woke by itself
+    if (from_user) {
+        scheduler_tick();
+        if (cpu->need_resched) schedule();
     }
+    apic_timer_rearm();
+}
+
+void apic_timer_rearm(void) {
+    if (!use_tsc_deadline) return;
+    // 0 disarms, a deadline already behind us fires right away
+    wrmsr(IA32_TSC_DEADLINE, scheduler_next_event());
+}
+
+void apic_timer_fire_now(void) {
+    if (use_tsc_deadline) wrmsr(IA32_TSC_DEADLINE, 1);
 }
 
 void apic_timer_init(void) {
@@ -27,23 +41,27 @@ void apic_timer_init(void) {
 
     bool tsc_deadline_supported = (ecx & (1U << 24)) != 0;
     bool tsc_invariant = tsc_is_invariant();
-    bool use_tsc_deadline = tsc_deadline_supported && (tsc_frequency_hz != 0) && tsc_invariant;
+    use_tsc_deadline = tsc_deadline_supported && (tsc_frequency_hz != 0) && tsc_invariant;
 
-    if (use_tsc_deadline) {
-        serial_puts("Using TSC-deadline timer\n");
+    if (use_tsc_deadline) serial_puts("Using TSC-deadline timer, tickless\n");
+    else serial_puts("Using periodic LAPIC timer\n");
 
+    apic_timer_init_ap();
+    serial_puts("LAPIC timer initialized\n");
+}
+
+void apic_timer_init_ap(void) {
+    if (use_tsc_deadline) {
         lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_VECTOR | LAPIC_LVT_TIMER_TSC_DEADLINE);
 
+        // one-shot from here on, the first interrupt arms it for whatever comes next
         wrmsr(IA32_TSC_DEADLINE, 0);
         wrmsr(IA32_TSC_DEADLINE, rdtsc() + tsc_ticks_per_10ms);
     } else {
-        serial_puts("Using periodic LAPIC timer\n");
-
         lapic_write(LAPIC_TIMER_DCR, 0b0011);
         lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_VECTOR | LAPIC_MODE_PERIODIC);
         lapic_write(LAPIC_TIMER_INIT, 1000000);
     }
 
     lapic_write(LAPIC_LVT_ERROR, LAPIC_ERROR_VECTOR);
-    serial_puts("LAPIC timer initialized\n");
-}
\ No newline at end of file
+}
@@ -7,6 +7,15 @@
 extern volatile bool lapic_timer_needed;
 
 void apic_timer_init(void);
-void lapic_timer_handler(void);
+// same mode as the bsp, started on the calling cpu
+void apic_timer_init_ap(void);
+// also taken for IPI_RESCHED_VECTOR: wakes due sleepers, reschedules if the interrupt
+// came from user mode, and arms the timer for the next event
+void lapic_timer_handler(bool from_user);
+// in tsc-deadline mode the timer is one-shot, set to scheduler_next_event() or off. the
+// periodic fallback keeps ticking and ignores both
+void apic_timer_rearm(void);
+// have the timer go off once interrupts are on; the handler arms it for the real event
+void apic_timer_fire_now(void);
 
 #endif
\ No newline at end of file
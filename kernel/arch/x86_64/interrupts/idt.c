@@ -3,6 +3,8 @@
 #include <klib/memory.h>
 #include <drivers/fbtext.h>
 #include <drivers/serial.h>
+#include <arch/x86_64/mm/fault.h>
+#include <arch/x86_64/interrupts/lapic.h>
 
 #define IDT_ENTRIES 256
 #define IDT_INTERRUPT 0x8E
@@ -17,9 +19,18 @@ extern void isr0(void), isr1(void), isr2(void), isr3(void), isr4(void), isr5(voi
 extern void lapic_timer_isr(void);
 extern void lapic_error_isr(void);
 extern void keyboard_isr(void);
+extern void ipi_wake_isr(void);
+extern void ipi_tlb_isr(void);
+extern void ipi_resched_isr(void);
 
 void exception_handler(uint64_t vector, uint64_t error_code, uint64_t rip, uint64_t cs,
                        uint64_t rflags, uint64_t rsp, uint64_t ss) {
+    if (vector == 14) {
+        uint64_t cr2;
+        asm volatile("mov %%cr2, %0" : "=r"(cr2));
+        if (handle_page_fault(cr2, error_code)) return;
+    }
+
     fb_print("KERNEL PANIC!\n", 0xFF5555);
     serial_puts("KERNEL PANIC!\n");
 
@@ -191,12 +202,20 @@ void idt_init(void) {
     
     idt_set_gate(0x20, lapic_timer_isr, 0);
     idt_set_gate(0x21, keyboard_isr, 0);
+    idt_set_gate(IPI_WAKE_VECTOR, ipi_wake_isr, 0);
+    idt_set_gate(IPI_TLB_VECTOR, ipi_tlb_isr, 0);
+    idt_set_gate(IPI_RESCHED_VECTOR, ipi_resched_isr, 0);
     idt_set_gate(0xFE, lapic_error_isr, 0);
 
     idtr.limit = sizeof(idt) - 1;
     idtr.base  = (uint64_t)&idt;
 
-    asm volatile ("lidt %0" : : "m"(idtr));
+    idt_load();
 
     serial_puts("IDT initialized\n");
+}
+
+// the table is shared, every cpu just points its idtr at it
+void idt_load(void) {
+    asm volatile ("lidt %0" : : "m"(idtr));
 }
\ No newline at end of file
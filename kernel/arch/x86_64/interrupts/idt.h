@@ -19,5 +19,6 @@ struct idtr {
 } __attribute__((packed));
 
 void idt_init(void);
+void idt_load(void);
 
 #endif
\ No newline at end of file
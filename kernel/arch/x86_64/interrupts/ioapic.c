@@ -1,10 +1,9 @@
 #include <arch/x86_64/interrupts/ioapic.h>
 #include <arch/x86_64/acpi/acpi.h>
 #include <arch/x86_64/mm/vmm.h>
+#include <mm/vmalloc.h>
 #include <drivers/serial.h>
 
-extern uint64_t hhdm_offset;
-
 ioapic_t ioapics[8];
 size_t ioapic_count = 0;
 
@@ -37,9 +36,11 @@ static void ioapic_init_one(struct madt_ioapic* entry) {
     }
 
     uint64_t phys = entry->ioapic_address;
-    uint64_t virt = phys + hhdm_offset;
-
-    vmm_map(virt, phys, PTE_PRESENT | PTE_WRITE | PTE_PCD | PTE_PWT);
+    uint64_t virt = (uint64_t)ioremap(phys, PAGE_SIZE, IOREMAP_UC);
+    if (!virt) {
+        serial_puts("IOAPIC: ioremap failed\n");
+        return;
+    }
 
     ioapic_t* io = &ioapics[ioapic_count++];
 
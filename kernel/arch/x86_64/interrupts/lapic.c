@@ -3,12 +3,13 @@
 #include <arch/x86_64/cpu/msr.h>
 #include <arch/x86_64/cpu/cpuid.h>
 #include <arch/x86_64/mm/vmm.h>
+#include <arch/x86_64/cpu/percpu.h>
+#include <mm/vmalloc.h>
 #include <drivers/serial.h>
 
 #include <limine.h>
 
 extern volatile struct limine_rsdp_request rsdp_request;
-extern uint64_t hhdm_offset;
 
 volatile uint64_t lapic_ticks = 0;
 uint64_t lapic_phys = 0;
@@ -47,9 +48,11 @@ void lapic_init(void) {
     }
 
     lapic_phys = madt->lapic_address;
-    lapic_va = lapic_phys + hhdm_offset;
-
-    vmm_map(lapic_va, lapic_phys, PTE_KERNEL_RW | PTE_PCD | PTE_PWT);
+    lapic_va = (uint64_t)ioremap(lapic_phys, PAGE_SIZE, IOREMAP_UC);
+    if (!lapic_va) {
+        serial_puts("LAPIC: ioremap failed\n");
+        return;
+    }
 
     uint32_t eax, ebx, ecx, edx;
     cpuid(1, &eax, &ebx, &ecx, &edx);
@@ -58,11 +61,6 @@ void lapic_init(void) {
 
     if (x2apic_supported) {
         serial_puts("x2APIC supported\n");
-
-        uint64_t apic_base = rdmsr(IA32_APIC_BASE_MSR);
-        apic_base |= IA32_APIC_BASE_ENABLE | IA32_APIC_BASE_X2APIC;
-        wrmsr(IA32_APIC_BASE_MSR, apic_base);
-
         x2apic_enabled = true;
     } else {
         serial_puts("x2APIC not supported\n");
@@ -70,6 +68,19 @@ void lapic_init(void) {
         return;
     }
 
+    lapic_init_ap();
+    serial_puts("LAPIC initialized\n");
+}
+
+void lapic_init_ap(void) {
+    if (!x2apic_enabled) return;
+
+    uint64_t apic_base = rdmsr(IA32_APIC_BASE_MSR);
+    apic_base |= IA32_APIC_BASE_ENABLE | IA32_APIC_BASE_X2APIC;
+    wrmsr(IA32_APIC_BASE_MSR, apic_base);
+
+    this_cpu()->lapic_id = lapic_read(LAPIC_ID);
+
     lapic_write(LAPIC_ESR, 0);
     lapic_write(LAPIC_TPR, 0);
     lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
@@ -78,6 +89,15 @@ void lapic_init(void) {
     lapic_write(LAPIC_LVT_LINT0, LAPIC_MASKED);
     lapic_write(LAPIC_LVT_LINT1, LAPIC_MASKED);
     lapic_write(LAPIC_LVT_ERROR, LAPIC_MASKED | LAPIC_ERROR_VECTOR);
-    
-    serial_puts("LAPIC initialized\n");
+}
+
+// fixed delivery, physical destination
+void lapic_send_ipi(uint32_t lapic_id, uint8_t vector) {
+    if (x2apic_enabled) {
+        // one 64-bit write, the destination sits in the high half
+        wrmsr(IA32_X2APIC_ICR, ((uint64_t)lapic_id << 32) | vector);
+        return;
+    }
+    lapic_write(LAPIC_ICR_HIGH, lapic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, vector);
 }
\ No newline at end of file
@@ -4,10 +4,13 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#define LAPIC_ID 0x020
 #define LAPIC_TPR 0x080
 #define LAPIC_EOI 0x0B0
 #define LAPIC_SVR 0x0F0
 #define LAPIC_ESR 0x280
+#define LAPIC_ICR_LOW 0x300
+#define LAPIC_ICR_HIGH 0x310
 #define LAPIC_LVT_TIMER 0x320
 #define LAPIC_LVT_THERMAL 0x330
 #define LAPIC_LVT_PERF 0x340
@@ -25,6 +28,9 @@
 #define LAPIC_LVT_TIMER_TSC_DEADLINE (1U << 18)
 
 #define LAPIC_TIMER_VECTOR 0x20
+#define IPI_WAKE_VECTOR 0xF0    // get an idle cpu out of hlt
+#define IPI_TLB_VECTOR 0xF1     // kernel tlb shootdown
+#define IPI_RESCHED_VECTOR 0xF2 // a busy cpu has new work queued, runs the timer handler
 #define LAPIC_ERROR_VECTOR 0xFE
 #define LAPIC_SPURIOUS_VECTOR 0xFF
 
@@ -32,6 +38,7 @@
 #define IA32_APIC_BASE_ENABLE (1U << 11)
 #define IA32_APIC_BASE_X2APIC (1U << 10)
 #define IA32_TSC_DEADLINE 0x6E0
+#define IA32_X2APIC_ICR 0x830
 
 extern volatile uint64_t lapic_ticks;
 extern uint64_t lapic_phys;
@@ -42,6 +49,9 @@ uint32_t lapic_read(uint32_t reg);
 void lapic_write(uint32_t reg, uint32_t value);
 
 void lapic_init(void);
+// the calling cpu's own lapic, with the mode lapic_init picked on the bsp
+void lapic_init_ap(void);
 void lapic_eoi(void);
+void lapic_send_ipi(uint32_t lapic_id, uint8_t vector);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,91 @@
+#include <arch/x86_64/mm/fault.h>
+#include <arch/x86_64/mm/vmm.h>
+#include <arch/x86_64/usermode/scheduler.h>
+#include <mm/pmm.h>
+#include <mm/page.h>
+#include <mm/vma.h>
+#include <arch/x86_64/usermode/elf_image.h>
+#include <klib/memory.h>
+
+#define USER_SPACE_END 0x0000800000000000ULL
+
+static uint64_t vma_pte_flags(const struct vma *vma) {
+    uint64_t flags = PTE_PRESENT | PTE_USER;
+    if (vma->prot & VMA_WRITE) flags |= PTE_WRITE;
+    if (!(vma->prot & VMA_EXEC)) flags |= PTE_NX;
+    return flags;
+}
+
+// the part of page that comes from the file, [*from, *to); empty for anonymous memory
+static void file_span(const struct vma *vma, uint64_t page, uint64_t *from, uint64_t *to) {
+    *from = *to = page;
+    if (!vma->file) return;
+    *from = page > vma->file_start ? page : vma->file_start;
+    *to = page + PAGE_SIZE;
+    if (*to > vma->file_start + vma->file_size) *to = vma->file_start + vma->file_size;
+    if (*to < *from) *to = *from;
+}
+
+void *fault_read_page(const struct vma *vma, uint64_t page) {
+    uint64_t from, to;
+    file_span(vma, page, &from, &to);
+
+    // a page entirely covered by the file needs no zeroing
+    void *frame = (to - from == PAGE_SIZE) ? pmm_alloc() : pmm_alloc_zeroed();
+    if (!frame) return NULL;
+
+    uint64_t src = (uint64_t)vma->file + (from - vma->file_start);
+    if (to > from) memcpy((void *)(phys_to_virt((uint64_t)frame) + (from - page)), (void *)src, to - from);
+
+    phys_to_page((uint64_t)frame)->flags |= PG_USER;
+    return frame;
+}
+
+static bool fill_page(const struct vma *vma, uint64_t *pml4, uint64_t page) {
+    uint64_t from, to;
+    file_span(vma, page, &from, &to);
+
+    // a read-only page the file fills completely can be the initrd frame itself,
+    // if the file data happens to be page aligned. the frame isn't PG_USER, so
+    // fork and teardown leave it alone
+    uint64_t src = (uint64_t)vma->file + (from - vma->file_start);
+    if (to - from == PAGE_SIZE && !(vma->prot & VMA_WRITE) && !(src & (PAGE_SIZE - 1))) {
+        return vmm_map_for_pml4(pml4, page, virt_to_phys(src), vma_pte_flags(vma));
+    }
+
+    // otherwise read-only program pages come from the image every instance shares
+    elf_image_t *image = current_task->mm->image;
+    if (image && vma->file && !(vma->prot & VMA_WRITE)) {
+        uint64_t shared = elf_image_page(image, vma, page);
+        if (shared) {
+            if (vmm_map_for_pml4(pml4, page, shared, vma_pte_flags(vma))) return true;
+            page_put(phys_to_page(shared));
+            return false;
+        }
+    }
+
+    void *frame = fault_read_page(vma, page);
+    if (!frame) return false;
+    if (!vmm_map_for_pml4(pml4, page, (uint64_t)frame, vma_pte_flags(vma))) {
+        pmm_free(frame);
+        return false;
+    }
+    return true;
+}
+
+bool handle_page_fault(uint64_t addr, uint64_t error_code) {
+    if (addr >= USER_SPACE_END || !current_task || !current_task->mm) return false;
+
+    struct vma *vma = mm_find(current_task->mm, addr);
+    if (!vma) return false;
+    if ((error_code & PF_ERR_WRITE) && !(vma->prot & VMA_WRITE)) return false;
+    if ((error_code & PF_ERR_FETCH) && !(vma->prot & VMA_EXEC)) return false;
+
+    uint64_t *pml4 = (uint64_t *)phys_to_virt((uint64_t)current_task->pml4_phys);
+
+    // a write to a present page is only legal if fork left it copy-on-write
+    if (error_code & PF_ERR_PRESENT) {
+        return (error_code & PF_ERR_WRITE) && vmm_resolve_cow(pml4, addr);
+    }
+    return fill_page(vma, pml4, addr & ~(PAGE_SIZE - 1));
+}
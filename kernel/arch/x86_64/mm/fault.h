@@ -0,0 +1,20 @@
+#ifndef ESTELLA_ARCH_X86_64_MM_FAULT_H
+#define ESTELLA_ARCH_X86_64_MM_FAULT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define PF_ERR_PRESENT (1 << 0)
+#define PF_ERR_WRITE   (1 << 1)
+#define PF_ERR_USER    (1 << 2)
+#define PF_ERR_FETCH   (1 << 4)
+
+// true if the fault was a first touch of a current_task vma or a write to a
+// copy-on-write page, and the access can now be retried
+bool handle_page_fault(uint64_t addr, uint64_t error_code);
+
+struct vma;
+// a fresh PG_USER frame holding what page of vma starts out as
+void *fault_read_page(const struct vma *vma, uint64_t page);
+
+#endif
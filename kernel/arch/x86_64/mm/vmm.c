@@ -2,6 +2,12 @@
 #include <klib/memory.h>
 #include <drivers/serial.h>
 #include <klib/string.h>
+#include <arch/x86_64/cpu/cpuid.h>
+#include <mm/page.h>
+#include <arch/x86_64/cpu/spinlock.h>
+#include <arch/x86_64/cpu/msr.h>
+#include <arch/x86_64/cpu/percpu.h>
+#include <arch/x86_64/cpu/smp.h>
 
 #define PML4_SHIFT 39
 #define PDP_SHIFT 30
@@ -20,11 +26,58 @@
 
 #define PAGE_OFFSET(v) ((v) & 0xFFF)
 
+#define CR4_PGE (1ULL << 7)
+#define CR0_WP  (1ULL << 16)
+#define CR4_PCIDE (1ULL << 17)
+#define CR3_NOFLUSH (1ULL << 63)
+
+#define IA32_PAT 0x277
+// PA0..PA7 = WB, WT, UC-, UC, WP, WC, UC-, UC
+#define PAT_LAYOUT 0x0007010500070406ULL
+
+#define KERNEL_HALF_START 0xFFFF800000000000ULL
+
+#define INVPCID_ALL 2
+
+// pcid 0 is the kernel's and the fallback once the pool runs dry; it is flushed on every load
+#define ASID_COUNT 4096
+#define ASID_NO_CPU 0xFF
+
 static inline void invlpg(uint64_t addr) {
     asm volatile("invlpg (%0)" ::"r"(addr) : "memory");
 }
 
+static inline void invpcid(uint64_t type, uint64_t pcid) {
+    struct { uint64_t pcid, addr; } desc = { pcid, 0 };
+    asm volatile("invpcid %0, %1" :: "m"(desc), "r"(type) : "memory");
+}
+
+// a present kernel entry went away: every cpu may have it cached, the kernel half is shared
+static void flush_kernel_page(uint64_t virt) {
+    invlpg(virt);
+    smp_tlb_shootdown(virt, virt + PAGE_SIZE);
+}
+
 uint64_t kernel_pml4_phys = 0;
+static bool has_1gb_pages = false;
+static bool has_pcid = false;
+static bool has_invpcid = false;
+static bool has_pat = false;
+
+static spinlock_t asid_lock = SPINLOCK_INIT;
+static uint64_t asid_used[ASID_COUNT / 64];
+// the cpu that last loaded each asid. only that cpu's tlb is known to match the tables, and
+// only until they change while not loaded, which resets it to ASID_NO_CPU
+static uint8_t asid_cpu[ASID_COUNT];
+static size_t asid_hint = 1;
+
+static uint64_t thp_collapsed;
+static uint64_t thp_split;
+
+// the kernel half is the same in every address space, so its entries can survive cr3 loads
+static inline uint64_t kernel_global(uint64_t virt, uint64_t flags) {
+    return virt >= KERNEL_HALF_START ? flags | PTE_GLOBAL : flags;
+}
 
 static uint64_t *get_pml4e(uint64_t *pml4, uint64_t virt) {
     return &pml4[PML4_INDEX(virt)];
@@ -41,6 +94,7 @@ static uint64_t *get_pdpe(uint64_t *pml4, uint64_t virt) {
 static uint64_t *get_pde(uint64_t *pml4, uint64_t virt) {
     uint64_t *pdpe = get_pdpe(pml4, virt);
     if (!pdpe || !(*pdpe & PTE_PRESENT)) return NULL;
+    if (*pdpe & PTE_HUGE) return NULL;
     uint64_t pd_phys = *pdpe & ~0xFFFULL;
     uint64_t *pd = (uint64_t *)phys_to_virt(pd_phys);
     return &pd[PD_INDEX(virt)];
@@ -56,9 +110,49 @@ static uint64_t *get_pte(uint64_t *pml4, uint64_t virt) {
     return &pt[PT_INDEX(virt)];
 }
 
+// last entry a walk reaches: a 4K pte, a huge pde/pdpe, or the first non-present level.
+// *size is the span of memory that entry covers
+static uint64_t *walk_leaf(uint64_t *pml4, uint64_t virt, uint64_t *size) {
+    uint64_t *entry = get_pml4e(pml4, virt);
+    *size = 1ULL << PML4_SHIFT;
+    if (!(*entry & PTE_PRESENT)) return entry;
+
+    uint64_t *table = (uint64_t *)phys_to_virt(*entry & PTE_ADDR_MASK);
+    entry = &table[PDP_INDEX(virt)];
+    *size = HUGE_1GB;
+    if (!(*entry & PTE_PRESENT) || (*entry & PTE_HUGE)) return entry;
+
+    table = (uint64_t *)phys_to_virt(*entry & PTE_ADDR_MASK);
+    entry = &table[PD_INDEX(virt)];
+    *size = HUGE_2MB;
+    if (!(*entry & PTE_PRESENT) || (*entry & PTE_HUGE)) return entry;
+
+    table = (uint64_t *)phys_to_virt(*entry & PTE_ADDR_MASK);
+    *size = PAGE_SIZE;
+    return &table[PT_INDEX(virt)];
+}
+
+static uint64_t leaf_size(int level) {
+    return level == 1 ? PAGE_SIZE : level == 2 ? HUGE_2MB : HUGE_1GB;
+}
+
+// a leaf's bits other than the frame address, minus accessed/dirty
+static uint64_t leaf_attrs(uint64_t entry, uint64_t size) {
+    return entry & ~(PTE_ADDR_MASK & ~(size - 1)) & ~(PTE_ACCESSED | PTE_DIRTY);
+}
+
+static void *alloc_table(void) {
+    void *table = pmm_alloc_zeroed();
+    if (table) phys_to_page((uint64_t)table)->flags |= PG_PAGETABLE;
+    return table;
+}
+
 static bool create_table(uint64_t *entry, uint64_t flags) {
-    if (*entry & PTE_PRESENT) return true;
-    void *new_table = pmm_alloc_zeroed();
+    if (*entry & PTE_PRESENT) {
+        // a huge leaf already covers this range
+        return !(*entry & PTE_HUGE);
+    }
+    void *new_table = alloc_table();
     if (!new_table) {
         serial_puts("create_table: failed to alloc page table");
         return false;
@@ -68,6 +162,43 @@ static bool create_table(uint64_t *entry, uint64_t flags) {
     return true;
 }
 
+// replace the huge leaf at entry (2 MiB at level 2, 1 GiB at level 3) with a table of the
+// next smaller pages mapping the same memory the same way
+static bool split_leaf(uint64_t *entry, int level, uint64_t virt) {
+    uint64_t old = *entry;
+    uint64_t size = leaf_size(level), child = leaf_size(level - 1);
+    uint64_t phys = old & PTE_ADDR_MASK & ~(size - 1);
+    uint64_t attrs = leaf_attrs(old, size) | (old & (PTE_ACCESSED | PTE_DIRTY));
+
+    // 4 KiB entries have PAT where huge ones have PS
+    if (level == 2) {
+        bool pat = attrs & PTE_PAT_HUGE;
+        attrs &= ~(PTE_PAT_HUGE | PTE_HUGE);
+        if (pat) attrs |= PTE_PAT;
+    }
+
+    void *table_phys = alloc_table();
+    if (!table_phys) return false;
+    uint64_t *table = (uint64_t *)phys_to_virt((uint64_t)table_phys);
+    for (int i = 0; i < 512; i++) table[i] = (phys + i * child) | attrs;
+
+    *entry = (uint64_t)table_phys | PTE_PRESENT | PTE_WRITE | (old & PTE_USER);
+    // the page size changed, the old large entry must not linger next to the new ones
+    invlpg(virt & ~(size - 1));
+    return true;
+}
+
+// the leaf covering virt, with huge leaves bigger than max_size split until it fits.
+// *size is what the returned entry covers; NULL if a split ran out of memory
+static uint64_t *leaf_at_most(uint64_t *pml4, uint64_t virt, uint64_t max_size, uint64_t *size) {
+    uint64_t *leaf = walk_leaf(pml4, virt, size);
+    while ((*leaf & PTE_PRESENT) && *size > max_size && *size <= HUGE_1GB) {
+        if (!split_leaf(leaf, *size == HUGE_1GB ? 3 : 2, virt)) return NULL;
+        leaf = walk_leaf(pml4, virt, size);
+    }
+    return leaf;
+}
+
 bool vmm_map(uint64_t virt, uint64_t phys, uint64_t flags) {
     if (virt & 0xFFF || phys & 0xFFF) return false;
 
@@ -90,7 +221,7 @@ bool vmm_map(uint64_t virt, uint64_t phys, uint64_t flags) {
         return false;
     }
 
-    *pte = phys | (flags & ~(PTE_PRESENT)) | PTE_PRESENT;
+    *pte = phys | kernel_global(virt, flags & ~(PTE_PRESENT)) | PTE_PRESENT;
     invlpg(virt);
     return true;
 }
@@ -114,29 +245,178 @@ bool vmm_map_huge_2mb(uint64_t virt, uint64_t phys, uint64_t flags) {
         return false;
     }
 
-    *pde = phys | (flags & ~(PTE_PRESENT|PTE_HUGE)) | PTE_PRESENT | PTE_HUGE;
+    *pde = phys | kernel_global(virt, pte_cache_huge(flags & ~PTE_PRESENT)) | PTE_PRESENT | PTE_HUGE;
     invlpg(virt);
     return true;
 }
 
-bool vmm_map_range(uint64_t virt, uint64_t phys, size_t count, uint64_t flags) {
-    for (size_t i = 0; i < count; i++) {
-        if (!vmm_map(virt + i * PAGE_SIZE, phys + i * PAGE_SIZE, flags)) {
-            return false;
+bool vmm_map_huge_1gb(uint64_t virt, uint64_t phys, uint64_t flags) {
+    if (!has_1gb_pages) return false;
+    if (virt & (HUGE_1GB-1) || phys & (HUGE_1GB-1)) return false;
+
+    uint64_t *pml4 = (uint64_t *)phys_to_virt(kernel_pml4_phys);
+
+    uint64_t *pml4e = get_pml4e(pml4, virt);
+    if (!create_table(pml4e, PTE_WRITE)) return false;
+
+    uint64_t *pdpe = get_pdpe(pml4, virt);
+    if (!pdpe) return false;
+
+    if (*pdpe & PTE_PRESENT) {
+        serial_puts("vmm_map_huge_1gb: already mapped\n");
+        return false;
+    }
+
+    *pdpe = phys | kernel_global(virt, pte_cache_huge(flags & ~PTE_PRESENT)) | PTE_PRESENT | PTE_HUGE;
+    invlpg(virt);
+    return true;
+}
+
+// map [virt, virt + count pages) with the largest entries alignment allows.
+// table_flags go on newly created intermediate tables
+static bool map_range_huge(uint64_t *pml4, uint64_t virt, uint64_t phys, size_t count,
+                           uint64_t flags, uint64_t table_flags) {
+    if (virt & 0xFFF || phys & 0xFFF) return false;
+
+    // bit 7 of flags is PAT here, it moves to bit 12 in huge leaves
+    uint64_t leaf_flags = flags | PTE_PRESENT;
+    uint64_t huge_flags = pte_cache_huge(leaf_flags) | PTE_HUGE;
+    uint64_t end = virt + count * PAGE_SIZE;
+
+    while (virt < end) {
+        uint64_t left = end - virt;
+        bool fits_1gb = has_1gb_pages && left >= HUGE_1GB && !((virt | phys) & (HUGE_1GB-1));
+        bool fits_2mb = left >= HUGE_2MB && !((virt | phys) & (HUGE_2MB-1));
+        uint64_t step;
+
+        if (!create_table(get_pml4e(pml4, virt), table_flags)) return false;
+        uint64_t *pdpe = get_pdpe(pml4, virt);
+
+        if (fits_1gb && !(*pdpe & PTE_PRESENT)) {
+            *pdpe = phys | huge_flags;
+            step = HUGE_1GB;
+        } else {
+            if (!create_table(pdpe, table_flags)) return false;
+            uint64_t *pde = get_pde(pml4, virt);
+
+            if (fits_2mb && !(*pde & PTE_PRESENT)) {
+                *pde = phys | huge_flags;
+                step = HUGE_2MB;
+            } else {
+                if (!create_table(pde, table_flags)) return false;
+                uint64_t *pte = get_pte(pml4, virt);
+                if (*pte & PTE_PRESENT) {
+                    serial_puts("vmm_map_range_huge: already mapped\n");
+                    return false;
+                }
+                *pte = phys | leaf_flags;
+                step = PAGE_SIZE;
+            }
+        }
+
+        invlpg(virt);
+        virt += step;
+        phys += step;
+    }
+    return true;
+}
+
+bool vmm_map_range_huge(uint64_t virt, uint64_t phys, size_t count, uint64_t flags) {
+    uint64_t *pml4 = (uint64_t *)phys_to_virt(kernel_pml4_phys);
+    return map_range_huge(pml4, virt, phys, count, kernel_global(virt, flags), PTE_WRITE);
+}
+
+// the pte for virt out of the cursor's page table, walking from the root only when
+// virt is in another 2 MiB region. NULL if there is no page table there (create
+// builds the missing ones) or a huge page covers virt
+static uint64_t *batch_pte(vmm_batch_t *batch, uint64_t virt, bool create) {
+    uint64_t base = virt & ~(HUGE_2MB - 1);
+    if (batch->pt && batch->pt_base == base) return &batch->pt[PT_INDEX(virt)];
+
+    batch->pt = NULL;
+    batch->walks++;
+
+    uint64_t *table = batch->pml4;
+    for (int shift = PML4_SHIFT; shift > PT_SHIFT; shift -= 9) {
+        uint64_t *entry = &table[(virt >> shift) & 0x1FF];
+        if (!(*entry & PTE_PRESENT)) {
+            if (!create || !create_table(entry, batch->table_flags)) return NULL;
+        } else if (*entry & PTE_HUGE) {
+            return NULL;
         }
+        table = (uint64_t *)phys_to_virt(*entry & PTE_ADDR_MASK);
+    }
+
+    batch->pt = table;
+    batch->pt_base = base;
+    return &table[PT_INDEX(virt)];
+}
+
+static void batch_queue_flush(vmm_batch_t *batch, uint64_t virt) {
+    if (batch->flush_all) return;
+    if (batch->pending_count == TLB_FLUSH_ALL_THRESHOLD) {
+        batch->flush_all = true;
+        return;
     }
+    batch->pending[batch->pending_count++] = virt;
+}
+
+void vmm_batch_begin(vmm_batch_t *batch, uint64_t *pml4) {
+    bool kernel = !pml4;
+    batch->pml4 = kernel ? (uint64_t *)phys_to_virt(kernel_pml4_phys) : pml4;
+    batch->table_flags = kernel ? PTE_WRITE : PTE_WRITE | PTE_USER;
+    batch->pt = NULL;
+    batch->pt_base = 0;
+    batch->pending_count = 0;
+    batch->flush_all = false;
+    batch->walks = 0;
+}
+
+bool vmm_batch_map(vmm_batch_t *batch, uint64_t virt, uint64_t phys, uint64_t flags) {
+    if (virt & 0xFFF || phys & 0xFFF) return false;
+
+    uint64_t *pte = batch_pte(batch, virt, true);
+    if (!pte || (*pte & PTE_PRESENT)) return false;
+
+    // a not-present entry is never cached, so filling one needs no invalidation
+    *pte = phys | kernel_global(virt, flags & ~PTE_PRESENT) | PTE_PRESENT;
     return true;
 }
 
+uint64_t vmm_batch_unmap(vmm_batch_t *batch, uint64_t virt) {
+    uint64_t *pte = batch_pte(batch, virt, false);
+    if (!pte || !(*pte & PTE_PRESENT)) return 0;
+
+    uint64_t old = *pte;
+    *pte = 0;
+    batch_queue_flush(batch, virt);
+    return old;
+}
+
+bool vmm_map_range(uint64_t virt, uint64_t phys, size_t count, uint64_t flags) {
+    if (virt & 0xFFF || phys & 0xFFF) return false;
+
+    vmm_batch_t batch;
+    vmm_batch_begin(&batch, NULL);
+    bool ok = true;
+    for (size_t i = 0; i < count && ok; i++) {
+        ok = vmm_batch_map(&batch, virt + i * PAGE_SIZE, phys + i * PAGE_SIZE, flags);
+    }
+    vmm_batch_end(&batch);
+    if (!ok) serial_puts("vmm_map_range: already mapped or out of memory\n");
+    return ok;
+}
+
 bool vmm_unmap(uint64_t virt) {
     if (virt & 0xFFF) return false;
 
     uint64_t *pml4 = (uint64_t *)phys_to_virt(kernel_pml4_phys);
-    uint64_t *pte = get_pte(pml4, virt);
-    if (!pte || !(*pte & PTE_PRESENT)) return false;
+    uint64_t size;
+    uint64_t *pte = leaf_at_most(pml4, virt, PAGE_SIZE, &size);
+    if (!pte || !(*pte & PTE_PRESENT) || size != PAGE_SIZE) return false;
 
     *pte = 0;
-    invlpg(virt);
+    flush_kernel_page(virt);
     return true;
 }
 
@@ -144,39 +424,166 @@ bool vmm_unmap_huge_2mb(uint64_t virt) {
     if (virt & (HUGE_2MB-1)) return false;
 
     uint64_t *pml4 = (uint64_t *)phys_to_virt(kernel_pml4_phys);
-    uint64_t *pde = get_pde(pml4, virt);
-    if (!pde || !(*pde & PTE_PRESENT)) return false;
+    uint64_t size;
+    uint64_t *pde = leaf_at_most(pml4, virt, HUGE_2MB, &size);
+    if (!pde || !(*pde & PTE_PRESENT) || size != HUGE_2MB) return false;
 
     *pde = 0;
-    invlpg(virt);
+    flush_kernel_page(virt);
     return true;
 }
 
-bool vmm_unmap_range(uint64_t virt, size_t count) {
-    for (size_t i = 0; i < count; i++) {
-        vmm_unmap(virt + i * PAGE_SIZE);
+bool vmm_unmap_huge_1gb(uint64_t virt) {
+    if (virt & (HUGE_1GB-1)) return false;
+
+    uint64_t *pml4 = (uint64_t *)phys_to_virt(kernel_pml4_phys);
+    uint64_t *pdpe = get_pdpe(pml4, virt);
+    if (!pdpe || !(*pdpe & PTE_PRESENT) || !(*pdpe & PTE_HUGE)) return false;
+
+    *pdpe = 0;
+    flush_kernel_page(virt);
+    return true;
+}
+
+// huge entries the range only partly covers are split first
+bool vmm_unmap_range_noflush(uint64_t virt, size_t count) {
+    uint64_t end = virt + count * PAGE_SIZE;
+
+    vmm_batch_t batch;
+    vmm_batch_begin(&batch, NULL);
+    uint64_t *pml4 = batch.pml4;
+
+    while (virt < end) {
+        // stays on the cursor's page table while there is one
+        uint64_t *pte = batch_pte(&batch, virt, false);
+        if (pte) {
+            *pte = 0;
+            virt += PAGE_SIZE;
+            continue;
+        }
+
+        uint64_t size;
+        uint64_t *leaf = walk_leaf(pml4, virt, &size);
+
+        if (*leaf & PTE_PRESENT) {
+            if (size > PAGE_SIZE && ((virt & (size-1)) || end - virt < size)) {
+                if (!leaf_at_most(pml4, virt, size / 512, &size)) {
+                    serial_puts("vmm_unmap_range: out of memory splitting a huge page\n");
+                    return false;
+                }
+                continue;
+            }
+            *leaf = 0;
+        }
+        virt = (virt & ~(size-1)) + size;
     }
     return true;
 }
 
-uint64_t vmm_get_physical(uint64_t virt) {
-    uint64_t *pml4 = (uint64_t *)phys_to_virt(kernel_pml4_phys);
-    uint64_t *pte = get_pte(pml4, virt);
-    if (!pte || !(*pte & PTE_PRESENT)) return 0;
+bool vmm_unmap_range(uint64_t virt, size_t count) {
+    bool ok = vmm_unmap_range_noflush(virt, count);
+    vmm_flush_tlb_range(virt, virt + count * PAGE_SIZE);
+    return ok;
+}
 
-    if (*pte & PTE_HUGE) {
-        uint64_t page_phys = *pte & ~(HUGE_2MB-1);
-        return page_phys + (virt & (HUGE_2MB-1));
+static void flush_tlb_local_all(void) {
+    uint64_t flags;
+    asm volatile("pushfq; pop %0; cli" : "=r"(flags) :: "memory");
+
+    uint64_t cr4;
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+    if (has_invpcid) {
+        // every pcid, global entries included
+        invpcid(INVPCID_ALL, 0);
+    } else if (cr4 & CR4_PGE) {
+        // toggling PGE drops global entries as well
+        asm volatile("mov %0, %%cr4" :: "r"(cr4 & ~CR4_PGE) : "memory");
+        asm volatile("mov %0, %%cr4" :: "r"(cr4) : "memory");
+    } else {
+        uint64_t cr3;
+        asm volatile("mov %%cr3, %0; mov %0, %%cr3" : "=r"(cr3) :: "memory");
     }
 
-    return (*pte & ~0xFFFULL) + PAGE_OFFSET(virt);
+    if (flags & (1ULL << 9)) asm volatile("sti" ::: "memory");
+}
+
+void vmm_flush_tlb_local(uint64_t start, uint64_t end) {
+    if ((end - start) / PAGE_SIZE > TLB_FLUSH_ALL_THRESHOLD) {
+        flush_tlb_local_all();
+        return;
+    }
+    for (uint64_t virt = start; virt < end; virt += PAGE_SIZE) {
+        invlpg(virt);
+    }
+}
+
+void vmm_flush_tlb_all(void) {
+    flush_tlb_local_all();
+    smp_tlb_shootdown(0, UINT64_MAX);
+}
+
+void vmm_flush_tlb_range(uint64_t start, uint64_t end) {
+    vmm_flush_tlb_local(start, end);
+    // user ranges are only ever live on the cpu changing them
+    if (start >= KERNEL_HALF_START) smp_tlb_shootdown(start, end);
+}
+
+uint64_t vmm_get_physical(uint64_t virt) {
+    uint64_t *pml4 = (uint64_t *)phys_to_virt(kernel_pml4_phys);
+    uint64_t size;
+    uint64_t *leaf = walk_leaf(pml4, virt, &size);
+    if (!(*leaf & PTE_PRESENT)) return 0;
+
+    return (*leaf & PTE_ADDR_MASK & ~(size-1)) + (virt & (size-1));
 }
 
 uint64_t vmm_get_flags(uint64_t virt) {
     uint64_t *pml4 = (uint64_t *)phys_to_virt(kernel_pml4_phys);
-    uint64_t *pte = get_pte(pml4, virt);
-    if (!pte) return 0;
-    return *pte & 0xFFFULL;
+    uint64_t size;
+    uint64_t *leaf = walk_leaf(pml4, virt, &size);
+    if (!(*leaf & PTE_PRESENT)) return 0;
+    return *leaf & 0xFFFULL;
+}
+
+bool vmm_prealloc_pml4e(uint64_t virt) {
+    uint64_t *pml4 = (uint64_t *)phys_to_virt(kernel_pml4_phys);
+    return create_table(get_pml4e(pml4, virt), PTE_WRITE);
+}
+
+bool vmm_set_cache(uint64_t virt, size_t count, uint64_t cache) {
+    uint64_t *pml4 = (uint64_t *)phys_to_virt(kernel_pml4_phys);
+    uint64_t end = virt + count * PAGE_SIZE;
+    bool ok = true;
+
+    while (virt < end) {
+        uint64_t size;
+        uint64_t *leaf = walk_leaf(pml4, virt, &size);
+        if (!(*leaf & PTE_PRESENT)) {
+            ok = false;
+            break;
+        }
+        if ((virt & (size - 1)) || end - virt < size) {
+            if (!leaf_at_most(pml4, virt, size / 512, &size)) {
+                ok = false;
+                break;
+            }
+            continue;
+        }
+
+        uint64_t mask = size == PAGE_SIZE ? PTE_CACHE_MASK : pte_cache_huge(PTE_CACHE_MASK);
+        uint64_t bits = size == PAGE_SIZE ? cache : pte_cache_huge(cache);
+        *leaf = (*leaf & ~mask) | bits;
+        virt += size;
+    }
+
+    // lines cached under the old type must not be written back over the new one later
+    asm volatile("wbinvd" ::: "memory");
+    vmm_flush_tlb_all();
+    return ok;
+}
+
+bool vmm_has_1gb_pages(void) {
+    return has_1gb_pages;
 }
 
 void vmm_dump_pte(uint64_t virt) {
@@ -189,19 +596,203 @@ void vmm_dump_pte(uint64_t virt) {
     serial_puts("flags: "); u64_to_hex(flags, buf); serial_puts(buf); serial_puts("\n");
 }
 
+// set G on every leaf under a kernel-half table. level 3 is a pdpt
+static void mark_global(uint64_t table_phys, int level) {
+    uint64_t *table = (uint64_t *)phys_to_virt(table_phys);
+    for (int i = 0; i < 512; i++) {
+        if (!(table[i] & PTE_PRESENT)) continue;
+        if (level == 1 || (table[i] & PTE_HUGE)) table[i] |= PTE_GLOBAL;
+        else mark_global(table[i] & PTE_ADDR_MASK, level - 1);
+    }
+}
+
 void vmm_init(void) {
     uint64_t cr3;
     asm volatile("mov %%cr3, %0" : "=r"(cr3));
     kernel_pml4_phys = cr3 & ~0xFFFULL;
+
+    // 1 GiB pages: CPUID.80000001h:EDX[26]
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0x80000000, &eax, &ebx, &ecx, &edx);
+    if (eax >= 0x80000001) {
+        cpuid(0x80000001, &eax, &ebx, &ecx, &edx);
+        has_1gb_pages = (edx >> 26) & 1;
+    }
+
+    // make ring 0 writes honour read-only user pages too, copy-on-write relies on it
+    uint64_t cr0;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    asm volatile("mov %0, %%cr0" :: "r"(cr0 | CR0_WP) : "memory");
+
+    // PCID: CPUID.1:ECX[17], INVPCID: CPUID.(7,0):EBX[10], PAT: CPUID.1:EDX[16]
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    has_pcid = (ecx >> 17) & 1;
+    has_pat = (edx >> 16) & 1;
+    if (has_pat) {
+        // entries 0-3 keep their reset values, so existing mappings don't change type
+        asm volatile("wbinvd" ::: "memory");
+        wrmsr(IA32_PAT, PAT_LAYOUT);
+        asm volatile("wbinvd" ::: "memory");
+    }
+    cpuid(0, &eax, &ebx, &ecx, &edx);
+    if (eax >= 7) {
+        cpuid(7, &eax, &ebx, &ecx, &edx);
+        has_invpcid = has_pcid && ((ebx >> 10) & 1);
+    }
+
+    // limine's mappings of the kernel half predate kernel_global()
+    uint64_t *pml4 = (uint64_t *)phys_to_virt(kernel_pml4_phys);
+    for (int i = 256; i < 512; i++) {
+        if (pml4[i] & PTE_PRESENT) mark_global(pml4[i] & PTE_ADDR_MASK, 3);
+    }
+
+    uint64_t cr4;
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+    cr4 |= CR4_PGE;
+    if (has_pcid) {
+        // PCIDE can only be set while cr3 selects pcid 0
+        asm volatile("mov %0, %%cr3" :: "r"(kernel_pml4_phys) : "memory");
+        cr4 |= CR4_PCIDE;
+    }
+    asm volatile("mov %0, %%cr4" :: "r"(cr4) : "memory");
+    vmm_flush_tlb_all();
+
+    if (has_pcid) serial_puts(has_invpcid ? "VMM: PCID + INVPCID\n" : "VMM: PCID\n");
+
     serial_puts("VMM initialized\n");
 }
 
+// an ap coming out of limine: the same paging setup as the bsp, on the kernel's tables
+void vmm_init_ap(void) {
+    uint64_t cr0;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    asm volatile("mov %0, %%cr0" :: "r"(cr0 | CR0_WP) : "memory");
+
+    if (has_pat) {
+        asm volatile("wbinvd" ::: "memory");
+        wrmsr(IA32_PAT, PAT_LAYOUT);
+        asm volatile("wbinvd" ::: "memory");
+    }
+
+    // pcid 0, so PCIDE can be turned on right after
+    asm volatile("mov %0, %%cr3" :: "r"(kernel_pml4_phys) : "memory");
+
+    uint64_t cr4;
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+    cr4 |= CR4_PGE;
+    if (has_pcid) cr4 |= CR4_PCIDE;
+    asm volatile("mov %0, %%cr4" :: "r"(cr4) : "memory");
+    flush_tlb_local_all();
+}
+
+// copy the tables under table_phys that sit in reclaimable memory, children first.
+// returns the table's (possibly new) address, 0 if a copy could not be allocated
+static uint64_t relocate_table(uint64_t table_phys, int level) {
+    uint64_t *table = (uint64_t *)phys_to_virt(table_phys);
+
+    if (level > 1) {
+        for (int i = 0; i < 512; i++) {
+            uint64_t entry = table[i];
+            if (!(entry & PTE_PRESENT) || (entry & PTE_HUGE)) continue;
+
+            uint64_t child = entry & PTE_ADDR_MASK;
+            uint64_t moved = relocate_table(child, level - 1);
+            if (!moved) return 0;
+            // the copy is identical, so swapping it in under a live cr3 is safe
+            if (moved != child) table[i] = (entry & ~PTE_ADDR_MASK) | moved;
+        }
+    }
+
+    if (!pmm_is_reclaimable(table_phys)) return table_phys;
+
+    void *copy = pmm_alloc();
+    if (!copy) return 0;
+    phys_to_page((uint64_t)copy)->flags |= PG_PAGETABLE;
+    memcpy((void *)phys_to_virt((uint64_t)copy), table, PAGE_SIZE);
+    return (uint64_t)copy;
+}
+
+// collapse the table under entry into one huge leaf if its 512 entries map one
+// aligned, physically contiguous run the same way. level is the table's: 1 = pt, 2 = pd,
+// virt where it starts. returns how many tables were folded away, children included
+static size_t promote_table(uint64_t *entry, int level, uint64_t virt) {
+    uint64_t *table = (uint64_t *)phys_to_virt(*entry & PTE_ADDR_MASK);
+    size_t promoted = 0;
+
+    if (level == 2) {
+        for (int i = 0; i < 512; i++) {
+            if ((table[i] & PTE_PRESENT) && !(table[i] & PTE_HUGE)) promoted += promote_table(&table[i], 1, virt + i * HUGE_2MB);
+        }
+        if (!has_1gb_pages) return promoted;
+    }
+
+    uint64_t child = leaf_size(level), size = leaf_size(level + 1);
+    uint64_t base = table[0] & PTE_ADDR_MASK & ~(child - 1);
+    uint64_t attrs = leaf_attrs(table[0], child);
+    if (base & (size - 1)) return promoted;
+
+    for (int i = 0; i < 512; i++) {
+        uint64_t e = table[i];
+        if (!(e & PTE_PRESENT) || (level == 2 && !(e & PTE_HUGE))) return promoted;
+        if ((e & PTE_ADDR_MASK & ~(child - 1)) != base + i * child || leaf_attrs(e, child) != attrs) return promoted;
+    }
+
+    if (level == 1) {
+        bool pat = attrs & PTE_PAT;
+        attrs &= ~PTE_PAT;
+        if (pat) attrs |= PTE_PAT_HUGE;
+    }
+    // same translation either way, so swapping it under a live cr3 is fine. invlpg also
+    // drops cached pointers to the table before it is freed
+    *entry = base | attrs | PTE_HUGE;
+    invlpg(virt);
+
+    // tables limine left outside of pmm memory are simply dropped
+    struct page *page = phys_to_page(virt_to_phys((uint64_t)table));
+    if (page && (page->flags & PG_PAGETABLE)) pmm_free((void *)virt_to_phys((uint64_t)table));
+    return promoted + 1;
+}
+
+bool vmm_relocate_boot_tables(void) {
+    uint64_t pml4 = relocate_table(kernel_pml4_phys, 4);
+    if (!pml4) {
+        serial_puts("vmm_relocate_boot_tables: out of memory\n");
+        return false;
+    }
+
+    if (pml4 != kernel_pml4_phys) {
+        kernel_pml4_phys = pml4;
+        asm volatile("mov %0, %%cr3" :: "r"(pml4) : "memory");
+    }
+
+    // put the hhdm (and anything else uniform in the kernel half) on the biggest pages it fits
+    uint64_t *top = (uint64_t *)phys_to_virt(kernel_pml4_phys);
+    size_t promoted = 0;
+    for (int i = 256; i < 512; i++) {
+        if (!(top[i] & PTE_PRESENT)) continue;
+        uint64_t *pdpt = (uint64_t *)phys_to_virt(top[i] & PTE_ADDR_MASK);
+        for (int j = 0; j < 512; j++) {
+            uint64_t virt = 0xFFFF000000000000ULL | ((uint64_t)i << PML4_SHIFT) | ((uint64_t)j << PDP_SHIFT);
+            if ((pdpt[j] & PTE_PRESENT) && !(pdpt[j] & PTE_HUGE)) promoted += promote_table(&pdpt[j], 2, virt);
+        }
+    }
+    if (promoted) {
+        vmm_flush_tlb_all();
+        char buf[32];
+        u64_to_dec(promoted, buf);
+        serial_puts("[vmm] page tables folded into huge pages: ");
+        serial_puts(buf);
+        serial_puts("\n");
+    }
+    return true;
+}
+
 bool vmm_map_for_pml4(uint64_t *pml4, uint64_t virt, uint64_t phys, uint64_t flags) {
     if (virt & 0xFFF || phys & 0xFFF) return false;
 
     uint64_t *pml4e = &pml4[PML4_INDEX(virt)];
     if (!(*pml4e & PTE_PRESENT)) {
-        void *pdpt = pmm_alloc_zeroed();
+        void *pdpt = alloc_table();
         if (!pdpt) return false;
         *pml4e = (uint64_t)pdpt | PTE_PRESENT | PTE_WRITE | PTE_USER;
     }
@@ -209,7 +800,7 @@ bool vmm_map_for_pml4(uint64_t *pml4, uint64_t virt, uint64_t phys, uint64_t fla
     uint64_t *pdpt = (uint64_t *)phys_to_virt(*pml4e & ~0xFFFULL);
     uint64_t *pdpe = &pdpt[PDP_INDEX(virt)];
     if (!(*pdpe & PTE_PRESENT)) {
-        void *pd = pmm_alloc_zeroed();
+        void *pd = alloc_table();
         if (!pd) return false;
         *pdpe = (uint64_t)pd | PTE_PRESENT | PTE_WRITE | PTE_USER;
     }
@@ -217,7 +808,7 @@ bool vmm_map_for_pml4(uint64_t *pml4, uint64_t virt, uint64_t phys, uint64_t fla
     uint64_t *pd = (uint64_t *)phys_to_virt(*pdpe & ~0xFFFULL);
     uint64_t *pde = &pd[PD_INDEX(virt)];
     if (!(*pde & PTE_PRESENT)) {
-        void *pt = pmm_alloc_zeroed();
+        void *pt = alloc_table();
         if (!pt) return false;
         *pde = (uint64_t)pt | PTE_PRESENT | PTE_WRITE | PTE_USER;
     }
@@ -234,8 +825,411 @@ bool vmm_map_for_pml4(uint64_t *pml4, uint64_t virt, uint64_t phys, uint64_t fla
 }
 
 bool vmm_map_range_for_pml4(uint64_t *pml4, uint64_t virt, uint64_t phys, size_t count, uint64_t flags) {
-    for (size_t i = 0; i < count; i++)
-        if (!vmm_map_for_pml4(pml4, virt + i*PAGE_SIZE, phys + i*PAGE_SIZE, flags))
-            return false;
+    vmm_batch_t batch;
+    vmm_batch_begin(&batch, pml4);
+    bool ok = true;
+    // NX dropped like vmm_map_for_pml4 does
+    for (size_t i = 0; i < count && ok; i++) {
+        ok = vmm_batch_map(&batch, virt + i * PAGE_SIZE, phys + i * PAGE_SIZE, flags & ~PTE_NX);
+    }
+    vmm_batch_end(&batch);
+    return ok;
+}
+
+bool vmm_map_range_huge_for_pml4(uint64_t *pml4, uint64_t virt, uint64_t phys, size_t count, uint64_t flags) {
+    return map_range_huge(pml4, virt, phys, count, flags, PTE_WRITE | PTE_USER);
+}
+// drop the user frames under a table, then free the table itself. only PG_USER
+// frames belong to the address space, anything else mapped there has another owner
+static void free_user_table(uint64_t table_phys, int level) {
+    uint64_t *table = (uint64_t *)phys_to_virt(table_phys);
+
+    for (int i = 0; i < 512; i++) {
+        uint64_t entry = table[i];
+        if (!(entry & PTE_PRESENT)) continue;
+
+        uint64_t phys = entry & PTE_ADDR_MASK;
+        if (level > 1 && !(entry & PTE_HUGE)) {
+            free_user_table(phys, level - 1);
+            continue;
+        }
+        // bit 12 is PAT in huge entries
+        if (level > 1) phys &= ~((level == 2 ? HUGE_2MB : HUGE_1GB) - 1);
+
+        struct page *page = phys_to_page(phys);
+        if (page->flags & PG_USER) page_put(page);
+    }
+    pmm_free((void *)table_phys);
+}
+
+// the pcid of an address space lives in its pml4's struct page
+static uint16_t asid_of(uint64_t pml4_phys) {
+    struct page *page = phys_to_page(pml4_phys);
+    return page ? (uint16_t)page->private : 0;
+}
+
+static bool asid_test(uint64_t *bitmap, uint16_t asid) {
+    return (bitmap[asid / 64] >> (asid % 64)) & 1;
+}
+
+// whatever any cpu's tlb holds under asid is dropped on its next load
+static void asid_invalidate(uint16_t asid) {
+    uint64_t flags = spin_lock_irqsave(&asid_lock);
+    asid_cpu[asid] = ASID_NO_CPU;
+    spin_unlock_irqrestore(&asid_lock, flags);
+}
+
+void vmm_asid_attach(uint64_t pml4_phys) {
+    if (!has_pcid) return;
+
+    uint64_t flags = spin_lock_irqsave(&asid_lock);
+    // round robin, so a freed asid rests as long as possible before it is reused
+    uint16_t asid = 0;
+    for (size_t n = 1; n < ASID_COUNT; n++) {
+        size_t candidate = asid_hint;
+        asid_hint = asid_hint + 1 < ASID_COUNT ? asid_hint + 1 : 1;
+        if (!asid_test(asid_used, candidate)) {
+            asid = candidate;
+            asid_used[asid / 64] |= 1ULL << (asid % 64);
+            asid_cpu[asid] = ASID_NO_CPU;
+            break;
+        }
+    }
+    spin_unlock_irqrestore(&asid_lock, flags);
+
+    phys_to_page(pml4_phys)->private = asid;
+}
+
+static void asid_release(uint64_t pml4_phys) {
+    uint16_t asid = asid_of(pml4_phys);
+    if (!asid) return;
+
+    phys_to_page(pml4_phys)->private = 0;
+    asid_invalidate(asid);
+
+    uint64_t flags = spin_lock_irqsave(&asid_lock);
+    asid_used[asid / 64] &= ~(1ULL << (asid % 64));
+    spin_unlock_irqrestore(&asid_lock, flags);
+}
+
+void vmm_switch_address_space(uint64_t pml4_phys) {
+    uint64_t cr3 = pml4_phys;
+    uint16_t asid = has_pcid ? asid_of(pml4_phys) : 0;
+
+    if (asid) {
+        cr3 |= asid;
+        uint8_t cpu = this_cpu_id();
+        uint64_t flags = spin_lock_irqsave(&asid_lock);
+        // tables changed under another cpu (or unloaded) since we last had it: flush with this load
+        if (asid_cpu[asid] == cpu) cr3 |= CR3_NOFLUSH;
+        else asid_cpu[asid] = cpu;
+        spin_unlock_irqrestore(&asid_lock, flags);
+    }
+    asm volatile("mov %0, %%cr3" :: "r"(cr3) : "memory");
+}
+
+bool vmm_has_pcid(void) {
+    return has_pcid;
+}
+
+void vmm_destroy_address_space(uint64_t pml4_phys) {
+    uint64_t *pml4 = (uint64_t *)phys_to_virt(pml4_phys);
+
+    // the upper half is the kernel's and shared by everyone
+    for (int i = 0; i < 256; i++) {
+        if (pml4[i] & PTE_PRESENT) free_user_table(pml4[i] & PTE_ADDR_MASK, 3);
+    }
+    asid_release(pml4_phys);
+    pmm_free((void *)pml4_phys);
+}
+
+static bool clone_table(uint64_t *dst, uint64_t *src, int level, int entries, bool cow) {
+    for (int i = 0; i < entries; i++) {
+        uint64_t entry = src[i];
+        if (!(entry & PTE_PRESENT)) continue;
+
+        if (level > 1 && !(entry & PTE_HUGE)) {
+            void *table = alloc_table();
+            if (!table) return false;
+            dst[i] = (uint64_t)table | (entry & ~PTE_ADDR_MASK);
+            if (!clone_table((uint64_t *)phys_to_virt((uint64_t)table),
+                             (uint64_t *)phys_to_virt(entry & PTE_ADDR_MASK), level - 1, 512, cow)) {
+                return false;
+            }
+            continue;
+        }
+
+        uint64_t size = leaf_size(level);
+        uint64_t addr_mask = PTE_ADDR_MASK & ~(size - 1);
+        uint64_t phys = entry & addr_mask;
+        struct page *page = phys_to_page(phys);
+
+        // not owned by the address space (shared file pages, MMIO): same mapping in both
+        if (!(page->flags & PG_USER)) {
+            dst[i] = entry;
+            continue;
+        }
+
+        // read-only frames never change, both sides can keep the same one
+        if (!(entry & (PTE_WRITE | PTE_COW))) {
+            page_get(page);
+            dst[i] = entry;
+            continue;
+        }
+
+        if (!cow) {
+            void *copy = pmm_alloc_frames(size / PAGE_SIZE);
+            if (!copy) return false;
+            memcpy((void *)phys_to_virt((uint64_t)copy), (void *)phys_to_virt(phys), size);
+            phys_to_page((uint64_t)copy)->flags |= PG_USER;
+            dst[i] = (entry & ~addr_mask) | (uint64_t)copy;
+            continue;
+        }
+
+        if (entry & PTE_WRITE) {
+            entry = (entry & ~PTE_WRITE) | PTE_COW;
+            src[i] = entry;
+        }
+        page_get(page);
+        dst[i] = entry;
+    }
+    return true;
+}
+
+static bool pml4_is_live(uint64_t *pml4) {
+    uint64_t cr3;
+    asm volatile("mov %%cr3, %0" : "=r"(cr3));
+    return (cr3 & PTE_ADDR_MASK) == virt_to_phys((uint64_t)pml4);
+}
+
+// pml4 changed while another address space was loaded; its pcid may still have entries cached
+static void invalidate_inactive(uint64_t *pml4) {
+    uint16_t asid = asid_of(virt_to_phys((uint64_t)pml4));
+    if (asid) asid_invalidate(asid);
+}
+
+void vmm_batch_end(vmm_batch_t *batch) {
+    bool kernel = batch->pml4 == (uint64_t *)phys_to_virt(kernel_pml4_phys);
+    if (!batch->flush_all && !batch->pending_count) return;
+
+    if (!kernel && !pml4_is_live(batch->pml4)) {
+        invalidate_inactive(batch->pml4);
+    } else if (batch->flush_all && !kernel) {
+        // a cr3 reload drops this address space's entries and leaves the global kernel ones
+        uint64_t cr3;
+        asm volatile("mov %%cr3, %0" : "=r"(cr3));
+        asm volatile("mov %0, %%cr3" :: "r"(cr3) : "memory");
+    } else if (batch->flush_all) {
+        vmm_flush_tlb_all();
+    } else {
+        uint64_t lo = UINT64_MAX, hi = 0;
+        for (size_t i = 0; i < batch->pending_count; i++) {
+            invlpg(batch->pending[i]);
+            if (batch->pending[i] < lo) lo = batch->pending[i];
+            if (batch->pending[i] + PAGE_SIZE > hi) hi = batch->pending[i] + PAGE_SIZE;
+        }
+        if (kernel) smp_tlb_shootdown(lo, hi);
+    }
+    batch->pending_count = 0;
+    batch->flush_all = false;
+}
+
+bool vmm_clone_user(uint64_t *dst_pml4, uint64_t *src_pml4, bool cow) {
+    bool ok = clone_table(dst_pml4, src_pml4, 4, 256, cow);
+
+    // src just lost write access to its private pages, drop the stale entries; with
+    // pcids the tlb keeps them even while src is not loaded
+    if (cow && pml4_is_live(src_pml4)) {
+        uint64_t cr3;
+        asm volatile("mov %%cr3, %0" : "=r"(cr3));
+        asm volatile("mov %0, %%cr3" :: "r"(cr3 & ~CR3_NOFLUSH) : "memory");
+    } else if (cow) {
+        invalidate_inactive(src_pml4);
+    }
+    return ok;
+}
+
+// drop the tlb entries for [start, end) of a user address space
+static void flush_user_range(uint64_t *pml4, uint64_t start, uint64_t end) {
+    if (!pml4_is_live(pml4)) {
+        invalidate_inactive(pml4);
+    } else if ((end - start) / PAGE_SIZE > TLB_FLUSH_ALL_THRESHOLD) {
+        // a plain cr3 load drops this pcid's entries and keeps the global kernel ones
+        uint64_t cr3;
+        asm volatile("mov %%cr3, %0" : "=r"(cr3));
+        asm volatile("mov %0, %%cr3" :: "r"(cr3) : "memory");
+    } else {
+        for (uint64_t virt = start; virt < end; virt += PAGE_SIZE) invlpg(virt);
+    }
+}
+
+// a 2 MiB user leaf becomes 512 ptes over 512 independent frames. a leaf fork still
+// shares is copied first, so the other address space keeps its huge page untouched
+static bool split_user_huge(uint64_t *leaf, uint64_t virt) {
+    uint64_t addr_mask = PTE_ADDR_MASK & ~(HUGE_2MB - 1);
+    uint64_t entry = *leaf;
+    struct page *page = phys_to_page(entry & addr_mask);
+
+    if (page->flags & PG_USER) {
+        if (__atomic_load_n(&page->refcount, __ATOMIC_ACQUIRE) != 1) {
+            void *copy = pmm_alloc_huge_2mb();
+            if (!copy) return false;
+            memcpy((void *)phys_to_virt((uint64_t)copy), (void *)phys_to_virt(entry & addr_mask), HUGE_2MB);
+            phys_to_page((uint64_t)copy)->flags |= PG_USER;
+
+            // the copy is private, so a cow leaf can be writable again
+            if (entry & PTE_COW) entry = (entry & ~PTE_COW) | PTE_WRITE;
+            *leaf = (entry & ~addr_mask) | (uint64_t)copy;
+            invlpg(virt & ~(HUGE_2MB - 1));
+            page_put(page);
+            page = phys_to_page((uint64_t)copy);
+        }
+        if (!split_leaf(leaf, 2, virt)) return false;
+        // the compound head's reference becomes one per frame
+        for (size_t i = 0; i < HUGE_2MB / PAGE_SIZE; i++) page[i] = (struct page){ .refcount = 1, .flags = PG_USER };
+    } else if (!split_leaf(leaf, 2, virt)) {
+        return false;
+    }
+
+    __atomic_add_fetch(&thp_split, 1, __ATOMIC_RELAXED);
     return true;
-}
\ No newline at end of file
+}
+
+void vmm_unmap_user_range(uint64_t *pml4, uint64_t start, uint64_t end) {
+    vmm_batch_t batch;
+    vmm_batch_begin(&batch, pml4);
+
+    uint64_t virt = start;
+    while (virt < end) {
+        if (batch_pte(&batch, virt, false)) {
+            uint64_t old = vmm_batch_unmap(&batch, virt);
+            struct page *page = old ? phys_to_page(old & PTE_ADDR_MASK) : NULL;
+            if (page && (page->flags & PG_USER)) page_put(page);
+            virt += PAGE_SIZE;
+            continue;
+        }
+
+        uint64_t size;
+        uint64_t *leaf = walk_leaf(pml4, virt, &size);
+        uint64_t next = (virt & ~(size - 1)) + size;
+
+        // a huge leaf the range only partly covers is split and the loop comes back to it
+        bool covered = size == PAGE_SIZE || ((virt & (size - 1)) == 0 && next <= end);
+        if ((*leaf & PTE_PRESENT) && !covered && size == HUGE_2MB) {
+            if (split_user_huge(leaf, virt)) continue;
+            serial_puts("vmm_unmap_user_range: out of memory splitting a huge page\n");
+        }
+        if ((*leaf & PTE_PRESENT) && covered) {
+            struct page *page = phys_to_page(*leaf & PTE_ADDR_MASK & ~(size - 1));
+            *leaf = 0;
+            batch_queue_flush(&batch, virt);
+            if (page->flags & PG_USER) page_put(page);
+        }
+        virt = next;
+    }
+    vmm_batch_end(&batch);
+}
+
+bool vmm_resolve_cow(uint64_t *pml4, uint64_t virt) {
+    uint64_t size;
+    uint64_t *leaf = walk_leaf(pml4, virt, &size);
+    uint64_t entry = *leaf;
+    if (!(entry & PTE_PRESENT) || !(entry & PTE_COW)) return false;
+
+    uint64_t addr_mask = PTE_ADDR_MASK & ~(size - 1);
+    uint64_t phys = entry & addr_mask;
+    uint64_t flags = (entry & ~addr_mask & ~PTE_COW) | PTE_WRITE;
+    struct page *page = phys_to_page(phys);
+
+    // everyone else already broke away or exited: take the frame over. frames the
+    // address space doesn't own (initrd pages after mprotect) are always copied
+    bool owned = page->flags & PG_USER;
+    if (owned && __atomic_load_n(&page->refcount, __ATOMIC_ACQUIRE) == 1) {
+        *leaf = phys | flags;
+        invlpg(virt);
+        return true;
+    }
+
+    void *copy = pmm_alloc_frames_aligned(size / PAGE_SIZE, size);
+    if (!copy) return false;
+    memcpy((void *)phys_to_virt((uint64_t)copy), (void *)phys_to_virt(phys), size);
+    phys_to_page((uint64_t)copy)->flags |= PG_USER;
+
+    *leaf = (uint64_t)copy | flags;
+    invlpg(virt);
+    if (owned) page_put(page);
+    return true;
+}
+
+bool vmm_collapse_user_2mb(uint64_t *pml4, uint64_t virt) {
+    if (virt & (HUGE_2MB - 1)) return false;
+
+    uint64_t *pde = get_pde(pml4, virt);
+    if (!pde || !(*pde & PTE_PRESENT) || (*pde & PTE_HUGE)) return false;
+    uint64_t *pt = (uint64_t *)phys_to_virt(*pde & PTE_ADDR_MASK);
+
+    // every page present, private, writable and mapped the same way
+    uint64_t attrs = leaf_attrs(pt[0], PAGE_SIZE);
+    for (int i = 0; i < 512; i++) {
+        if (!(pt[i] & PTE_PRESENT) || !(pt[i] & PTE_WRITE) || leaf_attrs(pt[i], PAGE_SIZE) != attrs) return false;
+        struct page *page = phys_to_page(pt[i] & PTE_ADDR_MASK);
+        if (!(page->flags & PG_USER) || __atomic_load_n(&page->refcount, __ATOMIC_ACQUIRE) != 1) return false;
+    }
+
+    void *huge = pmm_alloc_huge_2mb();
+    if (!huge) return false;
+    uint8_t *dst = (uint8_t *)phys_to_virt((uint64_t)huge);
+    for (int i = 0; i < 512; i++) {
+        memcpy(dst + i * PAGE_SIZE, (void *)phys_to_virt(pt[i] & PTE_ADDR_MASK), PAGE_SIZE);
+    }
+    phys_to_page((uint64_t)huge)->flags |= PG_USER;
+
+    uint64_t pt_phys = *pde & PTE_ADDR_MASK;
+    *pde = (uint64_t)huge | pte_cache_huge(attrs) | PTE_HUGE;
+    flush_user_range(pml4, virt, virt + HUGE_2MB);
+
+    for (int i = 0; i < 512; i++) page_put(phys_to_page(pt[i] & PTE_ADDR_MASK));
+    pmm_free((void *)pt_phys);
+
+    __atomic_add_fetch(&thp_collapsed, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+bool vmm_protect_user_range(uint64_t *pml4, uint64_t start, uint64_t end, bool writable) {
+    uint64_t virt = start;
+    while (virt < end) {
+        uint64_t size;
+        uint64_t *leaf = walk_leaf(pml4, virt, &size);
+        uint64_t next = (virt & ~(size - 1)) + size;
+        if (!(*leaf & PTE_PRESENT)) {
+            virt = next;
+            continue;
+        }
+
+        if ((virt & (size - 1)) || next > end) {
+            if (size != HUGE_2MB || !split_user_huge(leaf, virt)) return false;
+            continue;
+        }
+
+        uint64_t entry = *leaf;
+        if (!writable) {
+            entry &= ~PTE_WRITE;
+        } else if (!(entry & (PTE_WRITE | PTE_COW))) {
+            // only a frame nobody else maps can be written in place
+            struct page *page = phys_to_page(entry & PTE_ADDR_MASK & ~(size - 1));
+            bool owned = (page->flags & PG_USER) && __atomic_load_n(&page->refcount, __ATOMIC_ACQUIRE) == 1;
+            entry |= owned ? PTE_WRITE : PTE_COW;
+        }
+        *leaf = entry;
+        virt = next;
+    }
+
+    flush_user_range(pml4, start, end);
+    return true;
+}
+
+void vmm_get_thp_stats(struct vmm_thp_stats *stats) {
+    stats->collapsed = __atomic_load_n(&thp_collapsed, __ATOMIC_RELAXED);
+    stats->split = __atomic_load_n(&thp_split, __ATOMIC_RELAXED);
+}
+
@@ -9,6 +9,7 @@
 
 #define PAGE_SIZE 4096ULL
 #define HUGE_2MB  (2ULL*1024*1024)
+#define HUGE_1GB  (1024ULL*1024*1024)
 
 #define PTE_PRESENT (1ULL << 0)
 #define PTE_WRITE (1ULL << 1)
@@ -18,9 +19,28 @@
 #define PTE_ACCESSED (1ULL << 5)
 #define PTE_DIRTY (1ULL << 6)
 #define PTE_HUGE (1ULL << 7)
+#define PTE_PAT (1ULL << 7)      // 4 KiB entries only, it is PTE_HUGE everywhere else
 #define PTE_GLOBAL (1ULL << 8)
+#define PTE_COW (1ULL << 9)      // software bit: write-protected, copy on the next write
+#define PTE_PAT_HUGE (1ULL << 12)
 #define PTE_NX (1ULL << 63)
 
+#define PTE_ADDR_MASK 0x000FFFFFFFFFF000ULL
+
+// memory types. vmm_init programs IA32_PAT the way limine does (WB, WT, UC-, UC, WP, WC)
+// so these select the entry of the same name. the values are for 4 KiB entries,
+// pte_cache_huge() converts them for 2 MiB / 1 GiB ones
+#define PTE_CACHE_WB       0
+#define PTE_CACHE_WT       PTE_PWT
+#define PTE_CACHE_UC_MINUS PTE_PCD
+#define PTE_CACHE_UC       (PTE_PCD | PTE_PWT)
+#define PTE_CACHE_WC       (PTE_PAT | PTE_PWT)
+#define PTE_CACHE_MASK     (PTE_PAT | PTE_PCD | PTE_PWT)
+
+static inline uint64_t pte_cache_huge(uint64_t flags) {
+    return (flags & PTE_PAT) ? (flags & ~PTE_PAT) | PTE_PAT_HUGE : flags;
+}
+
 #define PTE_KERNEL_RO PTE_PRESENT
 #define PTE_KERNEL_RW (PTE_PRESENT | PTE_WRITE)
 #define PTE_KERNEL_EXEC (PTE_PRESENT | PTE_WRITE)
@@ -37,18 +57,102 @@ static inline uint64_t virt_to_phys(uint64_t virt) {
     return virt - hhdm_offset;
 }
 
+// past this many pages one full flush is cheaper than invlpg per page
+#define TLB_FLUSH_ALL_THRESHOLD 32
+
+// a run of 4 KiB map/unmap operations on one address space. the cursor keeps the
+// page table of the last 2 MiB touched, so neighbouring pages skip the walk from the
+// root, and invalidations are queued until vmm_batch_end
+typedef struct {
+    uint64_t *pml4;
+    uint64_t table_flags;   // for intermediate tables created on the way
+    uint64_t *pt;
+    uint64_t pt_base;       // 2 MiB region pt covers
+    uint64_t pending[TLB_FLUSH_ALL_THRESHOLD];
+    size_t pending_count;
+    bool flush_all;         // too many pending pages, flush everything instead
+    size_t walks;           // walks from the root so far
+} vmm_batch_t;
+
 void vmm_init(void);
+void vmm_init_ap(void);
 bool vmm_map(uint64_t virt, uint64_t phys, uint64_t flags);
 bool vmm_map_huge_2mb(uint64_t virt, uint64_t phys, uint64_t flags);
+bool vmm_map_huge_1gb(uint64_t virt, uint64_t phys, uint64_t flags);
 bool vmm_map_range(uint64_t virt, uint64_t phys, size_t page_count, uint64_t flags);
+// same as vmm_map_range, but uses 1 GiB / 2 MiB entries wherever virt and phys line up
+bool vmm_map_range_huge(uint64_t virt, uint64_t phys, size_t page_count, uint64_t flags);
 bool vmm_unmap(uint64_t virt);
 bool vmm_unmap_huge_2mb(uint64_t virt);
+bool vmm_unmap_huge_1gb(uint64_t virt);
 bool vmm_unmap_range(uint64_t virt, size_t page_count);
+// clears the entries but leaves stale TLB entries; the caller flushes later
+bool vmm_unmap_range_noflush(uint64_t virt, size_t page_count);
+// kernel ranges are shot down on every cpu, user ones only flushed here
+void vmm_flush_tlb_range(uint64_t start, uint64_t end);
+void vmm_flush_tlb_all(void);
+// this cpu only
+void vmm_flush_tlb_local(uint64_t start, uint64_t end);
 uint64_t vmm_get_physical(uint64_t virt);
 uint64_t vmm_get_flags(uint64_t virt);
 void vmm_dump_pte(uint64_t virt);
+bool vmm_has_1gb_pages(void);
+bool vmm_has_pcid(void);
+// switch [virt, virt + count pages) of the kernel half to another PTE_CACHE_* type,
+// splitting huge pages only where the range ends inside one
+bool vmm_set_cache(uint64_t virt, size_t page_count, uint64_t cache);
+
+// create the top-level entry for virt now, so address spaces that copy the
+// kernel half of the pml4 later on still see what gets mapped under it
+bool vmm_prealloc_pml4e(uint64_t virt);
+
+// move page tables Limine built in bootloader-reclaimable memory into PMM frames
+bool vmm_relocate_boot_tables(void);
 
 bool vmm_map_for_pml4(uint64_t *pml4, uint64_t virt, uint64_t phys, uint64_t flags);
 bool vmm_map_range_for_pml4(uint64_t *pml4, uint64_t virt, uint64_t phys, size_t count, uint64_t flags);
+bool vmm_map_range_huge_for_pml4(uint64_t *pml4, uint64_t virt, uint64_t phys, size_t count, uint64_t flags);
+
+// tag a new address space with its own pcid, so loading it keeps its tlb entries.
+// without PCID support, or once the pool is used up, it shares pcid 0 and flushes on load
+void vmm_asid_attach(uint64_t pml4_phys);
+// load pml4_phys into cr3
+void vmm_switch_address_space(uint64_t pml4_phys);
+
+// kernel pml4 when pml4 is NULL
+void vmm_batch_begin(vmm_batch_t *batch, uint64_t *pml4);
+// false if virt is already mapped, sits under a huge page, or a table can't be allocated
+bool vmm_batch_map(vmm_batch_t *batch, uint64_t virt, uint64_t phys, uint64_t flags);
+// clears the 4 KiB entry at virt and returns what it held, 0 if nothing was mapped there
+uint64_t vmm_batch_unmap(vmm_batch_t *batch, uint64_t virt);
+// flush what the batch changed: invlpg per page, or everything past TLB_FLUSH_ALL_THRESHOLD
+void vmm_batch_end(vmm_batch_t *batch);
+
+// free the lower-half tables of an address space, its user frames and the pml4.
+// it must not be loaded in cr3 anymore
+void vmm_destroy_address_space(uint64_t pml4_phys);
+
+// copy the lower half of src into the empty lower half of dst. with cow, user frames are
+// shared read-only and copied on the first write; otherwise every user frame is copied now
+bool vmm_clone_user(uint64_t *dst_pml4, uint64_t *src_pml4, bool cow);
+// clear [start, end) in a user address space and drop the frames it owns
+void vmm_unmap_user_range(uint64_t *pml4, uint64_t start, uint64_t end);
+// give virt its own writable copy if it is a cow page; false if it is not one
+bool vmm_resolve_cow(uint64_t *pml4, uint64_t virt);
+
+// transparent huge pages: collapsed counts 2 MiB ranges folded into one huge leaf,
+// split counts huge leaves broken up again by a partial unmap or protection change
+struct vmm_thp_stats {
+    uint64_t collapsed;
+    uint64_t split;
+};
+
+// copy the 512 pages under the pt at virt (2 MiB aligned) into one huge frame and map
+// it with a single pde. only done if all of them are present, private and writable
+bool vmm_collapse_user_2mb(uint64_t *pml4, uint64_t virt);
+// make [start, end) read-only or writable. frames that are shared or not owned by the
+// address space turn copy-on-write instead of writable; huge leaves on the edges are split
+bool vmm_protect_user_range(uint64_t *pml4, uint64_t start, uint64_t end, bool writable);
+void vmm_get_thp_stats(struct vmm_thp_stats *stats);
 
 #endif
\ No newline at end of file
@@ -4,9 +4,15 @@
 #include <klib/memory.h>
 #include <stdint.h>
 #include <arch/x86_64/cpu/msr.h>
+#include <arch/x86_64/cpu/spinlock.h>
+#include <arch/x86_64/syscalls/syscalls.h>
 #include <drivers/keyboard.h>
 #include <arch/x86_64/usermode/usermode.h>
 #include <arch/x86_64/usermode/scheduler.h>
+#include <mm/mmap.h>
+#include <mm/vma.h>
+#include <fs/cpio/cpio.h>
+#include <arch/x86_64/time/tsc.h>
 
 extern void syscall_handler(void);
 
@@ -20,7 +26,17 @@ extern void syscall_handler(void);
 #define USER_CS   0x1B
 #define USER_DS   0x23
 
+static void console_input(void);
+
 void syscalls_init(void)
+{
+    syscalls_init_ap();
+    keyboard_set_input_hook(console_input);
+    serial_puts("syscalls enabled\n");
+}
+
+// the syscall msrs are per cpu
+void syscalls_init_ap(void)
 {
     uint64_t efer = rdmsr(EFER_MSR);
     efer |= (1ULL << 0);
@@ -34,22 +50,181 @@ void syscalls_init(void)
     wrmsr(IA32_STAR_MSR, star);
 
     wrmsr(IA32_FMASK_MSR, (1ULL << 9));
-
-    serial_puts("syscalls enabled\n");
 }
 
 #define SYS_READ  0
 #define SYS_WRITE 1
+#define SYS_OPEN  2
+#define SYS_CLOSE 3
+#define SYS_MMAP  9
+#define SYS_MPROTECT 10
+#define SYS_MUNMAP 11
+#define SYS_BRK   12
+#define SYS_NANOSLEEP 35
 #define SYS_GETPID 39
+#define SYS_FORK 57
 #define SYS_EXIT 60
+#define SYS_SETPRIORITY 141
+#define SYS_SCHED_SETSCHEDULER 144
+
+#define PRIO_PROCESS 0
+
+#define USER_SPACE_END 0x0000800000000000ULL
 
 static char buf[64];
+// the console is shared by every cpu
+static spinlock_t console_lock = SPINLOCK_INIT;
 
+// rcx, r11 and r12 hold the user rip, rflags and rsp; the user's own r12 is saved above
 typedef struct {
     uint64_t rax, rbx, rbp, rdi, rsi, rdx, rcx, r8, r9, r10, r11, r12, r13, r14, r15;
-    uint64_t rip, rflags, rsp;
+    uint64_t user_r12;
 } syscall_context_t;
 
+// false unless all of [ptr, ptr + len) is user space covered by vmas allowing prot, so
+// touching it can only fault pages in, never panic or reach kernel memory
+static bool user_range_ok(const void *ptr, size_t len, uint32_t prot) {
+    uint64_t start = (uint64_t)ptr;
+    uint64_t end = start + len;
+    if (end < start || end > USER_SPACE_END) return false;
+    for (uint64_t addr = start; addr < end;) {
+        struct vma *vma = mm_find(current_task->mm, addr);
+        if (!vma || (vma->prot & prot) != prot) return false;
+        addr = vma->end;
+    }
+    return true;
+}
+
+// false on a bad pointer, and nothing is copied
+static bool copy_from_user(void *dst, const void *src, size_t len) {
+    if (!user_range_ok(src, len, VMA_READ)) return false;
+    memcpy(dst, src, len);
+    return true;
+}
+
+// the same for writes: the range has to be in writable vmas
+static bool copy_to_user(void *dst, const void *src, size_t len) {
+    if (!user_range_ok(dst, len, VMA_WRITE)) return false;
+    memcpy(dst, src, len);
+    return true;
+}
+
+// tasks blocked in SYS_READ, chained through next while off the run queues
+static task_t *console_readers;
+static spinlock_t readers_lock = SPINLOCK_INIT;
+
+// keyboard irq: every reader runs its read again. the lock is held across the wakeups,
+// a reader that blocks again right away can't relink itself while we walk the list
+static void console_input(void) {
+    uint64_t flags = spin_lock_irqsave(&readers_lock);
+    task_t *task = console_readers;
+    console_readers = NULL;
+    while (task) {
+        task_t *next = task->next;
+        task_wake(task);
+        task = next;
+    }
+    spin_unlock_irqrestore(&readers_lock, flags);
+}
+
+// user frame for a task that blocks in the syscall and later resumes at rip with rax
+static cpu_context_t resume_frame(syscall_context_t *ctx, uint64_t rip, uint64_t rax) {
+    cpu_context_t resume = {
+        .r15 = ctx->r15, .r14 = ctx->r14, .r13 = ctx->r13, .r12 = ctx->user_r12,
+        .r11 = ctx->r11, .r10 = ctx->r10, .r9 = ctx->r9, .r8 = ctx->r8,
+        .rbp = ctx->rbp, .rdi = ctx->rdi, .rsi = ctx->rsi, .rdx = ctx->rdx,
+        .rcx = ctx->rcx, .rbx = ctx->rbx,
+        .rax = rax, .rip = rip,
+        .cs = 0x23, .rflags = ctx->r11, .rsp = ctx->r12, .ss = 0x1B,
+    };
+    return resume;
+}
+
+// nothing typed yet: give up the cpu until the keyboard irq, then restart the read from
+// the syscall instruction. returns only if a key came in while we were getting ready
+static void console_wait(syscall_context_t *ctx) {
+    task_t *task = current_task;
+    // back onto the 2 byte syscall
+    cpu_context_t resume = resume_frame(ctx, ctx->rcx - 2, SYS_READ);
+
+    task_set_blocked(task);
+    uint64_t flags = spin_lock_irqsave(&readers_lock);
+    task->next = console_readers;
+    console_readers = task;
+    spin_unlock_irqrestore(&readers_lock, flags);
+
+    if (!keyboard_has_data()) scheduler_block(&resume);
+
+    flags = spin_lock_irqsave(&readers_lock);
+    task_t **link = &console_readers;
+    while (*link && *link != task) link = &(*link)->next;
+    if (*link) *link = task->next;
+    spin_unlock_irqrestore(&readers_lock, flags);
+    task_wake(task);
+}
+
+// req is a struct timespec. the task comes back from the syscall with 0 once this cpu's
+// timer wakes it; there are no signals to cut a sleep short, so rem is never written
+static int64_t sys_nanosleep(syscall_context_t *ctx, const int64_t *user_req) {
+    int64_t req[2];
+    if (!tsc_frequency_hz || !copy_from_user(req, user_req, sizeof(req))) return -1;
+    int64_t sec = req[0], nsec = req[1];
+    if (sec < 0 || nsec < 0 || nsec >= 1000000000) return -1;
+
+    uint64_t cycles = (uint64_t)nsec * (tsc_frequency_hz / 1000) / 1000000;
+    if ((uint64_t)sec > (UINT64_MAX - cycles) / tsc_frequency_hz) cycles = UINT64_MAX;
+    else cycles += (uint64_t)sec * tsc_frequency_hz;
+    if (cycles == 0) return 0;
+
+    uint64_t now = rdtsc();
+    uint64_t deadline = cycles > UINT64_MAX - now ? UINT64_MAX : now + cycles;
+    cpu_context_t resume = resume_frame(ctx, ctx->rcx, 0);
+    scheduler_sleep(deadline, &resume);
+}
+
+#define OPEN_PATH_MAX 128
+
+// read-only initrd files; there is nothing to release on close besides the slot
+static int64_t sys_open(const char *user_path) {
+    char path[OPEN_PATH_MAX];
+    size_t len = 0;
+    for (;;) {
+        if (!copy_from_user(&path[len], user_path + len, 1)) return -1;
+        if (!path[len]) break;
+        if (++len == OPEN_PATH_MAX - 1) {
+            path[len] = 0;
+            break;
+        }
+    }
+    // skip a leading '/', the archive stores relative names
+    const char *name = path[0] == '/' ? path + 1 : path;
+
+    size_t size;
+    void *data = initrd_lookup(name, &size);
+    if (!data) return -1;
+
+    for (int i = 0; i < TASK_MAX_FILES; i++) {
+        if (!current_task->files[i].data) {
+            current_task->files[i].data = data;
+            current_task->files[i].size = size;
+            return TASK_FD_BASE + i;
+        }
+    }
+    return -1;
+}
+
+static task_t *sys_fork(syscall_context_t *ctx) {
+    cpu_context_t regs = {
+        .r15 = ctx->r15, .r14 = ctx->r14, .r13 = ctx->r13, .r12 = ctx->user_r12,
+        .r11 = ctx->r11, .r10 = ctx->r10, .r9 = ctx->r9, .r8 = ctx->r8,
+        .rbp = ctx->rbp, .rdi = ctx->rdi, .rsi = ctx->rsi, .rdx = ctx->rdx,
+        .rcx = ctx->rcx, .rbx = ctx->rbx,
+        .rax = 0,  // fork returns 0 in the child
+        .rip = ctx->rcx, .cs = 0x23, .rflags = ctx->r11, .rsp = ctx->r12, .ss = 0x1B,
+    };
+    return task_fork(current_task, &regs, true);
+}
+
 uint64_t syscall_common_handler(syscall_context_t *ctx) {
     switch (ctx->rax)
     {
@@ -59,13 +234,21 @@ uint64_t syscall_common_handler(syscall_context_t *ctx) {
             const char *buf = (const char *)ctx->rsi;
             uint64_t len = ctx->rdx;
             
-            if (fd == 1) {
-                for (unsigned long i = 0; i < len; i++) {
-                    fb_put_char(buf[i], 0xAAAAAA);
+            if (fd != 1 || !user_range_ok(buf, len, VMA_READ)) return -1;
+
+            // copied in chunks outside the lock, a page fault can't happen while it is held
+            char chunk[128];
+            for (uint64_t done = 0; done < len;) {
+                uint64_t n = len - done < sizeof(chunk) ? len - done : sizeof(chunk);
+                if (!copy_from_user(chunk, buf + done, n)) return done ? (int64_t)done : -1;
+                spin_lock(&console_lock);
+                for (uint64_t i = 0; i < n; i++) {
+                    fb_put_char(chunk[i], 0xAAAAAA);
                 }
-                return len;
+                spin_unlock(&console_lock);
+                done += n;
             }
-            return -1;
+            return len;
         }
 
         case SYS_READ:
@@ -80,10 +263,19 @@ uint64_t syscall_common_handler(syscall_context_t *ctx) {
 
             static char line_buffer[256];
             static int line_pos = 0;
+            char line[sizeof(line_buffer)];
+            // checked before any input is taken; a line never exceeds the line buffer
+            uint64_t most = count < sizeof(line_buffer) - 1 ? count : sizeof(line_buffer) - 1;
+            if (!user_range_ok(user_buf, most, VMA_WRITE)) return -1;
             
+            // readers take turns on the keyboard ring and the line, and the echo shares
+            // the screen with SYS_WRITE
             while (1) {
-                while (!keyboard_has_data()) {
-                    asm("pause");
+                spin_lock(&console_lock);
+                if (!keyboard_has_data()) {
+                    spin_unlock(&console_lock);
+                    console_wait(ctx);
+                    continue;
                 }
                 
                 char c = keyboard_get_char();
@@ -91,12 +283,15 @@ uint64_t syscall_common_handler(syscall_context_t *ctx) {
                 if (c == '\n') {
                     int copy_size = (line_pos < count) ? line_pos : count;
                     for (int i = 0; i < copy_size; i++) {
-                        user_buf[i] = line_buffer[i];
+                        line[i] = line_buffer[i];
                     }
                     
                     line_pos = 0;
                     
                     fb_put_char('\n', 0xFFFFFF);
+                    spin_unlock(&console_lock);
+                    // the user buffer may fault, not with the lock held
+                    if (!copy_to_user(user_buf, line, copy_size)) return -1;
                     return copy_size;
                 }
                 else if (c == '\b' || c == 127) {
@@ -111,16 +306,70 @@ uint64_t syscall_common_handler(syscall_context_t *ctx) {
                         fb_put_char(c, 0xFFFFFF);
                     }
                 }
+                spin_unlock(&console_lock);
             }
         }
         
+        case SYS_OPEN:
+        {
+            return sys_open((const char *)ctx->rdi);
+        }
+
+        case SYS_CLOSE:
+        {
+            int64_t fd = ctx->rdi;
+            if (fd < TASK_FD_BASE || fd >= TASK_FD_BASE + TASK_MAX_FILES) return -1;
+            task_file_t *file = &current_task->files[fd - TASK_FD_BASE];
+            if (!file->data) return -1;
+            // existing mappings keep pointing into the initrd, they don't need the fd
+            file->data = NULL;
+            file->size = 0;
+            return 0;
+        }
+
+        case SYS_MMAP:
+        {
+            return do_mmap(current_task, ctx->rdi, ctx->rsi, ctx->rdx, ctx->r10, ctx->r8, ctx->r9);
+        }
+
+        case SYS_MPROTECT:
+        {
+            return do_mprotect(current_task, ctx->rdi, ctx->rsi, ctx->rdx);
+        }
+
+        case SYS_MUNMAP:
+        {
+            return do_munmap(current_task, ctx->rdi, ctx->rsi);
+        }
+
+        case SYS_BRK:
+        {
+            return do_brk(current_task, ctx->rdi);
+        }
+
+        case SYS_NANOSLEEP:
+        {
+            return sys_nanosleep(ctx, (const int64_t *)ctx->rdi);
+        }
+
         case SYS_GETPID:
         {
             return current_task->pid;
         }
 
+        case SYS_FORK:
+        {
+            task_t *child = sys_fork(ctx);
+            if (!child) return -1;
+            // once queued another cpu may run, exit and reap it before we get back here
+            uint32_t pid = child->pid;
+            scheduler_add_task(child);
+            return pid;
+        }
+
         case SYS_EXIT:
         {
+            spin_lock(&console_lock);
             fb_print("\n[task pid: ", 0xAAAAAA);
             u64_to_dec(current_task->pid, buf);
             fb_print(buf, 0xAAAAAA);
@@ -128,16 +377,39 @@ uint64_t syscall_common_handler(syscall_context_t *ctx) {
             u64_to_dec(ctx->rdi, buf);
             fb_print(buf, 0xAAAAAA);
             fb_print("\n", 0);
+            spin_unlock(&console_lock);
 
-            current_task->state = TASK_DEAD;
+            // we are still on the dying task's kernel stack, so it is freed once this cpu is off it
+            task_exit(current_task);
+            if (!scheduler_has_tasks()) fb_print("no tasks left\n", 0xAAAAAA);
+            scheduler_run_next();
+        }
 
-            task_t *next = scheduler_next();
-            if (!next) {
-                fb_print("no tasks left\n", 0xAAAAAA);
-                while (1) asm volatile("hlt");
-            }
-            task_enter(next);
-            __builtin_unreachable();
+        case SYS_SETPRIORITY:
+        {
+            // nice -20..19 in rdx; only the caller itself can be named, there is no pid lookup
+            if (ctx->rdi != PRIO_PROCESS) return -1;
+            if (ctx->rsi != 0 && ctx->rsi != current_task->pid) return -1;
+            int64_t nice = (int64_t)ctx->rdx;
+            if (nice < -20) nice = -20;
+            if (nice > 19) nice = 19;
+            task_set_nice(current_task, (int)nice);
+            return 0;
+        }
+
+        case SYS_SCHED_SETSCHEDULER:
+        {
+            // (pid, policy, struct sched_param *); SCHED_RR priorities 1..99 spread over
+            // the run queue levels, 99 landing on level 0
+            if (ctx->rdi != 0 && ctx->rdi != current_task->pid) return -1;
+            int param;
+            if (!copy_from_user(&param, (const void *)ctx->rdx, sizeof(param))) return -1;
+            int64_t prio = param;
+            if (ctx->rsi == SCHED_RR && (prio < 1 || prio > 99)) return -1;
+            if (ctx->rsi == SCHED_FAIR && prio != 0) return -1;
+
+            uint32_t level = ctx->rsi == SCHED_RR ? (uint32_t)((99 - prio) * (TASK_PRIO_LEVELS - 1) / 98) : 0;
+            return task_set_policy(current_task, (uint32_t)ctx->rsi, level) ? 0 : -1;
         }
 
         default:
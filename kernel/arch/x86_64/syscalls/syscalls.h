@@ -2,5 +2,6 @@
 #define ESTELLA_ARCH_X86_64_SYSCALLS_SYSCALLS_H
 
 void syscalls_init(void);
+void syscalls_init_ap(void);
 
 #endif
\ No newline at end of file
@@ -1,13 +1,13 @@
 #include <arch/x86_64/time/hpet.h>
 #include <arch/x86_64/acpi/acpi.h>
 #include <arch/x86_64/mm/vmm.h>
+#include <mm/vmalloc.h>
 #include <drivers/serial.h>
 #include <klib/string.h>
 
 uint64_t hpet_va = 0;
 uint64_t hpet_frequency_hz = 0;
 
-extern uint64_t hhdm_offset;
 
 inline uint64_t hpet_read(uint64_t offset) {
     return *(volatile uint64_t *)(hpet_va + offset);
@@ -25,9 +25,11 @@ void hpet_init(void *rsdp_ptr) {
     }
 
     uint64_t hpet_phys = hpet->base_address.address;
-    hpet_va = hpet_phys + hhdm_offset;
-
-    vmm_map(hpet_va, hpet_phys, PTE_KERNEL_RW | PTE_PCD | PTE_PWT);
+    hpet_va = (uint64_t)ioremap(hpet_phys, PAGE_SIZE, IOREMAP_UC);
+    if (!hpet_va) {
+        serial_puts("HPET: ioremap failed\n");
+        return;
+    }
 
     uint64_t capabilities = hpet_read(HPET_CAPABILITIES);
     uint32_t period_fs = (capabilities >> 32) & 0xFFFFFFFF;
@@ -3,13 +3,13 @@
 
 #include <arch/x86_64/mm/vmm.h>
 #include <mm/pmm.h>
+#include <mm/page.h>
 #include <klib/memory.h>
 #include <drivers/serial.h>
 #include <arch/x86_64/usermode/elf.h>
+#include <mm/vma.h>
 
-bool load_elf(void *elf_data, uint64_t *pml4, uint64_t *entry_point_out) {
-    Elf64_Ehdr *ehdr = (Elf64_Ehdr *)elf_data;
-
+static bool elf_header_valid(Elf64_Ehdr *ehdr) {
     if (memcmp(ehdr->e_ident, "\x7F" "ELF", 4) != 0 ||
         ehdr->e_ident[4] != 2 ||    // 64-bit
         ehdr->e_ident[5] != 1 ||    // Little-endian
@@ -18,6 +18,12 @@ bool load_elf(void *elf_data, uint64_t *pml4, uint64_t *entry_point_out) {
         serial_puts("Invalid ELF header\n");
         return false;
     }
+    return true;
+}
+
+bool load_elf(void *elf_data, uint64_t *pml4, uint64_t *entry_point_out) {
+    Elf64_Ehdr *ehdr = (Elf64_Ehdr *)elf_data;
+    if (!elf_header_valid(ehdr)) return false;
 
     *entry_point_out = ehdr->e_entry;
 
@@ -35,27 +41,76 @@ bool load_elf(void *elf_data, uint64_t *pml4, uint64_t *entry_point_out) {
         uint64_t page_offset = vaddr - page_start;
         size_t num_pages = (memsz + page_offset + PAGE_SIZE - 1) / PAGE_SIZE;
 
-        void *phys = pmm_alloc_frames_zeroed(num_pages);
-        if (!phys) {
-            serial_puts("Failed to alloc phys mem for ELF segment\n");
-            return false;
-        }
-
-        uintptr_t virt_base = phys_to_virt((uintptr_t)phys);
-        void *dest = (void *)(virt_base + page_offset);
-        memcpy(dest, elf_data + offset, filesz);
-
         uint64_t pte_flags = PTE_PRESENT | PTE_USER;
         if (phdr[i].p_flags & PF_W) pte_flags |= PTE_WRITE;
         if (!(phdr[i].p_flags & PF_X)) pte_flags |= PTE_NX;
 
-        bool success = vmm_map_range_for_pml4(pml4, page_start, (uint64_t)phys, num_pages, pte_flags);
-        if (!success) {
-            serial_puts("Failed to map ELF segment\n");
-            pmm_free_frames(phys, num_pages);
+        // page by page: single frames come from the per-cpu cache
+        for (size_t p = 0; p < num_pages; p++) {
+            uint64_t page_va = page_start + p * PAGE_SIZE;
+
+            void *phys = pmm_alloc_zeroed();
+            if (!phys) {
+                serial_puts("Failed to alloc phys mem for ELF segment\n");
+                return false;
+            }
+            phys_to_page((uint64_t)phys)->flags |= PG_USER;
+
+            uint64_t copy_start = page_va > vaddr ? page_va : vaddr;
+            uint64_t copy_end = page_va + PAGE_SIZE;
+            if (copy_end > vaddr + filesz) copy_end = vaddr + filesz;
+            if (copy_end > copy_start) {
+                void *dest = (void *)(phys_to_virt((uint64_t)phys) + (copy_start - page_va));
+                memcpy(dest, elf_data + offset + (copy_start - vaddr), copy_end - copy_start);
+            }
+
+            if (!vmm_map_for_pml4(pml4, page_va, (uint64_t)phys, pte_flags)) {
+                serial_puts("Failed to map ELF segment\n");
+                pmm_free(phys);
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+bool load_elf_demand(void *elf_data, struct mm *mm, uint64_t *entry_point_out) {
+    Elf64_Ehdr *ehdr = (Elf64_Ehdr *)elf_data;
+    if (!elf_header_valid(ehdr)) return false;
+
+    *entry_point_out = ehdr->e_entry;
+
+    Elf64_Phdr *phdr = (Elf64_Phdr *)(elf_data + ehdr->e_phoff);
+    for (uint16_t i = 0; i < ehdr->e_phnum; i++) {
+        if (phdr[i].p_type != 1 || phdr[i].p_memsz == 0) continue;
+
+        uint64_t vaddr = phdr[i].p_vaddr;
+        uint64_t start = vaddr & ~(PAGE_SIZE - 1);
+        uint64_t end = (vaddr + phdr[i].p_memsz + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+        uint32_t prot = VMA_READ;
+        if (phdr[i].p_flags & PF_W) prot |= VMA_WRITE;
+        if (phdr[i].p_flags & PF_X) prot |= VMA_EXEC;
+
+        struct vma *vma = vma_create(start, end, prot);
+        if (!vma) {
+            serial_puts("Failed to alloc vma for ELF segment\n");
+            return false;
+        }
+        // the initrd stays mapped for good, so pages are read straight out of it on fault
+        vma->file = (const uint8_t *)elf_data + phdr[i].p_offset;
+        vma->file_start = vaddr;
+        vma->file_size = phdr[i].p_filesz;
+
+        if (!mm_insert(mm, vma)) {
+            serial_puts("Overlapping ELF segments\n");
+            vma_free(vma);
             return false;
         }
+        // the heap starts right after the image
+        if (end > mm->brk_start) mm->brk_start = mm->brk = end;
     }
 
     return true;
-}
\ No newline at end of file
+}
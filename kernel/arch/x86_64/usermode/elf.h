@@ -8,7 +8,11 @@
 #define PF_W 0x2
 #define PF_R 0x4
 
+struct mm;
+
 bool load_elf(void *elf_data, uint64_t *pml4, uint64_t *entry_point_out);
+// only records the PT_LOAD segments as vmas, pages are filled in by the page fault handler
+bool load_elf_demand(void *elf_data, struct mm *mm, uint64_t *entry_point_out);
 
 typedef struct {
     uint8_t  e_ident[16];
@@ -0,0 +1,132 @@
+#include <arch/x86_64/usermode/elf_image.h>
+#include <arch/x86_64/usermode/elf.h>
+#include <arch/x86_64/mm/fault.h>
+#include <arch/x86_64/mm/vmm.h>
+#include <arch/x86_64/cpu/spinlock.h>
+#include <mm/page.h>
+#include <mm/slab.h>
+#include <mm/vma.h>
+
+static elf_image_t *images;
+static spinlock_t image_lock = SPINLOCK_INIT;
+
+static void image_free(elf_image_t *image) {
+    for (size_t s = 0; s < image->segment_count; s++) {
+        struct elf_image_segment *seg = &image->segments[s];
+        if (!seg->frames) continue;
+        for (uint64_t i = 0; i < (seg->end - seg->start) / PAGE_SIZE; i++) {
+            if (seg->frames[i]) page_put(phys_to_page(seg->frames[i]));
+        }
+        kfree(seg->frames);
+    }
+    kfree(image);
+}
+
+static elf_image_t *image_create(const void *elf) {
+    const Elf64_Ehdr *ehdr = elf;
+    const Elf64_Phdr *phdr = (const Elf64_Phdr *)((const uint8_t *)elf + ehdr->e_phoff);
+
+    elf_image_t *image = kzalloc(sizeof(elf_image_t));
+    if (!image) return NULL;
+    image->elf = elf;
+
+    for (uint16_t i = 0; i < ehdr->e_phnum; i++) {
+        if (phdr[i].p_type != 1 || phdr[i].p_memsz == 0 || (phdr[i].p_flags & PF_W)) continue;
+        if (image->segment_count == ELF_IMAGE_MAX_SEGMENTS) break;
+
+        struct elf_image_segment *seg = &image->segments[image->segment_count++];
+        seg->start = phdr[i].p_vaddr & ~(PAGE_SIZE - 1);
+        seg->end = (phdr[i].p_vaddr + phdr[i].p_memsz + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+        seg->file = (const uint8_t *)elf + phdr[i].p_offset;
+        seg->frames = kzalloc((seg->end - seg->start) / PAGE_SIZE * sizeof(uint64_t));
+        if (!seg->frames) {
+            image_free(image);
+            return NULL;
+        }
+    }
+
+    if (!image->segment_count) {
+        kfree(image);
+        return NULL;
+    }
+    return image;
+}
+
+elf_image_t *elf_image_get(const void *elf) {
+    uint64_t flags = spin_lock_irqsave(&image_lock);
+    for (elf_image_t *image = images; image; image = image->next) {
+        if (image->elf == elf) {
+            image->users++;
+            spin_unlock_irqrestore(&image_lock, flags);
+            return image;
+        }
+    }
+    spin_unlock_irqrestore(&image_lock, flags);
+
+    // built unlocked, a racing loader of the same elf just keeps its own copy out of the list
+    elf_image_t *image = image_create(elf);
+    if (!image) return NULL;
+    image->users = 1;
+
+    flags = spin_lock_irqsave(&image_lock);
+    image->next = images;
+    images = image;
+    spin_unlock_irqrestore(&image_lock, flags);
+    return image;
+}
+
+elf_image_t *elf_image_dup(elf_image_t *image) {
+    if (!image) return NULL;
+    uint64_t flags = spin_lock_irqsave(&image_lock);
+    image->users++;
+    spin_unlock_irqrestore(&image_lock, flags);
+    return image;
+}
+
+void elf_image_put(elf_image_t *image) {
+    if (!image) return;
+
+    uint64_t flags = spin_lock_irqsave(&image_lock);
+    bool last = --image->users == 0;
+    if (last) {
+        elf_image_t **link = &images;
+        while (*link && *link != image) link = &(*link)->next;
+        if (*link) *link = image->next;
+    }
+    spin_unlock_irqrestore(&image_lock, flags);
+
+    if (last) image_free(image);
+}
+
+uint64_t elf_image_page(elf_image_t *image, const struct vma *vma, uint64_t page) {
+    struct elf_image_segment *seg = NULL;
+    for (size_t s = 0; s < image->segment_count; s++) {
+        // munmap + MAP_FIXED can put something else at the same address
+        if (image->segments[s].file == vma->file && image->segments[s].start <= page
+            && page < image->segments[s].end) {
+            seg = &image->segments[s];
+            break;
+        }
+    }
+    if (!seg) return 0;
+
+    uint64_t *slot = &seg->frames[(page - seg->start) / PAGE_SIZE];
+    uint64_t frame = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    if (!frame) {
+        void *filled = fault_read_page(vma, page);
+        if (!filled) return 0;
+
+        // someone else may have filled it meanwhile, theirs wins
+        uint64_t expected = 0;
+        if (__atomic_compare_exchange_n(slot, &expected, (uint64_t)filled, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            frame = (uint64_t)filled;
+        } else {
+            page_put(phys_to_page((uint64_t)filled));
+            frame = expected;
+        }
+    }
+
+    page_get(phys_to_page(frame));
+    return frame;
+}
@@ -0,0 +1,40 @@
+#ifndef ESTELLA_ARCH_X86_64_USERMODE_ELF_IMAGE_H
+#define ESTELLA_ARCH_X86_64_USERMODE_ELF_IMAGE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define ELF_IMAGE_MAX_SEGMENTS 4
+
+struct vma;
+
+// one read-only PT_LOAD segment; frames[i] backs page i once someone touched it
+struct elf_image_segment {
+    uint64_t start;          // page aligned, like the vma load_elf_demand makes
+    uint64_t end;
+    const uint8_t *file;
+    uint64_t *frames;
+};
+
+// the read-only pages of one initrd ELF, shared by every task running it.
+// the image holds a reference on each frame it filled, each mapping holds another
+typedef struct elf_image {
+    const void *elf;         // the cpio entry's data, which is the cache key
+    uint32_t users;
+    size_t segment_count;
+    struct elf_image_segment segments[ELF_IMAGE_MAX_SEGMENTS];
+    struct elf_image *next;
+} elf_image_t;
+
+// the cached image of elf, created on first use. NULL if it has no read-only segments
+elf_image_t *elf_image_get(const void *elf);
+elf_image_t *elf_image_dup(elf_image_t *image);
+// the last user frees the image and drops its frame references
+void elf_image_put(elf_image_t *image);
+
+// the shared frame for page of vma, filled on first use, with a reference taken for
+// the caller's mapping. 0 if vma isn't one of the image's segments
+uint64_t elf_image_page(elf_image_t *image, const struct vma *vma, uint64_t page);
+
+#endif
@@ -0,0 +1,216 @@
+// fair scheduling class: every task accrues virtual runtime, the wall clock cycles it ran
+// scaled by nice 0's weight over its own, and the one furthest behind runs next
+#include <arch/x86_64/usermode/sched_fair.h>
+#include <arch/x86_64/usermode/scheduler.h>
+#include <arch/x86_64/time/tsc.h>
+
+// linux's table: one nice step is ~1.25x the weight
+static const uint32_t nice_to_weight[40] = {
+    88761, 71755, 56483, 46273, 36291,
+    29154, 23254, 18705, 14949, 11916,
+     9548,  7620,  6100,  4904,  3906,
+     3121,  2501,  1991,  1586,  1277,
+     1024,   820,   655,   526,   423,
+      335,   272,   215,   172,   137,
+      110,    87,    70,    56,    45,
+       36,    29,    23,    18,    15,
+};
+
+static struct fair_tunables tunables = {
+    .latency_us = 18000,
+    .min_granularity_us = 2250,
+    .wakeup_granularity_us = 3000,
+};
+
+// the same in tsc cycles
+static uint64_t latency;
+static uint64_t min_granularity;
+static uint64_t wakeup_granularity;
+
+static uint64_t us_to_cycles(uint32_t us) {
+    return tsc_frequency_hz / 1000000 * us;
+}
+
+void fair_init(void) {
+    fair_set_tunables(&tunables);
+}
+
+void fair_get_tunables(struct fair_tunables *out) {
+    *out = tunables;
+}
+
+void fair_set_tunables(const struct fair_tunables *in) {
+    tunables = *in;
+    if (tunables.min_granularity_us == 0) tunables.min_granularity_us = 1;
+    if (tunables.latency_us < tunables.min_granularity_us) tunables.latency_us = tunables.min_granularity_us;
+
+    latency = us_to_cycles(tunables.latency_us);
+    min_granularity = us_to_cycles(tunables.min_granularity_us);
+    wakeup_granularity = us_to_cycles(tunables.wakeup_granularity_us);
+}
+
+uint32_t fair_weight(int nice) {
+    if (nice < -20) nice = -20;
+    if (nice > 19) nice = 19;
+    return nice_to_weight[nice + 20];
+}
+
+// vruntimes are compared by their signed distance, like cfs does: a task rebased onto
+// another queue or placed below min_vruntime may sit just under zero and wrap around
+static bool vruntime_before(uint64_t a, uint64_t b) {
+    return (int64_t)(a - b) < 0;
+}
+
+// avl tree like the vma one, keyed by vruntime with the pid breaking ties so that every
+// key is distinct. a queued task's vruntime doesn't change, only the running one's does
+
+static bool key_less(struct task *a, struct task *b) {
+    if (a->vruntime != b->vruntime) return vruntime_before(a->vruntime, b->vruntime);
+    return a->pid < b->pid;
+}
+
+static int height(struct task *node) {
+    return node ? node->fair_height : 0;
+}
+
+static void update_height(struct task *node) {
+    int l = height(node->fair_left), r = height(node->fair_right);
+    node->fair_height = (l > r ? l : r) + 1;
+}
+
+static struct task *rotate_right(struct task *node) {
+    struct task *pivot = node->fair_left;
+    node->fair_left = pivot->fair_right;
+    pivot->fair_right = node;
+    update_height(node);
+    update_height(pivot);
+    return pivot;
+}
+
+static struct task *rotate_left(struct task *node) {
+    struct task *pivot = node->fair_right;
+    node->fair_right = pivot->fair_left;
+    pivot->fair_left = node;
+    update_height(node);
+    update_height(pivot);
+    return pivot;
+}
+
+static struct task *rebalance(struct task *node) {
+    update_height(node);
+    int balance = height(node->fair_left) - height(node->fair_right);
+
+    if (balance > 1) {
+        if (height(node->fair_left->fair_left) < height(node->fair_left->fair_right)) {
+            node->fair_left = rotate_left(node->fair_left);
+        }
+        return rotate_right(node);
+    }
+    if (balance < -1) {
+        if (height(node->fair_right->fair_right) < height(node->fair_right->fair_left)) {
+            node->fair_right = rotate_right(node->fair_right);
+        }
+        return rotate_left(node);
+    }
+    return node;
+}
+
+static struct task *tree_insert(struct task *node, struct task *task) {
+    if (!node) {
+        task->fair_left = task->fair_right = NULL;
+        task->fair_height = 1;
+        return task;
+    }
+    if (key_less(task, node)) node->fair_left = tree_insert(node->fair_left, task);
+    else node->fair_right = tree_insert(node->fair_right, task);
+    return rebalance(node);
+}
+
+static struct task *tree_remove_min(struct task *node, struct task **min) {
+    if (!node->fair_left) {
+        *min = node;
+        return node->fair_right;
+    }
+    node->fair_left = tree_remove_min(node->fair_left, min);
+    return rebalance(node);
+}
+
+static struct task *tree_remove(struct task *node, struct task *task) {
+    if (!node) return NULL;
+
+    if (node == task) {
+        if (!node->fair_left) return node->fair_right;
+        if (!node->fair_right) return node->fair_left;
+
+        struct task *min;
+        struct task *right = tree_remove_min(node->fair_right, &min);
+        min->fair_left = node->fair_left;
+        min->fair_right = right;
+        node = min;
+    } else if (key_less(task, node)) {
+        node->fair_left = tree_remove(node->fair_left, task);
+    } else {
+        node->fair_right = tree_remove(node->fair_right, task);
+    }
+    return rebalance(node);
+}
+
+static struct task *tree_first(struct task *node) {
+    while (node && node->fair_left) node = node->fair_left;
+    return node;
+}
+
+void fair_enqueue(fair_queue_t *fq, struct task *task) {
+    fq->root = tree_insert(fq->root, task);
+    if (!fq->leftmost || key_less(task, fq->leftmost)) fq->leftmost = task;
+    fq->load += task->weight;
+    fq->nr++;
+}
+
+void fair_dequeue(fair_queue_t *fq, struct task *task) {
+    fq->root = tree_remove(fq->root, task);
+    if (fq->leftmost == task) fq->leftmost = tree_first(fq->root);
+    task->fair_left = task->fair_right = NULL;
+    fq->load -= task->weight;
+    fq->nr--;
+}
+
+void fair_account(struct task *task, uint64_t delta) {
+    if (task->weight == FAIR_NICE_0_WEIGHT) task->vruntime += delta;
+    else task->vruntime += delta * FAIR_NICE_0_WEIGHT / task->weight;
+}
+
+void fair_update_min(fair_queue_t *fq, struct task *curr) {
+    uint64_t vruntime = fq->min_vruntime;
+    if (curr) vruntime = curr->vruntime;
+    if (fq->leftmost && (!curr || vruntime_before(fq->leftmost->vruntime, vruntime))) {
+        vruntime = fq->leftmost->vruntime;
+    }
+    if (vruntime_before(fq->min_vruntime, vruntime)) fq->min_vruntime = vruntime;
+}
+
+void fair_place(fair_queue_t *fq, struct task *task, bool wakeup) {
+    if (!wakeup) {
+        task->vruntime = fq->min_vruntime;
+        return;
+    }
+    // a long sleep doesn't bank an unbounded claim on the cpu
+    uint64_t floor = fq->min_vruntime - latency / 2;
+    if (vruntime_before(task->vruntime, floor)) task->vruntime = floor;
+}
+
+uint64_t fair_slice(fair_queue_t *fq, struct task *curr) {
+    uint64_t nr = fq->nr + 1;
+    uint64_t period = latency;
+    if (nr * min_granularity > period) period = nr * min_granularity;
+
+    uint64_t slice = period * curr->weight / (fq->load + curr->weight);
+    return slice > min_granularity ? slice : min_granularity;
+}
+
+bool fair_should_preempt(fair_queue_t *fq, struct task *curr, bool slice_used) {
+    struct task *next = fq->leftmost;
+    if (!next) return false;
+    uint64_t lead = slice_used ? 0 : wakeup_granularity;
+    return vruntime_before(next->vruntime + lead, curr->vruntime);
+}
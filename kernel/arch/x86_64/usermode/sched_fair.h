@@ -0,0 +1,52 @@
+#ifndef ESTELLA_ARCH_X86_64_USERMODE_SCHED_FAIR_H
+#define ESTELLA_ARCH_X86_64_USERMODE_SCHED_FAIR_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+struct task;
+
+// weight of a nice 0 task; vruntime advances at wall clock speed for it
+#define FAIR_NICE_0_WEIGHT 1024
+
+struct fair_tunables {
+    uint32_t latency_us;             // every ready task gets a turn within this period...
+    uint32_t min_granularity_us;     // ...unless that would cut slices below this
+    uint32_t wakeup_granularity_us;  // a woken task preempts only when this far behind
+};
+
+// ready fair tasks of one cpu, ordered by vruntime in an avl tree
+typedef struct {
+    struct task *root;
+    struct task *leftmost;   // runs next
+    uint64_t min_vruntime;   // only moves forward; new and waking tasks are placed against it
+    uint64_t load;           // sum of the queued weights
+    uint32_t nr;
+} fair_queue_t;
+
+// defaults; needs the tsc calibrated
+void fair_init(void);
+void fair_get_tunables(struct fair_tunables *tunables);
+void fair_set_tunables(const struct fair_tunables *tunables);
+
+// nice -20..19 to a weight, each step is about 10% of cpu time
+uint32_t fair_weight(int nice);
+
+void fair_enqueue(fair_queue_t *fq, struct task *task);
+void fair_dequeue(fair_queue_t *fq, struct task *task);
+
+// charge delta tsc cycles of cpu time to the task
+void fair_account(struct task *task, uint64_t delta);
+// move min_vruntime up to the smaller of the running task's vruntime (NULL if the cpu runs
+// something else) and the leftmost one's
+void fair_update_min(fair_queue_t *fq, struct task *curr);
+// vruntime for a task joining the queue: a new one starts at min_vruntime, a waking one
+// keeps its own unless that is more than half a latency period behind
+void fair_place(fair_queue_t *fq, struct task *task, bool wakeup);
+// cycles curr may run before it gives way: its weighted share of the latency period
+uint64_t fair_slice(fair_queue_t *fq, struct task *curr);
+// whether the leftmost task should take over from curr. before curr's slice is used up
+// it has to be ahead by the wakeup granularity
+bool fair_should_preempt(fair_queue_t *fq, struct task *curr, bool slice_used);
+
+#endif
@@ -1,80 +1,327 @@
 #include <arch/x86_64/usermode/scheduler.h>
 #include <mm/pmm.h>
+#include <mm/page.h>
+#include <mm/slab.h>
+#include <mm/vma.h>
 #include <arch/x86_64/mm/vmm.h>
-#include <arch/x86_64/cpu/gdt.h>
+#include <arch/x86_64/cpu/spinlock.h>
 #include <klib/memory.h>
 #include <drivers/serial.h>
 #include <arch/x86_64/usermode/elf.h>
+#include <arch/x86_64/usermode/elf_image.h>
 #include <klib/string.h>
+#include <arch/x86_64/cpu/percpu.h>
+#include <arch/x86_64/cpu/smp.h>
+#include <arch/x86_64/cpu/idle.h>
+#include <arch/x86_64/usermode/usermode.h>
+#include <arch/x86_64/usermode/sched_fair.h>
+#include <arch/x86_64/time/tsc.h>
+#include <arch/x86_64/interrupts/apictimer.h>
 
-task_t *current_task = NULL;
-static task_t *run_queue_head = NULL;
+// ready tasks per cpu, each queue on its own cache line: round-robin ones in one fifo per
+// priority level with a bitmap of the non-empty levels, fair ones in a vruntime tree. a
+// task sits on the queue of its home cpu; the running one is on none. only a stealing cpu
+// touches another cpu's queue, and it never holds two queue locks at once. sleeping tasks
+// wait on the same lock, on a list only their cpu's timer takes them off
+typedef struct {
+    spinlock_t lock;
+    uint32_t nr;        // both classes, read unlocked by stealers looking for the busiest queue
+    uint64_t bitmap;    // bit n set while level n has a task, the lowest one runs first
+    task_t *head[TASK_PRIO_LEVELS];
+    task_t *tail[TASK_PRIO_LEVELS];
+    fair_queue_t fair;
+    task_t *sleepers;   // soonest wake_at first, chained through next
+} __attribute__((aligned(64))) run_queue_t;
+
+_Static_assert(TASK_PRIO_LEVELS <= 64, "one bitmap word per queue");
+
+// what runs first, as one number: a round-robin level, then the fair class
+#define RANK_FAIR TASK_PRIO_LEVELS
+#define RANK_NONE (TASK_PRIO_LEVELS + 1)
+
+static run_queue_t run_queues[MAX_CPUS];
+static uint32_t nr_tasks;   // queued, running or blocked, for scheduler_has_tasks
+static kmem_cache_t *task_cache;
+
+// dead tasks off the run queue, freed later by task_reap_zombies
+static task_t *zombie_head = NULL;
+static spinlock_t zombie_lock = SPINLOCK_INIT;
 
-extern struct tss_struct tss;
 extern uint64_t kernel_pml4_phys;
 
 void scheduler_init(void) {
-    run_queue_head = NULL;
     current_task   = NULL;
+    task_cache     = kmem_cache_create("task_t", sizeof(task_t), 64);
+    fair_init();
     serial_puts("[scheduler] initialized\n");
 }
 
-void scheduler_add_task(task_t *task) {
+static uint32_t task_rank(task_t *task) {
+    return task->policy == SCHED_RR ? task->prio : RANK_FAIR;
+}
+
+// rank of the best ready task, RANK_NONE if there is none
+static uint32_t rq_top(run_queue_t *rq) {
+    uint64_t bitmap = __atomic_load_n(&rq->bitmap, __ATOMIC_RELAXED);
+    if (bitmap) return (uint32_t)__builtin_ctzll(bitmap);
+    return __atomic_load_n(&rq->fair.nr, __ATOMIC_RELAXED) ? RANK_FAIR : RANK_NONE;
+}
+
+// front is for round-robin tasks that just woke up, they go ahead of the others at their level
+static void rq_push(run_queue_t *rq, task_t *task, bool front) {
     task->state = TASK_READY;
-    if (!run_queue_head) {
-        run_queue_head = task;
-        task->next = task;
+    __atomic_store_n(&rq->nr, rq->nr + 1, __ATOMIC_RELAXED);
+    if (task->policy != SCHED_RR) {
+        fair_enqueue(&rq->fair, task);
         return;
     }
-    task_t *tail = run_queue_head;
-    while (tail->next != run_queue_head) tail = tail->next;
-    tail->next = task;
-    task->next = run_queue_head;
+
+    uint32_t level = task->prio;
+    if (front) {
+        task->next = rq->head[level];
+        rq->head[level] = task;
+        if (!rq->tail[level]) rq->tail[level] = task;
+    } else {
+        task->next = NULL;
+        if (rq->tail[level]) rq->tail[level]->next = task;
+        else rq->head[level] = task;
+        rq->tail[level] = task;
+    }
+    __atomic_store_n(&rq->bitmap, rq->bitmap | (1ULL << level), __ATOMIC_RELAXED);
 }
 
-task_t *scheduler_next(void) {
-    if (!run_queue_head) return NULL;
+static void rq_unlink(run_queue_t *rq, task_t *task, task_t *prev) {
+    uint32_t level = task->prio;
+    if (prev) prev->next = task->next;
+    else rq->head[level] = task->next;
+    if (rq->tail[level] == task) rq->tail[level] = prev;
+    if (!rq->head[level]) {
+        __atomic_store_n(&rq->bitmap, rq->bitmap & ~(1ULL << level), __ATOMIC_RELAXED);
+    }
+    task->next = NULL;
+}
+
+// the task rq_pop would hand out
+static task_t *rq_peek(run_queue_t *rq) {
+    uint32_t top = rq_top(rq);
+    if (top == RANK_NONE) return NULL;
+    return top == RANK_FAIR ? rq->fair.leftmost : rq->head[top];
+}
 
-    task_t *start = current_task ? current_task->next : run_queue_head;
-    task_t *t = start;
-    do {
-        if (t->state == TASK_READY || t->state == TASK_RUNNING)
-            return t;
-        t = t->next;
-    } while (t != start);
+static task_t *rq_pop(run_queue_t *rq) {
+    task_t *task = rq_peek(rq);
+    if (!task) return NULL;
+    if (task->policy == SCHED_RR) rq_unlink(rq, task, NULL);
+    else fair_dequeue(&rq->fair, task);
+    __atomic_store_n(&rq->nr, rq->nr - 1, __ATOMIC_RELAXED);
 
-    return NULL;
+    task->state = TASK_RUNNING;
+    task->on_cpu = true;
+    task->exec_start = rdtsc();
+    task->slice_start = task->sum_exec;
+    return task;
+}
+
+// task_exit and the priority setters take a task out of the middle; the fifo walk is fine there
+static void rq_remove(run_queue_t *rq, task_t *task) {
+    if (task->policy != SCHED_RR) {
+        fair_dequeue(&rq->fair, task);
+    } else {
+        task_t *prev = NULL;
+        task_t *t = rq->head[task->prio];
+        while (t && t != task) {
+            prev = t;
+            t = t->next;
+        }
+        if (!t) return;
+        rq_unlink(rq, task, prev);
+    }
+    __atomic_store_n(&rq->nr, rq->nr - 1, __ATOMIC_RELAXED);
+}
+
+// the queue the task is on, or would go back to, locked. task->cpu only changes under
+// that queue's lock, so it is stable once the lock is held and still matches
+static run_queue_t *task_rq_lock(task_t *task, uint64_t *flags) {
+    for (;;) {
+        uint32_t cpu = __atomic_load_n(&task->cpu, __ATOMIC_RELAXED);
+        run_queue_t *rq = &run_queues[cpu];
+        *flags = spin_lock_irqsave(&rq->lock);
+        if (__atomic_load_n(&task->cpu, __ATOMIC_RELAXED) == cpu) return rq;
+        spin_unlock_irqrestore(&rq->lock, *flags);
+    }
+}
+
+// charge the running task for the cycles since it was last charged
+static void account_curr(task_t *curr) {
+    uint64_t now = rdtsc();
+    uint64_t delta = now - curr->exec_start;
+    curr->exec_start = now;
+    curr->sum_exec += delta;
+    if (curr->policy != SCHED_RR) fair_account(curr, delta);
+}
+
+// cycles curr gets per turn: a fixed quantum for round-robin, a weighted share of the
+// latency period for fair
+static uint64_t slice_length(run_queue_t *rq, task_t *curr) {
+    if (curr->policy == SCHED_RR) return tsc_frequency_hz / 1000000 * SCHED_QUANTUM_US;
+    return fair_slice(&rq->fair, curr);
+}
+
+// whether curr has had its turn since it was picked
+static bool slice_used(run_queue_t *rq, task_t *curr) {
+    return curr->sum_exec - curr->slice_start >= slice_length(rq, curr);
+}
+
+// charge whatever the queue's cpu is running up to now, before a task is placed against
+// min_vruntime: without a tick it may have run a long while since it was last charged.
+// rq is locked, so a task seen running there can't be released under us
+static void rq_update_curr(run_queue_t *rq, uint32_t cpu) {
+    task_t *curr = cpu_locals[cpu].current;
+    if (!curr || curr->cpu != cpu || !curr->on_cpu) return;
+    account_curr(curr);
+    fair_update_min(&rq->fair, curr->policy != SCHED_RR ? curr : NULL);
+}
+
+// have cpu weigh its running task against its queue now rather than when its turn ends
+static void resched_cpu(uint32_t cpu) {
+    cpu_locals[cpu].need_resched = true;
+    smp_kick(cpu);
+}
+
+// home for a task that never ran: the online cpu with the fewest ready tasks
+static uint32_t least_loaded_cpu(void) {
+    uint32_t best = this_cpu_id();
+    uint32_t best_nr = __atomic_load_n(&run_queues[best].nr, __ATOMIC_RELAXED);
+    for (uint32_t cpu = 0; cpu < MAX_CPUS && best_nr; cpu++) {
+        if (!smp_cpu_online(cpu)) continue;
+        uint32_t nr = __atomic_load_n(&run_queues[cpu].nr, __ATOMIC_RELAXED);
+        if (nr < best_nr) {
+            best = cpu;
+            best_nr = nr;
+        }
+    }
+    return best;
+}
+
+void scheduler_add_task(task_t *task) {
+    if (task->cpu == TASK_NO_CPU) task->cpu = least_loaded_cpu();
+    __atomic_add_fetch(&nr_tasks, 1, __ATOMIC_RELAXED);
+
+    uint64_t flags;
+    run_queue_t *rq = task_rq_lock(task, &flags);
+    if (task->policy != SCHED_RR) {
+        rq_update_curr(rq, task->cpu);
+        fair_place(&rq->fair, task, false);
+    }
+    rq_push(rq, task, false);
+    spin_unlock_irqrestore(&rq->lock, flags);
+
+    // its cpu may have no timer armed while it runs alone; it sets one for the end of the turn
+    smp_kick(task->cpu);
+}
+
+// take a ready task of max_rank or better from the busiest other queue, if that one has
+// at least min_nr waiting; the task's home moves here, its cache footprint is about to
+static task_t *steal_task(uint32_t min_nr, uint32_t max_rank) {
+    uint32_t self = this_cpu_id();
+    run_queue_t *victim = NULL;
+    uint32_t victim_nr = min_nr - 1;
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (cpu == self || !smp_cpu_online(cpu)) continue;
+        run_queue_t *rq = &run_queues[cpu];
+        uint32_t nr = __atomic_load_n(&rq->nr, __ATOMIC_RELAXED);
+        if (nr > victim_nr && rq_top(rq) <= max_rank) {
+            victim = rq;
+            victim_nr = nr;
+        }
+    }
+    if (!victim) return NULL;
+
+    uint64_t flags = spin_lock_irqsave(&victim->lock);
+    task_t *task = NULL;
+    if (victim->nr >= min_nr && rq_top(victim) <= max_rank && !rq_peek(victim)->pinned) {
+        task = rq_pop(victim);
+        __atomic_store_n(&task->cpu, self, __ATOMIC_RELAXED);
+        // vruntimes only mean something against their own queue's min_vruntime. the offset
+        // may be negative and wrap, the fair class compares by signed distance
+        if (task->policy != SCHED_RR) task->vruntime -= victim->fair.min_vruntime;
+    }
+    spin_unlock_irqrestore(&victim->lock, flags);
+
+    if (task && task->policy != SCHED_RR) {
+        run_queue_t *rq = &run_queues[self];
+        flags = spin_lock_irqsave(&rq->lock);
+        task->vruntime += rq->fair.min_vruntime;
+        spin_unlock_irqrestore(&rq->lock, flags);
+    }
+    return task;
+}
+
+bool scheduler_has_tasks(void) {
+    return __atomic_load_n(&nr_tasks, __ATOMIC_RELAXED) != 0;
 }
 
 static uint32_t next_pid = 1;
 
-task_t *task_create_from_elf(void *elf_data) {
-    task_t *task = (task_t *)phys_to_virt((uint64_t)pmm_alloc_zeroed());
-    task->pid = next_pid++;
+// fresh task with an empty lower half and the shared kernel half
+static task_t *task_alloc(void) {
+    task_t *task = kmem_cache_zalloc(task_cache);
+    if (!task) return NULL;
+    task->pid = __atomic_fetch_add(&next_pid, 1, __ATOMIC_RELAXED);
+    task->cpu = TASK_NO_CPU;
+    task->policy = SCHED_FAIR;
+    task->prio = TASK_PRIO_DEFAULT;
+    task->weight = fair_weight(0);
 
     uint64_t *pml4_phys = pmm_alloc_zeroed();
+    if (!pml4_phys) {
+        kmem_cache_free(task_cache, task);
+        return NULL;
+    }
+    phys_to_page((uint64_t)pml4_phys)->flags |= PG_PAGETABLE;
     uint64_t *pml4      = (uint64_t *)phys_to_virt((uint64_t)pml4_phys);
     uint64_t *kpml4     = (uint64_t *)phys_to_virt(kernel_pml4_phys);
     for (int i = 256; i < 512; i++) pml4[i] = kpml4[i];
     task->pml4_phys = pml4_phys;
+    vmm_asid_attach((uint64_t)pml4_phys);
+
+    void *kstack_phys = pmm_alloc_frames_zeroed(TASK_STACK_SIZE / 4096);
+    if (!kstack_phys) {
+        task_destroy(task);
+        return NULL;
+    }
+    task->kernel_stack = (void *)phys_to_virt((uint64_t)kstack_phys);
+    task->ctx = (cpu_context_t *)((uint64_t)task->kernel_stack + TASK_STACK_SIZE - sizeof(cpu_context_t));
+    return task;
+}
+
+task_t *task_create_from_elf(void *elf_data) {
+    task_t *task = task_alloc();
+    if (!task) return NULL;
+
+    task->mm = mm_create();
+    if (!task->mm) goto fail;
 
     uint64_t entry = 0;
-    if (!load_elf(elf_data, pml4, &entry)) {
+    if (!load_elf_demand(elf_data, task->mm, &entry)) {
         serial_puts("[task] ELF load failed\n");
-        return NULL;
+        goto fail;
     }
+    // without an image every text page is a private copy, which still works
+    task->mm->image = elf_image_get(elf_data);
 
+    // faulted in like the segments, only touched stack pages get frames
     #define USER_STACK_VADDR 0x7FFFFFFF0000ULL
     #define USER_STACK_PAGES 8
-    void *ustack_phys = pmm_alloc_frames_zeroed(USER_STACK_PAGES);
-    vmm_map_range_for_pml4(pml4, USER_STACK_VADDR, (uint64_t)ustack_phys,
-                           USER_STACK_PAGES, PTE_PRESENT | PTE_WRITE | PTE_USER | PTE_NX);
-
-    void *kstack_phys = pmm_alloc_frames_zeroed(TASK_STACK_SIZE / 4096);
-    task->kernel_stack = (void *)phys_to_virt((uint64_t)kstack_phys);
-    uint64_t kstack_top = (uint64_t)task->kernel_stack + TASK_STACK_SIZE;
+    struct vma *stack = vma_create(USER_STACK_VADDR, USER_STACK_VADDR + USER_STACK_PAGES * PAGE_SIZE,
+                                   VMA_READ | VMA_WRITE);
+    if (!stack) goto fail;
+    if (!mm_insert(task->mm, stack)) {
+        vma_free(stack);
+        goto fail;
+    }
 
-    cpu_context_t *ctx = (cpu_context_t *)(kstack_top - sizeof(cpu_context_t));
+    cpu_context_t *ctx = task->ctx;
     memset(ctx, 0, sizeof(cpu_context_t));
 
     ctx->rip    = entry;
@@ -82,18 +329,413 @@ task_t *task_create_from_elf(void *elf_data) {
     ctx->rflags = 0x202; // IF=1
     ctx->rsp    = USER_STACK_VADDR + USER_STACK_PAGES * 4096;
     ctx->ss     = 0x1B;  // user data (ring 3)
-
-    task->ctx = ctx;
     return task;
+
+fail:
+    task_destroy(task);
+    return NULL;
+}
+
+task_t *task_fork(task_t *parent, const cpu_context_t *regs, bool cow) {
+    task_t *child = task_alloc();
+    if (!child) return NULL;
+
+    child->mm = mm_clone(parent->mm);
+    if (!child->mm) goto fail;
+    child->mm->image = elf_image_dup(parent->mm->image);
+
+    uint64_t *pml4 = (uint64_t *)phys_to_virt((uint64_t)child->pml4_phys);
+    uint64_t *parent_pml4 = (uint64_t *)phys_to_virt((uint64_t)parent->pml4_phys);
+    if (!vmm_clone_user(pml4, parent_pml4, cow)) goto fail;
+
+    for (int i = 0; i < TASK_MAX_FILES; i++) child->files[i] = parent->files[i];
+    *child->ctx = *regs;
+    // starts next to the parent, whose pages it shares
+    child->cpu = parent->cpu;
+    child->policy = parent->policy;
+    child->prio = parent->prio;
+    child->nice = parent->nice;
+    child->weight = parent->weight;
+    return child;
+
+fail:
+    task_destroy(child);
+    return NULL;
+}
+
+void task_destroy(task_t *task) {
+    if (task->pml4_phys) vmm_destroy_address_space((uint64_t)task->pml4_phys);
+    if (task->mm) {
+        elf_image_put(task->mm->image);
+        mm_destroy(task->mm);
+    }
+    if (task->kernel_stack) {
+        pmm_free_frames((void *)virt_to_phys((uint64_t)task->kernel_stack), TASK_STACK_SIZE / 4096);
+    }
+    kmem_cache_free(task_cache, task);
+}
+
+static void zombie_push(task_t *task) {
+    uint64_t flags = spin_lock_irqsave(&zombie_lock);
+    task->next = zombie_head;
+    zombie_head = task;
+    spin_unlock_irqrestore(&zombie_lock, flags);
+}
+
+static void sleep_insert(run_queue_t *rq, task_t *task) {
+    task_t **link = &rq->sleepers;
+    while (*link && (*link)->wake_at <= task->wake_at) link = &(*link)->next;
+    task->next = *link;
+    *link = task;
+}
+
+static void sleep_remove(run_queue_t *rq, task_t *task) {
+    task_t **link = &rq->sleepers;
+    while (*link && *link != task) link = &(*link)->next;
+    if (*link) *link = task->next;
+    task->next = NULL;
+    task->wake_at = 0;
+}
+
+void task_exit(task_t *task) {
+    if (task->cpu == TASK_NO_CPU) {
+        // never queued
+        task->state = TASK_DEAD;
+        zombie_push(task);
+        return;
+    }
+
+    uint64_t flags;
+    run_queue_t *rq = task_rq_lock(task, &flags);
+    if (task->state == TASK_READY) rq_remove(rq, task);
+    if (task->wake_at) sleep_remove(rq, task);
+    bool on_cpu = task->on_cpu;
+    uint32_t cpu = task->cpu;
+    task->state = TASK_DEAD;
+    spin_unlock_irqrestore(&rq->lock, flags);
+    __atomic_sub_fetch(&nr_tasks, 1, __ATOMIC_RELAXED);
+
+    // the exit path runs on the task's own kernel stack, schedule_tail queues it once we are off it
+    if (task == current_task) {
+        this_cpu()->prev = task;
+        current_task = NULL;
+        return;
+    }
+    // running on another cpu: the kick makes it switch away and schedule_tail queues it
+    if (on_cpu) resched_cpu(cpu);
+    else zombie_push(task);
+}
+
+size_t task_reap_zombies(void) {
+    uint64_t flags = spin_lock_irqsave(&zombie_lock);
+    task_t *list = zombie_head;
+    zombie_head = NULL;
+    spin_unlock_irqrestore(&zombie_lock, flags);
+
+    size_t reaped = 0;
+    while (list) {
+        task_t *next = list->next;
+        task_destroy(list);
+        list = next;
+        reaped++;
+    }
+    return reaped;
+}
+
+void scheduler_tick(void) {
+    cpu_local_t *cpu = this_cpu();
+    task_t *curr = current_task;
+    if (!curr) return;
+
+    run_queue_t *rq = &run_queues[cpu->id];
+    uint64_t flags = spin_lock_irqsave(&rq->lock);
+    account_curr(curr);
+    if (curr->policy != SCHED_RR) fair_update_min(&rq->fair, curr);
+    if (curr->state == TASK_DEAD || slice_used(rq, curr)) cpu->need_resched = true;
+    spin_unlock_irqrestore(&rq->lock, flags);
+}
+
+void task_set_blocked(task_t *task) {
+    uint64_t flags;
+    run_queue_t *rq = task_rq_lock(task, &flags);
+    task->state = TASK_BLOCKED;
+    spin_unlock_irqrestore(&rq->lock, flags);
+}
+
+// rq is the task's and locked; true if it went on the queue and its cpu needs a kick
+static bool wake_locked(run_queue_t *rq, task_t *task) {
+    if (task->state != TASK_BLOCKED) return false;
+    if (task->on_cpu) {
+        // still on its way off the cpu, schedule_tail queues it
+        task->state = TASK_RUNNING;
+        return false;
+    }
+    if (task->policy != SCHED_RR) {
+        rq_update_curr(rq, task->cpu);
+        fair_place(&rq->fair, task, true);
+    }
+    rq_push(rq, task, true);
+    return true;
+}
+
+void task_wake(task_t *task) {
+    uint64_t flags;
+    run_queue_t *rq = task_rq_lock(task, &flags);
+    bool queued = wake_locked(rq, task);
+    uint32_t cpu = task->cpu;
+    spin_unlock_irqrestore(&rq->lock, flags);
+
+    if (queued) resched_cpu(cpu);
+}
+
+void scheduler_sleep(uint64_t deadline, const cpu_context_t *resume) {
+    task_t *task = current_task;
+    uint64_t flags;
+    run_queue_t *rq = task_rq_lock(task, &flags);
+    task->state = TASK_BLOCKED;
+    task->wake_at = deadline ? deadline : 1;
+    sleep_insert(rq, task);
+    spin_unlock_irqrestore(&rq->lock, flags);
+
+    // interrupts stay off until the switch, so the deadline can't slip by before we block
+    scheduler_block(resume);
+}
+
+void scheduler_wake_sleepers(void) {
+    uint32_t self = this_cpu_id();
+    run_queue_t *rq = &run_queues[self];
+    if (!__atomic_load_n(&rq->sleepers, __ATOMIC_RELAXED)) return;
+
+    uint64_t now = rdtsc();
+    bool queued = false;
+    uint64_t flags = spin_lock_irqsave(&rq->lock);
+    while (rq->sleepers && rq->sleepers->wake_at <= now) {
+        task_t *task = rq->sleepers;
+        sleep_remove(rq, task);
+        queued |= wake_locked(rq, task);
+    }
+    spin_unlock_irqrestore(&rq->lock, flags);
+
+    // the caller is the timer interrupt, which reschedules and re-arms on its way out
+    if (queued) this_cpu()->need_resched = true;
+}
+
+// whether another cpu has more waiting than it will get to soon; our turn ending is
+// then worth a timer, schedule() steals from it
+static bool others_overloaded(uint32_t self) {
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (cpu == self || !smp_cpu_online(cpu)) continue;
+        if (__atomic_load_n(&run_queues[cpu].nr, __ATOMIC_RELAXED) >= 2) return true;
+    }
+    return false;
+}
+
+uint64_t scheduler_next_event(void) {
+    uint32_t self = this_cpu_id();
+    run_queue_t *rq = &run_queues[self];
+    task_t *curr = current_task;
+
+    uint64_t flags = spin_lock_irqsave(&rq->lock);
+    uint64_t next = rq->sleepers ? rq->sleepers->wake_at : 0;
+    // alone it just keeps running; anything queued later kicks this cpu
+    if (curr && (rq->nr || others_overloaded(self))) {
+        uint64_t ran = curr->sum_exec - curr->slice_start;
+        uint64_t slice = slice_length(rq, curr);
+        uint64_t end = curr->exec_start + (ran < slice ? slice - ran : 0);
+        if (!next || end < next) next = end;
+    }
+    spin_unlock_irqrestore(&rq->lock, flags);
+    return next;
+}
+
+void scheduler_block(const cpu_context_t *resume) {
+    task_t *task = current_task;
+    run_queue_t *rq = &run_queues[this_cpu_id()];
+    uint64_t flags = spin_lock_irqsave(&rq->lock);
+    account_curr(task);
+    spin_unlock_irqrestore(&rq->lock, flags);
+
+    task->resume = resume;
+    this_cpu()->prev = task;
+    current_task = NULL;
+    scheduler_run_next();
+}
+
+void task_set_nice(task_t *task, int nice) {
+    if (nice < -20) nice = -20;
+    if (nice > 19) nice = 19;
+    if (task->cpu == TASK_NO_CPU) {
+        // not queued yet
+        task->nice = nice;
+        task->weight = fair_weight(nice);
+        return;
+    }
+
+    uint64_t flags;
+    run_queue_t *rq = task_rq_lock(task, &flags);
+    // the weight is part of the queue's load, take it out while it changes
+    bool queued = task->state == TASK_READY;
+    if (queued) rq_remove(rq, task);
+    task->nice = nice;
+    task->weight = fair_weight(nice);
+    if (queued) rq_push(rq, task, false);
+    uint32_t cpu = task->cpu;
+    spin_unlock_irqrestore(&rq->lock, flags);
+
+    // a task that lowered itself may no longer be the one to run
+    if (task->on_cpu) resched_cpu(cpu);
+}
+
+bool task_set_policy(task_t *task, uint32_t policy, uint32_t prio) {
+    if (policy != SCHED_FAIR && policy != SCHED_RR) return false;
+    if (prio >= TASK_PRIO_LEVELS) prio = TASK_PRIO_LEVELS - 1;
+    if (task->cpu == TASK_NO_CPU) {
+        // not queued yet, scheduler_add_task places it
+        task->policy = policy;
+        task->prio = prio;
+        return true;
+    }
+
+    uint64_t flags;
+    run_queue_t *rq = task_rq_lock(task, &flags);
+    bool queued = task->state == TASK_READY;
+    if (queued) rq_remove(rq, task);
+    // whatever vruntime it had is stale by now
+    if (policy == SCHED_FAIR && task->policy != SCHED_FAIR) {
+        rq_update_curr(rq, task->cpu);
+        fair_place(&rq->fair, task, false);
+    }
+    task->policy = policy;
+    if (policy == SCHED_RR) task->prio = prio;
+    if (queued) rq_push(rq, task, false);
+    uint32_t cpu = task->cpu;
+    spin_unlock_irqrestore(&rq->lock, flags);
+
+    if (task->on_cpu) resched_cpu(cpu);
+    return true;
 }
 
 void schedule(void) {
-    task_t *next = scheduler_next();
-    if (!next || next == current_task) return;
+    task_reap_zombies();
 
-    if (current_task && current_task->state == TASK_RUNNING)
-        current_task->state = TASK_READY;
+    cpu_local_t *cpu = this_cpu();
+    cpu->need_resched = false;
+    task_t *curr = current_task;
+    bool dead = curr->state == TASK_DEAD;
+    uint32_t rank = dead ? RANK_NONE : task_rank(curr);
+    run_queue_t *rq = &run_queues[cpu->id];
+
+    uint64_t flags = spin_lock_irqsave(&rq->lock);
+    account_curr(curr);
+    bool used = slice_used(rq, curr);
+    if (curr->policy != SCHED_RR) fair_update_min(&rq->fair, curr);
+
+    // a better class or level always takes over. within the same one round-robin tasks
+    // take turns, fair ones go by vruntime
+    task_t *next = NULL;
+    uint32_t top = rq_top(rq);
+    if (top < rank || (top == rank && (rank != RANK_FAIR || fair_should_preempt(&rq->fair, curr, used)))) {
+        next = rq_pop(rq);
+    }
+    // staying on: a fresh turn
+    if (!next && used) curr->slice_start = curr->sum_exec;
+    spin_unlock_irqrestore(&rq->lock, flags);
 
-    current_task = next;
-    current_task->state = TASK_RUNNING;
-}
\ No newline at end of file
+    // nothing better here. once its turn is over, take from a cpu that has more than it can run
+    if (!next && (used || dead)) next = steal_task(dead ? 1 : 2, dead ? RANK_FAIR : rank);
+
+    if (next) {
+        // current goes back on a queue in schedule_tail, once we are off its stack
+        cpu->prev = curr;
+        current_task = next;
+        return;
+    }
+
+    // killed from another cpu and nothing else to run
+    if (dead) {
+        cpu->prev = curr;
+        current_task = NULL;
+        scheduler_run_next();
+    }
+}
+
+static void release_prev(task_t *prev) {
+    // blocked in a syscall: it restarts from a frame at the top of its stack, which
+    // the syscall's own frames were using until now
+    if (prev->resume) {
+        cpu_context_t *frame = (cpu_context_t *)((uint64_t)prev->kernel_stack + TASK_STACK_SIZE - sizeof(cpu_context_t));
+        memmove(frame, prev->resume, sizeof(cpu_context_t));
+        prev->ctx = frame;
+        prev->resume = NULL;
+    }
+
+    uint64_t flags;
+    run_queue_t *rq = task_rq_lock(prev, &flags);
+    prev->on_cpu = false;
+    bool dead = prev->state == TASK_DEAD;
+    if (prev->state == TASK_RUNNING) rq_push(rq, prev, false);
+    spin_unlock_irqrestore(&rq->lock, flags);
+
+    if (dead) zombie_push(prev);
+}
+
+void schedule_tail(void) {
+    cpu_local_t *cpu = this_cpu();
+    task_t *prev = cpu->prev;
+    if (prev) {
+        cpu->prev = NULL;
+        release_prev(prev);
+    }
+    // current_task is final now and prev is back on the queue if it still runs: time the
+    // end of the new turn, or the next sleeper
+    apic_timer_rearm();
+}
+
+// claim the next ready task for this cpu, taking any another cpu has waiting
+static task_t *take_next(void) {
+    run_queue_t *rq = &run_queues[this_cpu_id()];
+    task_t *next = NULL;
+    if (rq_top(rq) != RANK_NONE) {
+        uint64_t flags = spin_lock_irqsave(&rq->lock);
+        next = rq_pop(rq);
+        spin_unlock_irqrestore(&rq->lock, flags);
+    }
+    return next ? next : steal_task(1, RANK_FAIR);
+}
+
+__attribute__((noreturn)) static void idle_loop(void) {
+    schedule_tail();
+    cpu_local_t *cpu = this_cpu();
+
+    for (;;) {
+        // set first, so a task queued after take_next looks still sends the wake ipi
+        cpu->idle = true;
+        smp_run_work();
+
+        task_t *next = take_next();
+        if (next) {
+            cpu->idle = false;
+            task_enter(next);
+        }
+
+        // nothing until a wake ipi or the soonest sleeper's deadline
+        apic_timer_rearm();
+        cpu_idle();
+        asm volatile("cli" ::: "memory");
+    }
+}
+
+void scheduler_run_next(void) {
+    task_t *next = take_next();
+    if (next) task_enter(next);
+
+    // off the last task's address space and stack before schedule_tail lets it be freed
+    vmm_switch_address_space(kernel_pml4_phys);
+    asm volatile(
+        "mov %0, %%rsp\n"
+        "xor %%ebp, %%ebp\n"
+        "call *%1\n"
+        :: "r"(this_cpu()->idle_stack), "r"(idle_loop)
+        : "memory");
+    __builtin_unreachable();
+}
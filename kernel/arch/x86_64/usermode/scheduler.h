@@ -3,9 +3,26 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
+
+#include <arch/x86_64/cpu/percpu.h>
 
 #define TASK_STACK_SIZE (16 * 4096)
 #define MAX_TASKS       16
+#define TASK_MAX_FILES  8
+#define TASK_FD_BASE    3    // 0-2 are the console
+#define TASK_NO_CPU     0xFFFFFFFF
+
+// scheduling classes, numbered like linux's SCHED_OTHER and SCHED_RR. tasks are fair
+// unless asked otherwise; any ready round-robin task runs before every fair one
+#define SCHED_FAIR 0
+#define SCHED_RR   2
+
+// round-robin priority levels, level 0 runs first
+#define TASK_PRIO_LEVELS  40
+#define TASK_PRIO_DEFAULT 20
+// how long a round-robin task runs before the next one at its level gets a turn
+#define SCHED_QUANTUM_US  100000
 
 typedef enum {
     TASK_READY,
@@ -20,20 +37,91 @@ typedef struct {
     uint64_t rip, cs, rflags, rsp, ss;
 } __attribute__((packed)) cpu_context_t;
 
+struct mm;
+
+// an initrd file opened with SYS_OPEN
+typedef struct {
+    const uint8_t *data;
+    size_t size;
+} task_file_t;
+
+// ctx, pml4_phys and kernel_stack are at fixed offsets for isr.S
 typedef struct task {
     cpu_context_t *ctx;
     uint64_t      *pml4_phys;
     void          *kernel_stack;
+    struct mm     *mm;
     task_state_t   state;
     uint32_t       pid;
+    uint32_t       cpu;     // home cpu: the run queue it waits on, TASK_NO_CPU until first queued
+    uint32_t       policy;  // SCHED_FAIR or SCHED_RR
+    uint32_t       prio;    // SCHED_RR: level in the run queue, lower runs first
+    int32_t        nice;
+    uint32_t       weight;  // SCHED_FAIR: from nice
+    bool           on_cpu;  // picked to run and not yet released by schedule_tail
+    bool           pinned;  // stays on its home cpu, never stolen
     struct task   *next;
+    // cpu time in tsc cycles
+    uint64_t       vruntime;     // SCHED_FAIR: sum_exec scaled by weight, the tree key while queued
+    uint64_t       sum_exec;
+    uint64_t       exec_start;   // last time it was charged while running
+    uint64_t       slice_start;  // sum_exec when it was picked
+    struct task   *fair_left;
+    struct task   *fair_right;
+    int            fair_height;
+    const cpu_context_t *resume;   // blocked in a syscall: where to restart, on its own stack
+    uint64_t       wake_at;      // tsc deadline while on its cpu's sleep list, 0 otherwise
+    task_file_t    files[TASK_MAX_FILES];
 } task_t;
 
 void scheduler_init(void);
+// queue a task on its home cpu, or the least loaded one for a new task, and kick that
+// cpu, or an idle one that can come and get it
 void scheduler_add_task(task_t *task);
+// pick what this cpu runs next, possibly current_task again. called from the timer
+// interrupt in user mode once need_resched is set
 void schedule(void);
-task_t *scheduler_next(void);
+// called on the new task's stack after every switch; releases the task switched away from
+void schedule_tail(void);
+// run the next ready task on this cpu, or idle until there is one. never returns
+__attribute__((noreturn)) void scheduler_run_next(void);
+bool scheduler_has_tasks(void);
 task_t *task_create_from_elf(void *elf_data);
-extern task_t *current_task;
+// frees everything the task owns; it must not be running or queued
+void task_destroy(task_t *task);
+// child of parent that resumes in user mode with regs; cow shares the user frames
+// until either side writes, otherwise they are copied up front
+task_t *task_fork(task_t *parent, const cpu_context_t *regs, bool cow);
+// take a dying task off the run queue; it is freed on a later schedule(). exiting
+// current_task leaves the cpu without one, scheduler_run_next picks the next
+void task_exit(task_t *task);
+size_t task_reap_zombies(void);
+
+// blocking takes two steps so a wakeup can't be lost: mark the task blocked, publish it
+// wherever its waker looks, check the condition once more, then switch away with
+// scheduler_block. resume is the user frame to restart from, usually the syscall again
+void task_set_blocked(task_t *task);
+__attribute__((noreturn)) void scheduler_block(const cpu_context_t *resume);
+// queue a blocked task ahead of the others at its level; its cpu is kicked to reschedule
+// and lets it in if it is at least as urgent as what runs there
+void task_wake(task_t *task);
+// block current_task until the tsc reaches deadline, then resume at resume. the timer of
+// this cpu wakes it
+__attribute__((noreturn)) void scheduler_sleep(uint64_t deadline, const cpu_context_t *resume);
+// wake this cpu's sleepers whose deadline has passed; called from its timer interrupt
+void scheduler_wake_sleepers(void);
+// tsc deadline of this cpu's next scheduling event, 0 if there is none: the end of the
+// running task's turn when something waits for the cpu, or the soonest sleeper's wakeup
+uint64_t scheduler_next_event(void);
+// nice -20..19: the weight of a fair task, kept but unused while it is round-robin
+void task_set_nice(task_t *task, int nice);
+// move the task to SCHED_FAIR, or SCHED_RR at level prio; false for anything else
+bool task_set_policy(task_t *task, uint32_t policy, uint32_t prio);
+// charge the running task for its time and flag a reschedule once it has had its turn;
+// called on every timer interrupt taken in user mode
+void scheduler_tick(void);
+
+// the task running on this cpu
+#define current_task (this_cpu()->current)
 
 #endif
\ No newline at end of file
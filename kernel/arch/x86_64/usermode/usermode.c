@@ -7,6 +7,8 @@
 #include <drivers/serial.h>
 #include <arch/x86_64/usermode/elf.h>
 #include <arch/x86_64/usermode/scheduler.h>
+#include <arch/x86_64/cpu/gdt.h>
+#include <arch/x86_64/cpu/percpu.h>
 
 extern uint64_t kernel_pml4_phys;
 
@@ -61,6 +63,7 @@ void runElf_ring3(void *elf_data, size_t elf_size) {
     asm volatile(
         "mov %0, %%cr3\n"
         "mov %1, %%rsp\n"
+        "swapgs\n"
         "iretq\n"
         :
         : "r"(user_pml4_phys), "r"(sp)
@@ -70,16 +73,21 @@ void runElf_ring3(void *elf_data, size_t elf_size) {
 
 void task_enter(task_t *task) {
     current_task = task;
+    // interrupts and syscalls must land on this task's stack, not the previous one's
+    this_cpu()->tss->rsp0 = (uint64_t)task->kernel_stack + TASK_STACK_SIZE;
+    vmm_switch_address_space((uint64_t)task->pml4_phys);
     asm volatile(
-        "mov %0, %%cr3\n"
-        "mov %1, %%rsp\n"
+        "mov %0, %%rsp\n"
+        // on the new stack, whatever ran before can be released now
+        "call schedule_tail\n"
         "pop %%r15\npop %%r14\npop %%r13\npop %%r12\n"
         "pop %%r11\npop %%r10\npop %%r9\npop %%r8\n"
         "pop %%rbp\npop %%rdi\npop %%rsi\npop %%rdx\n"
         "pop %%rcx\npop %%rbx\npop %%rax\n"
+        "swapgs\n"
         "iretq\n"
         :
-        : "r"(task->pml4_phys), "r"(task->ctx)
+        : "r"(task->ctx)
         : "memory"
     );
 }
\ No newline at end of file
@@ -0,0 +1,24 @@
+#include <bench/bench.h>
+#include <drivers/serial.h>
+#include <klib/string.h>
+
+void bench_report(const char *label, uint64_t value, const char *unit) {
+    char buf[32];
+    serial_puts("[bench] ");
+    serial_puts(label);
+    serial_puts(": ");
+    u64_to_dec(value, buf);
+    serial_puts(buf);
+    serial_puts(" ");
+    serial_puts(unit);
+    serial_puts("\n");
+}
+
+void bench_run_all(void) {
+    serial_puts("[bench] running boot benchmarks\n");
+    bench_pmm();
+    bench_zero_pool();
+    bench_slab();
+    bench_vmalloc();
+    serial_puts("[bench] done\n");
+}
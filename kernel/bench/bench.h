@@ -0,0 +1,30 @@
+#ifndef ESTELLA_BENCH_BENCH_H
+#define ESTELLA_BENCH_BENCH_H
+
+#include <stdint.h>
+
+#include <limine.h>
+
+// boot-time benchmarks, built with `make BENCH=1`
+void bench_run_all(void);
+
+void bench_pmm(void);
+void bench_zero_pool(void);
+void bench_slab(void);
+void bench_vmalloc(void);
+// run separately once the scheduler is up, elf is any program from the initrd
+void bench_task_churn(void *elf);
+void bench_fork(void *elf);
+void bench_context_switch(void *elf);
+void bench_thp(void *elf);
+// leaves the framebuffer write-combining
+void bench_framebuffer(struct limine_framebuffer *fb);
+// run once the aps are up
+void bench_smp_scaling(void);
+// elf has to spin forever, bin/hog.elf
+void bench_fairness(void *elf);
+
+// "<label>: <value> <unit>" on serial
+void bench_report(const char *label, uint64_t value, const char *unit);
+
+#endif
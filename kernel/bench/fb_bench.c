@@ -0,0 +1,42 @@
+#include <bench/bench.h>
+#include <drivers/fbtext.h>
+#include <drivers/serial.h>
+#include <arch/x86_64/mm/vmm.h>
+#include <arch/x86_64/time/tsc.h>
+
+#define BENCH_FB_LINES 64
+#define BENCH_FB_ROWS  64
+#define BENCH_FB_ROW_HEIGHT 25    // a text line of the 12x24 console font
+
+static const char bench_line[] = "The quick brown fox jumps over the lazy dog 0123456789";
+
+// cycles per glyph and per cleared full-width text row, drawn in a band at the bottom
+static void fb_throughput(struct limine_framebuffer *fb, uint64_t *glyph, uint64_t *row) {
+    size_t y = fb->height - 2 * BENCH_FB_ROW_HEIGHT;
+    size_t glyphs = BENCH_FB_LINES * (sizeof(bench_line) - 1);
+
+    uint64_t start = rdtsc();
+    for (size_t i = 0; i < BENCH_FB_LINES; i++) fb_print_at(bench_line, 0xFFFFFF, 20, (int)y);
+    *glyph = (rdtsc() - start) / glyphs;
+
+    // the store traffic of a scroll step, the console has no scrolling yet
+    start = rdtsc();
+    for (size_t i = 0; i < BENCH_FB_ROWS; i++) fb_clear_area(0, y, fb->width, BENCH_FB_ROW_HEIGHT, 0);
+    *row = (rdtsc() - start) / BENCH_FB_ROWS;
+}
+
+void bench_framebuffer(struct limine_framebuffer *fb) {
+    uint64_t uc_glyph, uc_row, wc_glyph, wc_row;
+
+    // uncached is what firmware often leaves the framebuffer as
+    if (!fb_set_cache(PTE_CACHE_UC)) return;
+    fb_throughput(fb, &uc_glyph, &uc_row);
+    fb_set_cache(PTE_CACHE_WC);
+    fb_throughput(fb, &wc_glyph, &wc_row);
+
+    serial_puts("[bench] framebuffer console\n");
+    bench_report("  glyph, uncached", uc_glyph, "cycles");
+    bench_report("  glyph, write-combining", wc_glyph, "cycles");
+    bench_report("  text row clear, uncached", uc_row, "cycles");
+    bench_report("  text row clear, write-combining", wc_row, "cycles");
+}
@@ -0,0 +1,101 @@
+#include <bench/bench.h>
+#include <mm/pmm.h>
+#include <arch/x86_64/time/tsc.h>
+#include <drivers/serial.h>
+
+#define BENCH_ROUNDS    256
+#define BENCH_FRAG_SIZE 4096
+
+static void *bench_slots[BENCH_FRAG_SIZE];
+
+typedef void *(*alloc_fn_t)(size_t count, size_t alignment);
+
+// average cycles for one alloc of `count` frames, BENCH_ROUNDS allocations in flight
+static uint64_t bench_alloc_cycles(alloc_fn_t alloc, size_t count) {
+    uint64_t total = 0;
+    size_t done = 0;
+
+    for (size_t i = 0; i < BENCH_ROUNDS; i++) {
+        uint64_t start = rdtsc();
+        bench_slots[i] = alloc(count, PAGE_SIZE);
+        total += rdtsc() - start;
+        if (bench_slots[i]) done++;
+    }
+    for (size_t i = 0; i < BENCH_ROUNDS; i++) {
+        if (bench_slots[i]) pmm_free_frames(bench_slots[i], count);
+    }
+    return done ? total / done : 0;
+}
+
+static void bench_compare(const char *label, size_t count) {
+    uint64_t buddy = bench_alloc_cycles(pmm_alloc_frames_aligned, count);
+    uint64_t linear = bench_alloc_cycles(pmm_alloc_frames_linear, count);
+
+    serial_puts("[bench] pmm ");
+    serial_puts(label);
+    serial_puts("\n");
+    bench_report("  buddy alloc", buddy, "cycles");
+    bench_report("  bitmap alloc", linear, "cycles");
+}
+
+void bench_pmm(void) {
+    bench_compare("1 frame (per-cpu cache)", 1);
+    bench_compare("16 frames", 16);
+    bench_compare("512 frames", 512);
+
+    // 2 MiB-aligned block for a huge page
+    uint64_t start = rdtsc();
+    void *huge = pmm_alloc_huge_2mb();
+    uint64_t huge_buddy = rdtsc() - start;
+    if (huge) pmm_free_frames(huge, 512);
+
+    start = rdtsc();
+    huge = pmm_alloc_frames_linear(512, 512 * PAGE_SIZE);
+    uint64_t huge_linear = rdtsc() - start;
+    if (huge) pmm_free_frames(huge, 512);
+
+    serial_puts("[bench] pmm 2 MiB huge frame\n");
+    bench_report("  buddy alloc", huge_buddy, "cycles");
+    bench_report("  bitmap alloc", huge_linear, "cycles");
+
+    // punch holes: every other single frame stays allocated
+    for (size_t i = 0; i < BENCH_FRAG_SIZE; i++) {
+        bench_slots[i] = pmm_alloc();
+    }
+    for (size_t i = 0; i < BENCH_FRAG_SIZE; i += 2) {
+        if (bench_slots[i]) pmm_free(bench_slots[i]);
+    }
+    // single frames park in this cpu's magazine, still used in the bitmap; the holes
+    // only show up in the bitmap and the buddy lists once they are drained
+    pmm_drain_cpu_cache();
+
+    start = rdtsc();
+    void *buddy_run = pmm_alloc_frames(64);
+    uint64_t buddy = rdtsc() - start;
+
+    start = rdtsc();
+    void *linear_run = pmm_alloc_frames_linear(64, PAGE_SIZE);
+    uint64_t linear = rdtsc() - start;
+
+    start = rdtsc();
+    pmm_bench_find_run(64, false);
+    uint64_t bit_scan = rdtsc() - start;
+
+    start = rdtsc();
+    pmm_bench_find_run(64, true);
+    uint64_t word_scan = rdtsc() - start;
+
+    if (buddy_run) pmm_free_frames(buddy_run, 64);
+    if (linear_run) pmm_free_frames(linear_run, 64);
+    for (size_t i = 1; i < BENCH_FRAG_SIZE; i += 2) {
+        if (bench_slots[i]) pmm_free(bench_slots[i]);
+    }
+
+    serial_puts("[bench] pmm 64 frames, fragmented\n");
+    bench_report("  buddy alloc", buddy, "cycles");
+    bench_report("  bitmap alloc", linear, "cycles");
+    bench_report("  bit-at-a-time scan", bit_scan, "cycles");
+    bench_report("  word-at-a-time scan", word_scan, "cycles");
+
+    bench_report("pmm init", pmm_get_init_cycles(), "cycles");
+}
@@ -0,0 +1,86 @@
+#include <bench/bench.h>
+#include <arch/x86_64/usermode/scheduler.h>
+#include <arch/x86_64/cpu/smp.h>
+#include <arch/x86_64/time/tsc.h>
+#include <drivers/serial.h>
+#include <klib/string.h>
+
+#define BENCH_FAIR_CPU 1        // the hogs are pinned here, the bsp only watches
+#define BENCH_FAIR_MS  1000
+
+static const int bench_fair_nice[] = { -5, 0, 0, 3, 5 };
+#define BENCH_FAIR_HOGS (sizeof(bench_fair_nice) / sizeof(bench_fair_nice[0]))
+
+static void spin_ms(uint64_t ms) {
+    uint64_t end = rdtsc() + tsc_frequency_hz / 1000 * ms;
+    while (rdtsc() < end) asm volatile("pause");
+}
+
+static void nice_label(char *label, int nice, const char *what) {
+    label[0] = 0;
+    strcat(label, "  nice ");
+    size_t len = strlen(label);
+    if (nice < 0) label[len++] = '-';
+    u64_to_dec(nice < 0 ? -nice : nice, label + len);
+    strcat(label, what);
+}
+
+// cpu hogs of different nice values share one ap; the cpu time each one got against what
+// its weight entitles it to, in parts per thousand of the total
+void bench_fairness(void *elf) {
+    if (!elf) return;
+    if (smp_cpu_count() <= BENCH_FAIR_CPU) {
+        serial_puts("[bench] fairness needs a second cpu to run the hogs on\n");
+        return;
+    }
+
+    task_t *hogs[BENCH_FAIR_HOGS];
+    uint64_t weight[BENCH_FAIR_HOGS];
+    uint64_t total_weight = 0;
+    size_t n = 0;
+    for (; n < BENCH_FAIR_HOGS; n++) {
+        task_t *task = task_create_from_elf(elf);
+        if (!task) break;
+        task_set_nice(task, bench_fair_nice[n]);
+        task->cpu = BENCH_FAIR_CPU;
+        task->pinned = true;
+        hogs[n] = task;
+        weight[n] = task->weight;
+        total_weight += task->weight;
+    }
+    if (n < 2) {
+        for (size_t i = 0; i < n; i++) task_destroy(hogs[i]);
+        return;
+    }
+
+    for (size_t i = 0; i < n; i++) scheduler_add_task(hogs[i]);
+    spin_ms(BENCH_FAIR_MS);
+
+    // the running hog's count lags by at most one tick
+    uint64_t ran[BENCH_FAIR_HOGS];
+    uint64_t total = 0;
+    for (size_t i = 0; i < n; i++) {
+        ran[i] = __atomic_load_n(&hogs[i]->sum_exec, __ATOMIC_RELAXED);
+        total += ran[i];
+    }
+    for (size_t i = 0; i < n; i++) task_exit(hogs[i]);
+    // the one still on the ap is let go once the kick reaches that cpu
+    spin_ms(50);
+    task_reap_zombies();
+
+    serial_puts("[bench] fair class, cpu hogs sharing one cpu\n");
+    uint64_t worst = 0;
+    for (size_t i = 0; i < n; i++) {
+        uint64_t expected = weight[i] * 1000 / total_weight;
+        uint64_t measured = total ? ran[i] * 1000 / total : 0;
+        uint64_t deviation = measured > expected ? measured - expected : expected - measured;
+        if (deviation > worst) worst = deviation;
+
+        char label[48];
+        nice_label(label, bench_fair_nice[i], ", weight share");
+        bench_report(label, expected, "/1000");
+        nice_label(label, bench_fair_nice[i], ", measured");
+        bench_report(label, measured, "/1000");
+    }
+    bench_report("  worst deviation", worst, "/1000");
+}
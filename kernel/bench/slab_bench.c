@@ -0,0 +1,39 @@
+#include <bench/bench.h>
+#include <mm/pmm.h>
+#include <mm/slab.h>
+#include <arch/x86_64/time/tsc.h>
+#include <drivers/serial.h>
+
+#define BENCH_SLAB_ROUNDS 256
+#define BENCH_OBJECT_SIZE 64   // about a task_t
+
+static void *bench_objs[BENCH_SLAB_ROUNDS];
+
+void bench_slab(void) {
+    uint64_t slab_total = 0;
+    for (size_t i = 0; i < BENCH_SLAB_ROUNDS; i++) {
+        uint64_t start = rdtsc();
+        bench_objs[i] = kzalloc(BENCH_OBJECT_SIZE);
+        slab_total += rdtsc() - start;
+    }
+    for (size_t i = 0; i < BENCH_SLAB_ROUNDS; i++) kfree(bench_objs[i]);
+
+    // what task_create_from_elf used to do: a whole zeroed frame per object
+    uint64_t frame_total = 0;
+    for (size_t i = 0; i < BENCH_SLAB_ROUNDS; i++) {
+        uint64_t start = rdtsc();
+        bench_objs[i] = pmm_alloc_zeroed();
+        frame_total += rdtsc() - start;
+    }
+    for (size_t i = 0; i < BENCH_SLAB_ROUNDS; i++) {
+        if (bench_objs[i]) pmm_free(bench_objs[i]);
+    }
+
+    serial_puts("[bench] 64-byte object alloc\n");
+    bench_report("  kzalloc", slab_total / BENCH_SLAB_ROUNDS, "cycles");
+    bench_report("  zeroed frame", frame_total / BENCH_SLAB_ROUNDS, "cycles");
+    bench_report("  bytes per object, slab", BENCH_OBJECT_SIZE, "bytes");
+    bench_report("  bytes per object, frame", PAGE_SIZE, "bytes");
+
+    slab_dump_stats();
+}
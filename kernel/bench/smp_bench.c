@@ -0,0 +1,61 @@
+#include <bench/bench.h>
+#include <arch/x86_64/cpu/smp.h>
+#include <arch/x86_64/cpu/percpu.h>
+#include <arch/x86_64/time/tsc.h>
+#include <drivers/serial.h>
+#include <klib/string.h>
+
+#define BENCH_SMP_STEPS (1ULL << 27)    // xorshift rounds, split over the cpus taking part
+
+struct smp_share {
+    uint64_t steps;
+    uint64_t result;
+};
+
+static void crunch(void *arg) {
+    struct smp_share *share = arg;
+    uint64_t x = 88172645463325252ULL + share->steps;
+    for (uint64_t i = 0; i < share->steps; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+    }
+    share->result = x;
+}
+
+// wall clock cycles for the whole job on cpus 0..n-1, the bsp doing its share itself
+static uint64_t run_split(struct smp_share *shares, uint32_t n) {
+    uint64_t start = rdtsc();
+    for (uint32_t id = 1; id < n; id++) {
+        shares[id].steps = BENCH_SMP_STEPS / n;
+        if (!smp_call(id, crunch, &shares[id])) crunch(&shares[id]);
+    }
+    shares[0].steps = BENCH_SMP_STEPS / n;
+    crunch(&shares[0]);
+    for (uint32_t id = 1; id < n; id++) {
+        while (!smp_call_done(id)) asm volatile("pause");
+    }
+    return rdtsc() - start;
+}
+
+// the same cpu-bound job on 1, 2, 4 ... cpus; speedup is relative to one cpu, in percent
+void bench_smp_scaling(void) {
+    static struct smp_share shares[MAX_CPUS];
+    uint32_t cpus = smp_cpu_count();
+    uint64_t single = 0;
+
+    serial_puts("[bench] cpu-bound job split across cpus\n");
+    for (uint32_t n = 1;; n = n * 2 < cpus ? n * 2 : cpus) {
+        uint64_t cycles = run_split(shares, n);
+        if (n == 1) single = cycles;
+
+        char label[48] = "  ";
+        u64_to_dec(n, label + 2);
+        strcat(label, n == 1 ? " cpu" : " cpus");
+        bench_report(label, cycles, "cycles");
+        strcat(label, ", speedup");
+        bench_report(label, cycles ? single * 100 / cycles : 0, "%");
+
+        if (n == cpus) break;
+    }
+}
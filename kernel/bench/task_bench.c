@@ -0,0 +1,239 @@
+#include <bench/bench.h>
+#include <mm/pmm.h>
+#include <mm/page.h>
+#include <mm/vma.h>
+#include <mm/thp.h>
+#include <arch/x86_64/mm/vmm.h>
+#include <arch/x86_64/usermode/scheduler.h>
+#include <arch/x86_64/time/tsc.h>
+#include <drivers/serial.h>
+
+#define BENCH_CHURN_TASKS  4096
+#define BENCH_CHURN_BATCH  64     // exits between two reaper runs
+
+// create a task, queue it, exit it through the same path SYS_EXIT uses and let
+// the reaper free it; the free frame count has to come back to where it started
+void bench_task_churn(void *elf) {
+    if (!elf) return;
+
+    // resident cost of a task that has not run yet: page tables, kernel stack, task_t
+    size_t free_before = pmm_get_free_frames();
+    uint64_t create_start = rdtsc();
+    task_t *probe = task_create_from_elf(elf);
+    uint64_t create_cycles = rdtsc() - create_start;
+    if (!probe) return;
+    size_t probe_frames = free_before - pmm_get_free_frames();
+    task_destroy(probe);
+
+    free_before = pmm_get_free_frames();
+    size_t lowest = free_before;
+    size_t done = 0;
+
+    uint64_t start = rdtsc();
+    for (size_t i = 0; i < BENCH_CHURN_TASKS; i++) {
+        task_t *task = task_create_from_elf(elf);
+        if (!task) break;
+        scheduler_add_task(task);
+        task_exit(task);
+        done++;
+
+        if (done % BENCH_CHURN_BATCH == 0) {
+            size_t free_now = pmm_get_free_frames();
+            if (free_now < lowest) lowest = free_now;
+            task_reap_zombies();
+        }
+    }
+    task_reap_zombies();
+    uint64_t cycles = rdtsc() - start;
+
+    size_t free_after = pmm_get_free_frames();
+
+    serial_puts("[bench] task create + exit + reap\n");
+    bench_report("  create, cold", create_cycles, "cycles");
+    bench_report("  frames held by a new task", probe_frames, "frames");
+    bench_report("  tasks", done, "tasks");
+    if (done) bench_report("  per task", cycles / done, "cycles");
+    bench_report("  peak frames held by zombies", free_before - lowest, "frames");
+    bench_report("  frames not returned", free_before > free_after ? free_before - free_after : 0, "frames");
+}
+
+#define BENCH_FORK_HEAP_VADDR 0x10000000ULL
+#define BENCH_FORK_HEAP_PAGES 2048    // 8 MiB, all touched
+#define BENCH_FORK_ROUNDS     16
+
+static uint64_t bench_fork_cycles(task_t *parent, bool cow) {
+    cpu_context_t regs = { .cs = 0x23, .ss = 0x1B, .rflags = 0x202 };
+    uint64_t total = 0;
+    size_t done = 0;
+
+    for (size_t i = 0; i < BENCH_FORK_ROUNDS; i++) {
+        uint64_t start = rdtsc();
+        task_t *child = task_fork(parent, &regs, cow);
+        if (!child) break;
+        task_destroy(child);
+        total += rdtsc() - start;
+        done++;
+    }
+    return done ? total / done : 0;
+}
+
+// an 8 MiB anonymous heap, every page touched and backed by its own frame
+static bool map_bench_heap(task_t *task) {
+    struct vma *heap = vma_create(BENCH_FORK_HEAP_VADDR, BENCH_FORK_HEAP_VADDR + BENCH_FORK_HEAP_PAGES * PAGE_SIZE,
+                                  VMA_READ | VMA_WRITE);
+    if (!heap || !mm_insert(task->mm, heap)) {
+        if (heap) vma_free(heap);
+        return false;
+    }
+
+    uint64_t *pml4 = (uint64_t *)phys_to_virt((uint64_t)task->pml4_phys);
+    for (size_t i = 0; i < BENCH_FORK_HEAP_PAGES; i++) {
+        void *frame = pmm_alloc_zeroed();
+        if (!frame) return false;
+        phys_to_page((uint64_t)frame)->flags |= PG_USER;
+        if (!vmm_map_for_pml4(pml4, BENCH_FORK_HEAP_VADDR + i * PAGE_SIZE, (uint64_t)frame,
+                              PTE_PRESENT | PTE_WRITE | PTE_USER | PTE_NX)) {
+            pmm_free(frame);
+            return false;
+        }
+    }
+    return true;
+}
+
+// fork + exit of a task with a big resident heap: copy everything vs share it copy-on-write
+void bench_fork(void *elf) {
+    if (!elf) return;
+
+    task_t *parent = task_create_from_elf(elf);
+    if (!parent) return;
+    if (!map_bench_heap(parent)) {
+        task_destroy(parent);
+        return;
+    }
+
+    uint64_t eager = bench_fork_cycles(parent, false);
+    uint64_t cow = bench_fork_cycles(parent, true);
+    task_destroy(parent);
+
+    serial_puts("[bench] fork + exit, 8 MiB touched heap\n");
+    bench_report("  eager copy", eager, "cycles");
+    bench_report("  copy-on-write", cow, "cycles");
+}
+
+#define BENCH_SWITCH_VADDR  0x10000000ULL
+#define BENCH_SWITCH_PAGES  64      // working set each side touches after a switch
+#define BENCH_SWITCH_ROUNDS 4096
+
+extern uint64_t kernel_pml4_phys;
+
+static bool map_working_set(task_t *task) {
+    uint64_t *pml4 = (uint64_t *)phys_to_virt((uint64_t)task->pml4_phys);
+    for (size_t i = 0; i < BENCH_SWITCH_PAGES; i++) {
+        void *frame = pmm_alloc_zeroed();
+        if (!frame) return false;
+        phys_to_page((uint64_t)frame)->flags |= PG_USER;
+        if (!vmm_map_for_pml4(pml4, BENCH_SWITCH_VADDR + i * PAGE_SIZE, (uint64_t)frame,
+                              PTE_PRESENT | PTE_WRITE | PTE_USER | PTE_NX)) {
+            pmm_free(frame);
+            return false;
+        }
+    }
+    return true;
+}
+
+// cycles per switch + working set walk. without pcid every load lands on pcid 0 and
+// drops all non-global entries, which is what a switch cost before pcids
+static uint64_t bench_switch_cycles(task_t *a, task_t *b, bool pcid) {
+    task_t *side[2] = { a, b };
+    uint64_t sum = 0;
+
+    uint64_t start = rdtsc();
+    for (size_t i = 0; i < BENCH_SWITCH_ROUNDS * 2; i++) {
+        uint64_t pml4_phys = (uint64_t)side[i & 1]->pml4_phys;
+        if (pcid) vmm_switch_address_space(pml4_phys);
+        else asm volatile("mov %0, %%cr3" :: "r"(pml4_phys) : "memory");
+
+        for (size_t p = 0; p < BENCH_SWITCH_PAGES; p++) {
+            sum += *(volatile uint64_t *)(BENCH_SWITCH_VADDR + p * PAGE_SIZE);
+        }
+    }
+    uint64_t cycles = rdtsc() - start;
+
+    vmm_switch_address_space(kernel_pml4_phys);
+    (void)sum;
+    return cycles / (BENCH_SWITCH_ROUNDS * 2);
+}
+
+// two address spaces taking turns, as the timer does with two runnable tasks.
+// runs with interrupts off, so nothing else switches cr3 in between
+void bench_context_switch(void *elf) {
+    if (!elf) return;
+
+    task_t *a = task_create_from_elf(elf);
+    task_t *b = task_create_from_elf(elf);
+    if (a && b && map_working_set(a) && map_working_set(b)) {
+        uint64_t flush = bench_switch_cycles(a, b, false);
+        uint64_t tagged = bench_switch_cycles(a, b, true);
+
+        serial_puts("[bench] address space ping-pong, 64 pages touched per switch\n");
+        if (!vmm_has_pcid()) serial_puts("[bench]   no PCID on this cpu, both runs flush\n");
+        bench_report("  full flush", flush, "cycles");
+        bench_report("  pcid, no flush", tagged, "cycles");
+    }
+    if (a) task_destroy(a);
+    if (b) task_destroy(b);
+}
+
+#define BENCH_THP_PASSES 16
+
+// cycles per pass reading one word from every page of the bench heap
+static uint64_t bench_heap_walk(task_t *task) {
+    uint64_t sum = 0;
+    vmm_switch_address_space((uint64_t)task->pml4_phys);
+
+    uint64_t start = rdtsc();
+    for (size_t pass = 0; pass < BENCH_THP_PASSES; pass++) {
+        for (size_t i = 0; i < BENCH_FORK_HEAP_PAGES; i++) {
+            sum += *(volatile uint64_t *)(BENCH_FORK_HEAP_VADDR + i * PAGE_SIZE);
+        }
+    }
+    uint64_t cycles = rdtsc() - start;
+
+    vmm_switch_address_space(kernel_pml4_phys);
+    (void)sum;
+    return cycles / BENCH_THP_PASSES;
+}
+
+// collapse the heap into 2 MiB pages, then punch a hole in it to force a split
+void bench_thp(void *elf) {
+    if (!elf) return;
+
+    task_t *task = task_create_from_elf(elf);
+    if (!task) return;
+    if (!map_bench_heap(task)) {
+        task_destroy(task);
+        return;
+    }
+
+    struct vmm_thp_stats before, after;
+    vmm_get_thp_stats(&before);
+
+    uint64_t small = bench_heap_walk(task);
+    uint64_t scan_start = rdtsc();
+    size_t collapsed = thp_scan(task, BENCH_FORK_HEAP_PAGES * PAGE_SIZE / HUGE_2MB);
+    uint64_t scan = rdtsc() - scan_start;
+    uint64_t huge = bench_heap_walk(task);
+
+    uint64_t *pml4 = (uint64_t *)phys_to_virt((uint64_t)task->pml4_phys);
+    vmm_unmap_user_range(pml4, BENCH_FORK_HEAP_VADDR + PAGE_SIZE, BENCH_FORK_HEAP_VADDR + 2 * PAGE_SIZE);
+    vmm_get_thp_stats(&after);
+    task_destroy(task);
+
+    serial_puts("[bench] transparent huge pages, 8 MiB touched heap\n");
+    bench_report("  ranges collapsed", collapsed, "");
+    bench_report("  scan", scan, "cycles");
+    bench_report("  heap walk, 4 KiB pages", small, "cycles");
+    bench_report("  heap walk, 2 MiB pages", huge, "cycles");
+    bench_report("  collapses counted", after.collapsed - before.collapsed, "");
+    bench_report("  splits counted", after.split - before.split, "");
+}
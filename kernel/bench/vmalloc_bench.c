@@ -0,0 +1,42 @@
+#include <bench/bench.h>
+#include <mm/pmm.h>
+#include <mm/vmalloc.h>
+#include <arch/x86_64/time/tsc.h>
+#include <drivers/serial.h>
+
+#define BENCH_VMAP_ROUNDS 512
+#define BENCH_VMAP_PAGES  4
+
+// average cycles per vmap/vunmap pair; eager flushes after every unmap,
+// lazy leaves it to the threshold purge and one at the end
+static uint64_t bench_vmap_cycles(uint64_t *frames, bool lazy) {
+    uint64_t start = rdtsc();
+    for (size_t i = 0; i < BENCH_VMAP_ROUNDS; i++) {
+        void *addr = vmap(frames, BENCH_VMAP_PAGES, PTE_KERNEL_RW_NX);
+        if (!addr) return 0;
+        vunmap(addr);
+        if (!lazy) vmalloc_purge_lazy();
+    }
+    vmalloc_purge_lazy();
+    return (rdtsc() - start) / BENCH_VMAP_ROUNDS;
+}
+
+void bench_vmalloc(void) {
+    uint64_t frames[BENCH_VMAP_PAGES];
+    for (size_t i = 0; i < BENCH_VMAP_PAGES; i++) {
+        frames[i] = (uint64_t)pmm_alloc();
+        if (!frames[i]) {
+            while (i--) pmm_free((void *)frames[i]);
+            return;
+        }
+    }
+
+    uint64_t eager = bench_vmap_cycles(frames, false);
+    uint64_t lazy = bench_vmap_cycles(frames, true);
+
+    for (size_t i = 0; i < BENCH_VMAP_PAGES; i++) pmm_free((void *)frames[i]);
+
+    serial_puts("[bench] vmap + unmap of 4 pages\n");
+    bench_report("  flush on every unmap", eager, "cycles");
+    bench_report("  lazy batched flush", lazy, "cycles");
+}
@@ -0,0 +1,42 @@
+#include <bench/bench.h>
+#include <mm/pmm.h>
+#include <mm/zeropool.h>
+#include <arch/x86_64/time/tsc.h>
+#include <drivers/serial.h>
+
+#define BENCH_ZERO_ROUNDS 128
+
+static void *bench_pages[BENCH_ZERO_ROUNDS];
+
+// average cycles for pmm_alloc_zeroed, all BENCH_ZERO_ROUNDS pages in flight
+static uint64_t bench_alloc_zeroed_cycles(void) {
+    uint64_t total = 0;
+    size_t done = 0;
+
+    for (size_t i = 0; i < BENCH_ZERO_ROUNDS; i++) {
+        uint64_t start = rdtsc();
+        bench_pages[i] = pmm_alloc_zeroed();
+        total += rdtsc() - start;
+        if (bench_pages[i]) done++;
+    }
+    for (size_t i = 0; i < BENCH_ZERO_ROUNDS; i++) {
+        if (bench_pages[i]) pmm_free(bench_pages[i]);
+    }
+    return done ? total / done : 0;
+}
+
+void bench_zero_pool(void) {
+    zero_pool_refill(ZERO_POOL_SIZE);
+    uint64_t hit = bench_alloc_zeroed_cycles();
+
+    zero_pool_drain();
+    uint64_t miss = bench_alloc_zeroed_cycles();
+
+    zero_pool_refill(ZERO_POOL_SIZE);
+
+    serial_puts("[bench] pmm_alloc_zeroed\n");
+    bench_report("  pool hit", hit, "cycles");
+    bench_report("  pool miss", miss, "cycles");
+    bench_report("  hits so far", zero_pool_hits(), "allocs");
+    bench_report("  misses so far", zero_pool_misses(), "allocs");
+}
@@ -1,6 +1,7 @@
 #include <drivers/fbtext.h>
 #include <drivers/font.h>
 #include <klib/string.h>
+#include <arch/x86_64/mm/vmm.h>
 
 #define LEFT_MARGIN 20
 
@@ -38,7 +39,7 @@ static inline void fb_advance(size_t pixels)
     }
 }
 
-static void fb_clear_area(size_t x, size_t y, size_t width, size_t height, uint32_t color)
+void fb_clear_area(size_t x, size_t y, size_t width, size_t height, uint32_t color)
 {
     if (!g_fb || x >= g_fb->width || y >= g_fb->height) return;
 
@@ -61,6 +62,15 @@ static void fb_clear_area(size_t x, size_t y, size_t width, size_t height, uint3
     }
 }
 
+bool fb_set_cache(uint64_t cache)
+{
+    if (!g_fb) return false;
+
+    uint64_t start = (uint64_t)g_fb->address & ~(PAGE_SIZE - 1);
+    uint64_t end = ((uint64_t)g_fb->address + g_fb->pitch * g_fb->height + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    return vmm_set_cache(start, (end - start) / PAGE_SIZE, cache);
+}
+
 void fb_clear(void) {
     fb_clear_area(0, 0, g_fb->width, g_fb->height, 0x000000);
     g_cursor_x = LEFT_MARGIN;
@@ -14,5 +14,8 @@ void fb_print(const char *str, uint32_t color);
 void fb_print_at(const char *str, uint32_t color, int x, int y);
 void fb_print_number(uint64_t, uint32_t color);
 void fb_clear(void);
+void fb_clear_area(size_t x, size_t y, size_t width, size_t height, uint32_t color);
+// memory type of the framebuffer mapping, one of the PTE_CACHE_* values
+bool fb_set_cache(uint64_t cache);
 
 #endif
\ No newline at end of file
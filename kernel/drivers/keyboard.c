@@ -9,6 +9,7 @@
 static char kbd_buffer[KBD_BUFFER_SIZE];
 static volatile unsigned int kbd_head = 0;
 static volatile unsigned int kbd_tail = 0;
+static void (*input_hook)(void);
 
 static inline bool kbd_buffer_empty(void) {
     return kbd_head == kbd_tail;
@@ -96,12 +97,17 @@ void keyboard_handler(void) {
         else {
             char ch = get_char_from_scancode(code);
             kbd_buffer_push(ch);
+            if (input_hook) input_hook();
         }
     }
 
     irq_eoi();
 }
 
+void keyboard_set_input_hook(void (*hook)(void)) {
+    input_hook = hook;
+}
+
 extern void keyboard_isr(void);
 
 void keyboard_init(void) {
@@ -8,5 +8,7 @@ void keyboard_init(void);
 bool keyboard_has_data(void);
 uint8_t keyboard_get_scancode(void);
 char keyboard_get_char(void);
+// called from the irq after every character that lands in the buffer
+void keyboard_set_input_hook(void (*hook)(void));
 
 #endif
\ No newline at end of file
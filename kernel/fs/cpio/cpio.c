@@ -46,4 +46,14 @@ void* cpio_lookup(struct limine_file *module, const char *path, size_t *out_size
     }
 
     return NULL;
-}
\ No newline at end of file
+}
+
+static struct limine_file *initrd;
+
+void cpio_set_initrd(struct limine_file *module) {
+    initrd = module;
+}
+
+void* initrd_lookup(const char *path, size_t *out_size) {
+    return cpio_lookup(initrd, path, out_size);
+}
@@ -25,4 +25,8 @@ typedef struct cpio_header {
 
 void* cpio_lookup(struct limine_file *module, const char *path, size_t *out_size);
 
+// the boot initrd, for lookups that don't have the module at hand (syscalls)
+void cpio_set_initrd(struct limine_file *module);
+void* initrd_lookup(const char *path, size_t *out_size);
+
 #endif
\ No newline at end of file
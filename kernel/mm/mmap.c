@@ -0,0 +1,128 @@
+#include <mm/mmap.h>
+#include <mm/vma.h>
+#include <arch/x86_64/mm/vmm.h>
+#include <arch/x86_64/usermode/scheduler.h>
+
+#define USER_SPACE_END 0x0000800000000000ULL
+
+static uint64_t page_align_up(uint64_t value) {
+    return (value + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+}
+
+static uint32_t prot_to_vma(uint32_t prot) {
+    uint32_t vma_prot = 0;
+    if (prot & PROT_READ) vma_prot |= VMA_READ;
+    if (prot & PROT_WRITE) vma_prot |= VMA_WRITE;
+    if (prot & PROT_EXEC) vma_prot |= VMA_EXEC;
+    return vma_prot;
+}
+
+// vmas first: if a split fails nothing has been torn down yet
+static bool unmap_range(struct task *task, uint64_t start, uint64_t end) {
+    if (!mm_remove_range(task->mm, start, end)) return false;
+    vmm_unmap_user_range((uint64_t *)phys_to_virt((uint64_t)task->pml4_phys), start, end);
+    return true;
+}
+
+int64_t do_mmap(struct task *task, uint64_t addr, uint64_t len, uint32_t prot, uint32_t flags,
+                int64_t fd, uint64_t offset) {
+    if (len == 0 || len > MMAP_END - MMAP_BASE || (offset & (PAGE_SIZE - 1))) return -1;
+    if (!(flags & (MAP_SHARED | MAP_PRIVATE))) return -1;
+    len = page_align_up(len);
+
+    const uint8_t *file = NULL;
+    uint64_t file_size = 0;
+    if (flags & MAP_ANONYMOUS) {
+        // anonymous memory is private to the task even across fork
+        if (flags & MAP_SHARED) return -1;
+    } else {
+        if (fd < TASK_FD_BASE || fd >= TASK_FD_BASE + TASK_MAX_FILES) return -1;
+        task_file_t *f = &task->files[fd - TASK_FD_BASE];
+        if (!f->data || offset > f->size) return -1;
+        // the initrd is read-only, there is nothing a shared writable mapping could write to
+        if ((flags & MAP_SHARED) && (prot & PROT_WRITE)) return -1;
+
+        file = f->data + offset;
+        file_size = f->size - offset < len ? f->size - offset : len;
+    }
+
+    if (flags & MAP_FIXED) {
+        if ((addr & (PAGE_SIZE - 1)) || addr < PAGE_SIZE || addr + len > USER_SPACE_END || addr + len < addr) {
+            return -1;
+        }
+        if (!unmap_range(task, addr, addr + len)) return -1;
+    } else {
+        // the hint is used when it is free, otherwise first fit above MMAP_BASE
+        addr &= ~(PAGE_SIZE - 1);
+        if (addr < MMAP_BASE || addr + len > MMAP_END || mm_find_gap(task->mm, len, addr, addr + len) != addr) {
+            addr = mm_find_gap(task->mm, len, MMAP_BASE, MMAP_END);
+            if (!addr) return -1;
+        }
+    }
+
+    struct vma *vma = vma_create(addr, addr + len, prot_to_vma(prot));
+    if (!vma) return -1;
+    vma->file = file;
+    vma->file_start = addr;
+    vma->file_size = file_size;
+    if (!mm_insert(task->mm, vma)) {
+        vma_free(vma);
+        return -1;
+    }
+    return addr;
+}
+
+int64_t do_munmap(struct task *task, uint64_t addr, uint64_t len) {
+    if ((addr & (PAGE_SIZE - 1)) || len == 0 || addr >= USER_SPACE_END) return -1;
+    uint64_t end = page_align_up(addr + len);
+    if (end > USER_SPACE_END || end < addr) return -1;
+
+    return unmap_range(task, addr, end) ? 0 : -1;
+}
+
+int64_t do_mprotect(struct task *task, uint64_t addr, uint64_t len, uint32_t prot) {
+    if ((addr & (PAGE_SIZE - 1)) || addr >= USER_SPACE_END) return -1;
+    uint64_t end = page_align_up(addr + len);
+    if (end > USER_SPACE_END || end < addr) return -1;
+    if (end == addr) return 0;
+
+    mm_t *mm = task->mm;
+    uint64_t covered = addr;
+    for (struct vma *vma = mm_find_next(mm, addr); covered < end; vma = vma->next) {
+        if (!vma || vma->start > covered) return -1;
+        covered = vma->end;
+    }
+
+    struct vma *vma = mm_find(mm, addr);
+    if (vma->start < addr && !(vma = mm_split(mm, vma, addr))) return -1;
+    for (; vma && vma->start < end; vma = vma->next) {
+        if (vma->end > end && !mm_split(mm, vma, end)) return -1;
+        vma->prot = prot_to_vma(prot);
+    }
+
+    uint64_t *pml4 = (uint64_t *)phys_to_virt((uint64_t)task->pml4_phys);
+    return vmm_protect_user_range(pml4, addr, end, prot & PROT_WRITE) ? 0 : -1;
+}
+
+uint64_t do_brk(struct task *task, uint64_t addr) {
+    mm_t *mm = task->mm;
+    if (addr < mm->brk_start || addr > MMAP_BASE) return mm->brk;
+
+    uint64_t old_top = page_align_up(mm->brk);
+    uint64_t new_top = page_align_up(addr);
+
+    if (new_top > old_top) {
+        struct vma *heap = vma_create(old_top, new_top, VMA_READ | VMA_WRITE);
+        if (!heap) return mm->brk;
+        // merges into the heap vma below, fails if something was mapped in the way
+        if (!mm_insert(mm, heap)) {
+            vma_free(heap);
+            return mm->brk;
+        }
+    } else if (new_top < old_top) {
+        if (!unmap_range(task, new_top, old_top)) return mm->brk;
+    }
+
+    mm->brk = addr;
+    return addr;
+}
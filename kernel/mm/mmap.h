@@ -0,0 +1,31 @@
+#ifndef ESTELLA_MM_MMAP_H
+#define ESTELLA_MM_MMAP_H
+
+#include <stdint.h>
+
+// linux values, so userspace headers can be shared
+#define PROT_READ  0x1
+#define PROT_WRITE 0x2
+#define PROT_EXEC  0x4
+
+#define MAP_SHARED    0x01
+#define MAP_PRIVATE   0x02
+#define MAP_FIXED     0x10
+#define MAP_ANONYMOUS 0x20
+
+// mmap without MAP_FIXED places mappings here, between the heap and the stack
+#define MMAP_BASE 0x0000100000000000ULL
+#define MMAP_END  0x00007FFF00000000ULL
+
+struct task;
+
+// these return the address (or new break) on success and -1 on failure, like the syscalls
+int64_t do_mmap(struct task *task, uint64_t addr, uint64_t len, uint32_t prot, uint32_t flags,
+                int64_t fd, uint64_t offset);
+int64_t do_munmap(struct task *task, uint64_t addr, uint64_t len);
+// brk(0) or any address below the initial break just reports the current one
+uint64_t do_brk(struct task *task, uint64_t addr);
+// the whole range has to be mapped. pages that become writable but are shared turn copy-on-write
+int64_t do_mprotect(struct task *task, uint64_t addr, uint64_t len, uint32_t prot);
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef ESTELLA_MM_PAGE_H
+#define ESTELLA_MM_PAGE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include <mm/pmm.h>
+
+// page flags
+#define PG_RESERVED  (1 << 0)   // never handed out by the allocator (firmware, pmm metadata, holes)
+#define PG_ZEROED    (1 << 1)   // contents were zero when the frame was allocated
+#define PG_PINNED    (1 << 2)   // must stay at this physical address
+#define PG_PAGETABLE (1 << 3)
+#define PG_USER      (1 << 4)   // mapped into a user address space
+#define PG_KHEAP     (1 << 5)   // backs kernel heap objects
+#define PG_COMPOUND  (1 << 6)   // head of a 2^order frame allocation
+#define PG_PCP       (1 << 7)   // free, parked in a per-cpu magazine; still used in the bitmap
+
+// one per physical frame, indexed by pfn. free frames are all zero, apart from PG_PCP
+struct page {
+    uint32_t refcount;
+    uint16_t flags;
+    uint8_t  order;      // compound heads: allocation spans 2^order frames
+    uint8_t  reserved;
+    uint64_t private;    // owner-defined
+};
+
+_Static_assert(sizeof(struct page) <= 16, "struct page must stay within 16 bytes");
+
+extern struct page *page_array;
+extern size_t page_array_frames;
+
+static inline struct page *pfn_to_page(size_t pfn) {
+    return pfn < page_array_frames ? &page_array[pfn] : NULL;
+}
+
+static inline struct page *phys_to_page(uint64_t phys) {
+    return pfn_to_page(phys / PAGE_SIZE);
+}
+
+static inline size_t page_to_pfn(const struct page *page) {
+    return (size_t)(page - page_array);
+}
+
+static inline uint64_t page_to_phys(const struct page *page) {
+    return page_to_pfn(page) * PAGE_SIZE;
+}
+
+static inline void page_get(struct page *page) {
+    __atomic_add_fetch(&page->refcount, 1, __ATOMIC_RELAXED);
+}
+
+// drop a reference, frees the frame (or the whole compound) once the last one is gone.
+// runs that aren't a power of two aren't compound and go back through pmm_free_frames
+bool page_put(struct page *page);
+
+#endif
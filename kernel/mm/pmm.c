@@ -1,18 +1,75 @@
-// Physical memory manager using a simple bitmap
+// Physical memory manager: binary buddy allocator on top of a used/free bitmap
 #include <mm/pmm.h>
+#include <mm/zeropool.h>
+#include <mm/page.h>
 #include <stdbool.h>
 #include <klib/memory.h>
 #include <drivers/serial.h>
 #include <klib/string.h>
-
-static uint8_t *pmm_bitmap; 
-static size_t pmm_bitmap_bytes;
+#include <arch/x86_64/cpu/percpu.h>
+#include <arch/x86_64/cpu/spinlock.h>
+#include <arch/x86_64/time/tsc.h>
+
+#define PMM_NO_FRAME ((size_t)-1)
+
+// per-cpu magazines of single frames in front of the buddy lists
+#define PCP_HIGH  128   // a magazine above this is drained...
+#define PCP_LOW   64    // ...down to this
+#define PCP_BATCH 32    // frames pulled in one go when a magazine runs empty
+#define PCP_BATCH_ORDER 5
+
+// bootloader/ACPI reclaimable regions remembered for pmm_reclaim_boot_memory
+#define PMM_MAX_RECLAIM_RANGES 64
+
+// free blocks are linked through their own first frame (via hhdm)
+struct pmm_free_block {
+    struct pmm_free_block *next;
+    struct pmm_free_block *prev;
+};
+
+// one bit per frame (set = used), plus one summary bit per bitmap word
+// (set = that word has at least one free frame)
+static uint64_t *pmm_bitmap;
+static uint64_t *pmm_summary;
+static size_t pmm_bitmap_words;
+static size_t pmm_summary_words;
 static size_t pmm_bitmap_frames;
 static size_t pmm_total_frames_count;
 static size_t pmm_usable_frames_count;
 static size_t pmm_free_frames_count;
 static size_t pmm_used_frames_count;
 static size_t next_fit_hint = 0;
+static uint64_t pmm_init_cycles;
+
+struct pmm_range {
+    size_t start;
+    size_t count;
+};
+
+// the memmap itself lives in reclaimable memory, so keep our own copy
+static struct pmm_range reclaim_ranges[PMM_MAX_RECLAIM_RANGES];
+static size_t reclaim_range_count;
+static size_t pmm_reclaimed_frames_count;
+
+// order + 1 for the first frame of every free block, 0 everywhere else
+static uint8_t *pmm_order_map;
+static struct pmm_free_block *free_lists[PMM_MAX_ORDER + 1];
+static size_t free_blocks_count[PMM_MAX_ORDER + 1];
+
+// frame database, lives right after the order map
+struct page *page_array;
+size_t page_array_frames;
+
+// protects the bitmap, the free lists and the global counters
+static spinlock_t pmm_lock = SPINLOCK_INIT;
+
+struct pmm_pcp {
+    size_t count;
+    size_t frames[PCP_HIGH];
+} __attribute__((aligned(64)));
+
+static struct pmm_pcp pcp_caches[MAX_CPUS];
+
 extern struct limine_hhdm_request hhdm_request;
 extern struct limine_memmap_request memmap_request;
 uint64_t hhdm_offset;
@@ -35,19 +92,341 @@ static bool is_ram_type(uint64_t type) {
         || type == LIMINE_MEMMAP_ACPI_RECLAIMABLE;
 }
 
-static void pmm_set_frame(size_t frame) {
-    pmm_bitmap[frame / 8] |= (uint8_t)(1u << (frame % 8));
+static inline unsigned ctz64(uint64_t value) {
+    return (unsigned)__builtin_ctzll(value);
+}
+
+static inline unsigned popcount64(uint64_t value) {
+    value = value - ((value >> 1) & 0x5555555555555555ULL);
+    value = (value & 0x3333333333333333ULL) + ((value >> 2) & 0x3333333333333333ULL);
+    value = (value + (value >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return (unsigned)((value * 0x0101010101010101ULL) >> 56);
+}
+
+static void summary_update(size_t word) {
+    uint64_t bit = 1ULL << (word % 64);
+    if (pmm_bitmap[word] != ~0ULL) pmm_summary[word / 64] |= bit;
+    else pmm_summary[word / 64] &= ~bit;
 }
 
 static void pmm_clear_frame(size_t frame) {
-    pmm_bitmap[frame / 8] &= (uint8_t)~(1u << (frame % 8));
+    pmm_bitmap[frame / 64] &= ~(1ULL << (frame % 64));
+    pmm_summary[frame / 4096] |= 1ULL << ((frame / 64) % 64);
 }
 
 static bool pmm_test_frame(size_t frame) {
-    return (pmm_bitmap[frame / 8] & (uint8_t)(1u << (frame % 8))) != 0;
+    return (pmm_bitmap[frame / 64] & (1ULL << (frame % 64))) != 0;
+}
+
+// bits [start % 64, ...) of the first word, up to `count` of them
+static uint64_t word_mask(size_t start, size_t count) {
+    unsigned shift = start % 64;
+    if (count >= 64 - shift) return ~0ULL << shift;
+    return ((1ULL << count) - 1) << shift;
+}
+
+// set [start, start + count), returns how many of those frames were free
+static size_t pmm_set_range(size_t start, size_t count) {
+    size_t newly_used = 0;
+    while (count > 0) {
+        size_t word = start / 64;
+        uint64_t mask = word_mask(start, count);
+        size_t n = popcount64(mask);
+
+        newly_used += popcount64(~pmm_bitmap[word] & mask);
+        pmm_bitmap[word] |= mask;
+        summary_update(word);
+
+        start += n;
+        count -= n;
+    }
+    return newly_used;
+}
+
+// clear [start, start + count), returns how many of those frames were used
+static size_t pmm_clear_range(size_t start, size_t count) {
+    size_t newly_free = 0;
+    while (count > 0) {
+        size_t word = start / 64;
+        uint64_t mask = word_mask(start, count);
+        size_t n = popcount64(mask);
+
+        if (mask == ~0ULL && count >= 128) {
+            // whole words in the middle: count, then memset them in one go
+            size_t words = count / 64;
+            for (size_t i = 0; i < words; i++) {
+                newly_free += popcount64(pmm_bitmap[word + i]);
+            }
+            memset(&pmm_bitmap[word], 0, words * sizeof(uint64_t));
+            for (size_t i = 0; i < words; i++) {
+                pmm_summary[(word + i) / 64] |= 1ULL << ((word + i) % 64);
+            }
+            start += words * 64;
+            count -= words * 64;
+            continue;
+        }
+
+        newly_free += popcount64(pmm_bitmap[word] & mask);
+        pmm_bitmap[word] &= ~mask;
+        pmm_summary[word / 64] |= 1ULL << (word % 64);
+
+        start += n;
+        count -= n;
+    }
+    return newly_free;
+}
+
+// index of the first word >= `word` holding a free frame, pmm_bitmap_words if none
+static size_t next_free_word(size_t word) {
+    while (word < pmm_bitmap_words) {
+        uint64_t bits = pmm_summary[word / 64] & (~0ULL << (word % 64));
+        if (bits) return (word & ~63ULL) + ctz64(bits);
+        word = (word & ~63ULL) + 64;
+    }
+    return pmm_bitmap_words;
+}
+
+// first free frame at or after `frame`, pmm_bitmap_frames if none
+static size_t next_free_frame(size_t frame) {
+    size_t word = frame / 64;
+    if (word >= pmm_bitmap_words) return pmm_bitmap_frames;
+
+    uint64_t free_bits = ~pmm_bitmap[word] & (~0ULL << (frame % 64));
+    if (!free_bits) {
+        word = next_free_word(word + 1);
+        if (word >= pmm_bitmap_words) return pmm_bitmap_frames;
+        free_bits = ~pmm_bitmap[word];
+    }
+    return word * 64 + ctz64(free_bits);
+}
+
+// first used frame in [frame, limit), limit if the whole range is free
+static size_t next_used_frame(size_t frame, size_t limit) {
+    if (limit > pmm_bitmap_frames) limit = pmm_bitmap_frames;
+
+    size_t word = frame / 64;
+    uint64_t used_bits = pmm_bitmap[word] & (~0ULL << (frame % 64));
+    while (!used_bits) {
+        word++;
+        if (word * 64 >= limit) return limit;
+        used_bits = pmm_bitmap[word];
+    }
+
+    size_t used = word * 64 + ctz64(used_bits);
+    return used < limit ? used : limit;
+}
+
+// first free run of `count` frames starting at a multiple of `align` in [from, to)
+static size_t bitmap_find_run(size_t from, size_t to, size_t count, size_t align) {
+    size_t frame = next_free_frame(from);
+
+    while (frame < to) {
+        size_t start = (frame + align - 1) / align * align;
+        if (start >= to) break;
+        if (pmm_test_frame(start)) {
+            frame = next_free_frame(start);
+            continue;
+        }
+
+        size_t end = next_used_frame(start, start + count);
+        if (end - start >= count) return start;
+        frame = next_free_frame(end);
+    }
+    return PMM_NO_FRAME;
+}
+
+static unsigned order_for_count(size_t count) {
+    unsigned order = 0;
+    while (((size_t)1 << order) < count) order++;
+    return order;
+}
+
+static struct pmm_free_block *frame_to_block(size_t frame) {
+    return (struct pmm_free_block *)(frame * PAGE_SIZE + hhdm_offset);
+}
+
+static size_t block_to_frame(struct pmm_free_block *block) {
+    return ((uint64_t)block - hhdm_offset) / PAGE_SIZE;
+}
+
+static void buddy_list_add(size_t frame, unsigned order) {
+    struct pmm_free_block *block = frame_to_block(frame);
+    block->prev = NULL;
+    block->next = free_lists[order];
+    if (free_lists[order]) free_lists[order]->prev = block;
+    free_lists[order] = block;
+
+    pmm_order_map[frame] = (uint8_t)(order + 1);
+    free_blocks_count[order]++;
+}
+
+static void buddy_list_remove(size_t frame, unsigned order) {
+    struct pmm_free_block *block = frame_to_block(frame);
+    if (block->prev) block->prev->next = block->next;
+    else free_lists[order] = block->next;
+    if (block->next) block->next->prev = block->prev;
+
+    pmm_order_map[frame] = 0;
+    free_blocks_count[order]--;
+}
+
+static bool buddy_is_free_head(size_t frame, unsigned order) {
+    return frame < pmm_bitmap_frames && pmm_order_map[frame] == order + 1;
+}
+
+// put one naturally aligned block back, merging with its buddy while possible
+static void buddy_free_block(size_t frame, unsigned order) {
+    while (order < PMM_MAX_ORDER) {
+        size_t buddy = frame ^ ((size_t)1 << order);
+        if (!buddy_is_free_head(buddy, order)) break;
+
+        buddy_list_remove(buddy, order);
+        if (buddy < frame) frame = buddy;
+        order++;
+    }
+    buddy_list_add(frame, order);
+}
+
+// split an arbitrary frame range into the largest aligned blocks it contains
+static void buddy_free_range(size_t frame, size_t count) {
+    while (count > 0) {
+        unsigned order = PMM_MAX_ORDER;
+        while (order > 0 && ((frame & (((size_t)1 << order) - 1)) != 0 || ((size_t)1 << order) > count)) {
+            order--;
+        }
+        buddy_free_block(frame, order);
+        frame += (size_t)1 << order;
+        count -= (size_t)1 << order;
+    }
+}
+
+static size_t buddy_alloc_block(unsigned order) {
+    unsigned cur = order;
+    while (cur <= PMM_MAX_ORDER && !free_lists[cur]) cur++;
+    if (cur > PMM_MAX_ORDER) return PMM_NO_FRAME;
+
+    size_t frame = block_to_frame(free_lists[cur]);
+    buddy_list_remove(frame, cur);
+
+    // hand the upper halves back until the block has the wanted order
+    while (cur > order) {
+        cur--;
+        buddy_list_add(frame + ((size_t)1 << cur), cur);
+    }
+    return frame;
+}
+
+// take [start, start + count) out of the free lists; every frame in it must be free
+static void buddy_carve(size_t start, size_t count) {
+    size_t end = start + count;
+    size_t frame = start;
+
+    while (frame < end) {
+        size_t head = frame;
+        unsigned order = 0;
+        for (; order <= PMM_MAX_ORDER; order++) {
+            head = frame & ~(((size_t)1 << order) - 1);
+            if (buddy_is_free_head(head, order)) break;
+        }
+        if (order > PMM_MAX_ORDER) {
+            serial_puts("buddy_carve: frame not in any free block\n");
+            return;
+        }
+
+        size_t block_end = head + ((size_t)1 << order);
+        buddy_list_remove(head, order);
+        if (head < frame) buddy_free_range(head, frame - head);
+        if (block_end > end) buddy_free_range(end, block_end - end);
+
+        frame = block_end < end ? block_end : end;
+    }
+}
+
+static void mark_run_used(size_t start, size_t count) {
+    pmm_set_range(start, count);
+    pmm_free_frames_count -= count;
+    pmm_used_frames_count += count;
+}
+
+// frames sitting in magazines are used in the bitmap but free for the counters
+static size_t pcp_cached_frames(void) {
+    size_t cached = 0;
+    for (size_t i = 0; i < MAX_CPUS; i++) {
+        cached += pcp_caches[i].count;
+    }
+    return cached;
+}
+
+static void pcp_refill(struct pmm_pcp *pcp) {
+    spin_lock(&pmm_lock);
+
+    size_t frame = buddy_alloc_block(PCP_BATCH_ORDER);
+    if (frame != PMM_NO_FRAME) {
+        mark_run_used(frame, PCP_BATCH);
+        for (size_t i = PCP_BATCH; i > 0; i--) {
+            page_array[frame + i - 1].flags = PG_PCP;
+            pcp->frames[pcp->count++] = frame + i - 1;
+        }
+    } else {
+        while (pcp->count < PCP_BATCH) {
+            frame = buddy_alloc_block(0);
+            if (frame == PMM_NO_FRAME) break;
+            mark_run_used(frame, 1);
+            page_array[frame].flags = PG_PCP;
+            pcp->frames[pcp->count++] = frame;
+        }
+    }
+
+    spin_unlock(&pmm_lock);
+}
+
+static void pcp_drain(struct pmm_pcp *pcp, size_t target) {
+    spin_lock(&pmm_lock);
+    while (pcp->count > target) {
+        size_t frame = pcp->frames[--pcp->count];
+        page_array[frame].flags = 0;
+        pmm_clear_frame(frame);
+        pmm_free_frames_count++;
+        pmm_used_frames_count--;
+        buddy_free_block(frame, 0);
+    }
+    spin_unlock(&pmm_lock);
+}
+
+static size_t pcp_alloc(void) {
+    uint64_t flags = irq_save();
+    struct pmm_pcp *pcp = &pcp_caches[this_cpu_id()];
+
+    if (pcp->count == 0) pcp_refill(pcp);
+
+    size_t frame = PMM_NO_FRAME;
+    if (pcp->count > 0) {
+        frame = pcp->frames[--pcp->count];
+        page_array[frame].flags = 0;
+    }
+
+    irq_restore(flags);
+    return frame;
+}
+
+static void pcp_free(size_t frame) {
+    uint64_t flags = irq_save();
+    struct pmm_pcp *pcp = &pcp_caches[this_cpu_id()];
+
+    if (pcp->count >= PCP_HIGH) pcp_drain(pcp, PCP_LOW);
+    pcp->frames[pcp->count++] = frame;
+
+    irq_restore(flags);
+}
+
+void pmm_drain_cpu_cache(void) {
+    uint64_t flags = irq_save();
+    pcp_drain(&pcp_caches[this_cpu_id()], 0);
+    irq_restore(flags);
 }
 
 void pmm_init() {
+    uint64_t init_start = rdtsc();
     const struct limine_memmap_response *memmap = memmap_request.response;
     hhdm_offset = hhdm_request.response->offset;
 
@@ -77,14 +456,31 @@ void pmm_init() {
                 usable_frames += (size_t)((end - start) / PAGE_SIZE);
             }
         }
+
+        if (entry->type == LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE
+            || entry->type == LIMINE_MEMMAP_ACPI_RECLAIMABLE) {
+            uint64_t start = align_up(entry->base, PAGE_SIZE);
+            uint64_t end   = align_down(entry->base + entry->length, PAGE_SIZE);
+            if (end > start && reclaim_range_count < PMM_MAX_RECLAIM_RANGES) {
+                reclaim_ranges[reclaim_range_count].start = start / PAGE_SIZE;
+                reclaim_ranges[reclaim_range_count].count = (end - start) / PAGE_SIZE;
+                reclaim_range_count++;
+            }
+        }
     }
 
     pmm_bitmap_frames = align_up(max_addr, PAGE_SIZE) / PAGE_SIZE;
     pmm_total_frames_count = total_ram_frames;
     pmm_usable_frames_count = usable_frames;
 
-    pmm_bitmap_bytes = (pmm_bitmap_frames + 7) / 8;
-    size_t bitmap_size = align_up(pmm_bitmap_bytes, PAGE_SIZE);
+    // bitmap, summary bitmap, one order byte per frame, then the struct page array
+    pmm_bitmap_words = (pmm_bitmap_frames + 63) / 64;
+    pmm_summary_words = (pmm_bitmap_words + 63) / 64;
+    size_t bitmap_bytes = pmm_bitmap_words * sizeof(uint64_t);
+    size_t summary_bytes = pmm_summary_words * sizeof(uint64_t);
+    size_t pages_offset = align_up(bitmap_bytes + summary_bytes + pmm_bitmap_frames, 64);
+    size_t pages_bytes = pmm_bitmap_frames * sizeof(struct page);
+    size_t bitmap_size = align_up(pages_offset + pages_bytes, PAGE_SIZE);
 
 
     // find place for bitmap
@@ -113,10 +509,17 @@ void pmm_init() {
         return;
     }
 
-    pmm_bitmap = (uint8_t *)(bitmap_phys + hhdm_offset);
+    pmm_bitmap = (uint64_t *)(bitmap_phys + hhdm_offset);
+    pmm_summary = pmm_bitmap + pmm_bitmap_words;
+    pmm_order_map = (uint8_t *)(pmm_summary + pmm_summary_words);
+    page_array = (struct page *)((uint8_t *)pmm_bitmap + pages_offset);
+    page_array_frames = pmm_bitmap_frames;
 
-    // initially everything marked as used
-    memset(pmm_bitmap, 0xFF, pmm_bitmap_bytes);
+    // initially everything marked as used (including the tail of the last word)
+    memset(pmm_bitmap, 0xFF, bitmap_bytes);
+    memset(pmm_summary, 0, summary_bytes);
+    memset(pmm_order_map, 0, pmm_bitmap_frames);
+    memset(page_array, 0, pages_bytes);
 
     pmm_free_frames_count = 0;
     pmm_used_frames_count = pmm_usable_frames_count;
@@ -128,34 +531,34 @@ void pmm_init() {
 
         uint64_t base = align_up(entry->base, PAGE_SIZE);
         uint64_t end  = align_down(entry->base + entry->length, PAGE_SIZE);
-        for (uint64_t addr = base; addr < end; addr += PAGE_SIZE) {
-            size_t frame = (size_t)(addr / PAGE_SIZE);
-            if (frame < pmm_bitmap_frames && pmm_test_frame(frame)) {
-                pmm_clear_frame(frame);
-                pmm_free_frames_count++;
-                pmm_used_frames_count--;
-            }
-        }
-    }
+        if (end <= base) continue;
 
-    // protect frame 0
-    pmm_set_frame(0);
-    if (pmm_free_frames_count > 0) {
-        pmm_free_frames_count--;
-        pmm_used_frames_count++;
+        size_t freed = pmm_clear_range(base / PAGE_SIZE, (end - base) / PAGE_SIZE);
+        pmm_free_frames_count += freed;
+        pmm_used_frames_count -= freed;
     }
 
-    // protect bitmap
-    uint64_t bitmap_end = bitmap_phys + bitmap_size;
-    for (uint64_t addr = bitmap_phys; addr < bitmap_end; addr += PAGE_SIZE) {
-        size_t frame = (size_t)(addr / PAGE_SIZE);
-        if (frame < pmm_bitmap_frames && !pmm_test_frame(frame)) {
-            pmm_set_frame(frame);
-            pmm_free_frames_count--;
-            pmm_used_frames_count++;
+    // protect frame 0 and the bitmap itself
+    size_t protected = pmm_set_range(0, 1);
+    protected += pmm_set_range(bitmap_phys / PAGE_SIZE, bitmap_size / PAGE_SIZE);
+    pmm_free_frames_count -= protected;
+    pmm_used_frames_count += protected;
+
+    // seed the buddy free lists with every free run, everything else is reserved
+    size_t frame = 0;
+    while (frame < pmm_bitmap_frames) {
+        size_t free_start = next_free_frame(frame);
+        for (size_t f = frame; f < free_start; f++) {
+            page_array[f].flags = PG_RESERVED;
         }
+        if (free_start >= pmm_bitmap_frames) break;
+
+        size_t free_end = next_used_frame(free_start, pmm_bitmap_frames);
+        buddy_free_range(free_start, free_end - free_start);
+        frame = free_end;
     }
 
+    pmm_init_cycles = rdtsc() - init_start;
     serial_puts("PMM initialized\n");
 }
 
@@ -164,61 +567,30 @@ void *pmm_alloc(void) {
 }
 
 void *pmm_alloc_zeroed(void) {
-    void *page = pmm_alloc();
-    if(page) {
-        memset(page + hhdm_offset, 0, PAGE_SIZE);
+    void *page = zero_pool_take();
+    if (!page) {
+        page = pmm_alloc();
+        if (!page) return NULL;
+        zero_frames(page + hhdm_offset, 1);
     }
+
+    page_array[(uint64_t)page / PAGE_SIZE].flags |= PG_ZEROED;
     return page;
 }
 
 
 
 void *pmm_alloc_frames(size_t count) {
-    if (count == 0 || pmm_free_frames_count < count) {
-        return NULL;
-    }
-
-    size_t frame = next_fit_hint;
-    size_t wrap_point = frame;
-    size_t run_start = 0;
-    size_t run_length = 0;
-    bool wrapped = false;
-
-    while (true) {
-        if (!pmm_test_frame(frame)) {
-            if (run_length == 0) {
-                run_start = frame;
-            }
-            run_length++;
-
-            if (run_length == count) {
-                for (size_t i = 0; i < count; i++) {
-                    pmm_set_frame(run_start + i);
-                }
-                pmm_free_frames_count -= count;
-                pmm_used_frames_count += count;
-
-                next_fit_hint = (run_start + count) % pmm_bitmap_frames;
-                return (void *)(run_start * PAGE_SIZE);
-            }
-        } else {
-            run_length = 0;
-        }
-
-        frame = (frame + 1) % pmm_bitmap_frames;
-        if (frame == wrap_point) {
-            if (wrapped) break;
-            wrapped = true;
-        }
-    }
-
-    return NULL;
+    return pmm_alloc_frames_aligned(count, PAGE_SIZE);
 }
 
 void *pmm_alloc_frames_zeroed(size_t count) {
+    if (count == 1) return pmm_alloc_zeroed();
+
     void *pages = pmm_alloc_frames(count);
     if (pages) {
-        memset(pages + hhdm_offset, 0, count * PAGE_SIZE);
+        zero_frames(pages + hhdm_offset, count);
+        page_array[(uint64_t)pages / PAGE_SIZE].flags |= PG_ZEROED;
     }
     return pages;
 }
@@ -227,32 +599,65 @@ void pmm_free(void *phys_addr) {
     pmm_free_frames(phys_addr, 1);
 }
 
+static void report_bad_free(size_t frame) {
+    serial_puts("pmm_free_frames: double-free or invalid free at frame ");
+    char buf[32];
+    u64_to_dec(frame, buf);
+    serial_puts(buf);
+    serial_puts("\n");
+}
+
 void pmm_free_frames(void *phys_addr, size_t count) {
     if (count == 0) return;
 
     uint64_t addr = (uint64_t)phys_addr;
     size_t frame = (size_t)(addr / PAGE_SIZE);
 
+    if (count == 1) {
+        if (frame >= pmm_bitmap_frames) return;
+        // a frame in a magazine is still used in the bitmap, PG_PCP is what tells a
+        // second free apart. set atomically so two racing frees can't both pass
+        if (!pmm_test_frame(frame) ||
+            (__atomic_fetch_or(&page_array[frame].flags, PG_PCP, __ATOMIC_ACQ_REL) & PG_PCP)) {
+            report_bad_free(frame);
+            return;
+        }
+        page_array[frame] = (struct page){ .flags = PG_PCP };
+        pcp_free(frame);
+        return;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+
+    size_t run_start = frame;
+    size_t run_length = 0;
+
     for (size_t i = 0; i < count; i++) {
         size_t cur = frame + i;
         if (cur >= pmm_bitmap_frames) break;
 
-        if (!pmm_test_frame(cur)) {
-            serial_puts("pmm_free_frames: double-free or invalid free at frame ");
-            char buf[32];
-            u64_to_dec(cur, buf);
-            serial_puts(buf);
-            serial_puts("\n");
+        if (!pmm_test_frame(cur) || (page_array[cur].flags & PG_PCP)) {
+            report_bad_free(cur);
+
+            if (run_length) buddy_free_range(run_start, run_length);
+            run_start = cur + 1;
+            run_length = 0;
             continue;
         }
         pmm_clear_frame(cur);
+        page_array[cur] = (struct page){0};
         pmm_free_frames_count++;
         pmm_used_frames_count--;
+        run_length++;
     }
+
+    if (run_length) buddy_free_range(run_start, run_length);
+
+    spin_unlock_irqrestore(&pmm_lock, flags);
 }
 
-void *pmm_alloc_frames_aligned(size_t count, size_t alignment) {
-    if (count == 0 || pmm_free_frames_count < count || alignment == 0) {
+static void *alloc_linear_locked(size_t count, size_t alignment) {
+    if (pmm_free_frames_count < count) {
         return NULL;
     }
 
@@ -260,53 +665,154 @@ void *pmm_alloc_frames_aligned(size_t count, size_t alignment) {
         alignment = PAGE_SIZE;
     }
 
-    size_t frame = next_fit_hint;
-    size_t wrap_point = frame;
-    size_t run_start = 0;
-    size_t run_length = 0;
-    bool wrapped = false;
-
-    while (true) {
-        if (!pmm_test_frame(frame)) {
-            if (run_length == 0 && ((frame * PAGE_SIZE) % alignment == 0)) {
-                run_start = frame;
-                run_length = 1;
-            } else if (run_length > 0) {
-                run_length++;
-            }
+    // frame * PAGE_SIZE must be a multiple of alignment
+    size_t a = alignment, b = PAGE_SIZE;
+    while (b) {
+        size_t t = a % b;
+        a = b;
+        b = t;
+    }
+    size_t align_frames = alignment / a;
+
+    // next-fit: search from the hint to the end, then wrap around to 0
+    size_t run_start = bitmap_find_run(next_fit_hint, pmm_bitmap_frames, count, align_frames);
+    if (run_start == PMM_NO_FRAME) {
+        run_start = bitmap_find_run(0, next_fit_hint, count, align_frames);
+    }
+    if (run_start == PMM_NO_FRAME) {
+        return NULL;
+    }
+
+    buddy_carve(run_start, count);
+    mark_run_used(run_start, count);
+
+    next_fit_hint = (run_start + count) % pmm_bitmap_frames;
+    return (void *)(run_start * PAGE_SIZE);
+}
+
+// fresh allocation: one reference; power-of-two runs are marked compound on their head
+static void page_init_alloc(void *pages, size_t count) {
+    struct page *page = &page_array[(uint64_t)pages / PAGE_SIZE];
+    page->refcount = 1;
+    if (count > 1 && (count & (count - 1)) == 0) {
+        page->flags = PG_COMPOUND;
+        page->order = (uint8_t)order_for_count(count);
+    }
+}
 
-            if (run_length == count) {
-                for (size_t i = 0; i < count; i++) {
-                    pmm_set_frame(run_start + i);
-                }
-                pmm_free_frames_count -= count;
-                pmm_used_frames_count += count;
+void *pmm_alloc_frames_linear(size_t count, size_t alignment) {
+    if (count == 0 || alignment == 0) {
+        return NULL;
+    }
 
-                next_fit_hint = (run_start + count) % pmm_bitmap_frames;
-                return (void *)(run_start * PAGE_SIZE);
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    void *pages = alloc_linear_locked(count, alignment);
+    spin_unlock_irqrestore(&pmm_lock, flags);
+
+    if (pages) page_init_alloc(pages, count);
+    return pages;
+}
+
+#if ESTELLA_BENCH
+// bench hook: locate a free run without taking it, one bit or one word at a time
+size_t pmm_bench_find_run(size_t count, bool word_scan) {
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    size_t found = PMM_NO_FRAME;
+
+    if (word_scan) {
+        found = bitmap_find_run(0, pmm_bitmap_frames, count, 1);
+    } else {
+        size_t run_length = 0;
+        for (size_t frame = 0; frame < pmm_bitmap_frames; frame++) {
+            if (pmm_test_frame(frame)) {
+                run_length = 0;
+            } else if (++run_length == count) {
+                found = frame + 1 - count;
+                break;
             }
-        } else {
-            run_length = 0;
         }
+    }
 
-        frame = (frame + 1) % pmm_bitmap_frames;
-        if (frame == wrap_point) {
-            if (wrapped) break;
-            wrapped = true;
-        }
+    spin_unlock_irqrestore(&pmm_lock, flags);
+    return found;
+}
+#endif
+
+static void *alloc_frames_aligned(size_t count, size_t alignment) {
+    if (alignment < PAGE_SIZE) {
+        alignment = PAGE_SIZE;
+    }
+
+    if (count == 1 && alignment == PAGE_SIZE) {
+        size_t frame = pcp_alloc();
+        return frame == PMM_NO_FRAME ? NULL : (void *)(frame * PAGE_SIZE);
+    }
+
+    // blocks are naturally aligned, so alignment is just a minimum order
+    size_t align_frames = alignment / PAGE_SIZE;
+    bool pow2_alignment = (alignment & (alignment - 1)) == 0;
+    unsigned order = order_for_count(count);
+    unsigned align_order = order_for_count(align_frames);
+    if (align_order > order) order = align_order;
+
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+
+    if (!pow2_alignment || order > PMM_MAX_ORDER) {
+        void *pages = alloc_linear_locked(count, alignment);
+        spin_unlock_irqrestore(&pmm_lock, flags);
+        return pages;
+    }
+
+    size_t frame = buddy_alloc_block(order);
+    if (frame == PMM_NO_FRAME) {
+        spin_unlock_irqrestore(&pmm_lock, flags);
+        return NULL;
+    }
+
+    size_t block_frames = (size_t)1 << order;
+    if (block_frames > count) {
+        buddy_free_range(frame + count, block_frames - count);
+    }
+    mark_run_used(frame, count);
+
+    spin_unlock_irqrestore(&pmm_lock, flags);
+    return (void *)(frame * PAGE_SIZE);
+}
+
+void *pmm_alloc_frames_aligned(size_t count, size_t alignment) {
+    if (count == 0 || alignment == 0) {
+        return NULL;
+    }
+
+    void *pages = alloc_frames_aligned(count, alignment);
+    // out of memory: the zero pool is only a cache, take its frames back
+    if (!pages && zero_pool_drain() > 0) {
+        pages = alloc_frames_aligned(count, alignment);
     }
 
-    return NULL;
+    if (pages) page_init_alloc(pages, count);
+    return pages;
 }
 
 void *pmm_alloc_frames_aligned_zeroed(size_t count, size_t alignment) {
     void *pages = pmm_alloc_frames_aligned(count, alignment);
     if (pages) {
-        memset((void *)((uint64_t)pages + hhdm_offset), 0, count * PAGE_SIZE);
+        zero_frames((void *)((uint64_t)pages + hhdm_offset), count);
+        page_array[(uint64_t)pages / PAGE_SIZE].flags |= PG_ZEROED;
     }
     return pages;
 }
 
+void *pmm_alloc_huge_2mb(void) {
+    size_t count = (size_t)1 << PMM_ORDER_2MB;
+    return pmm_alloc_frames_aligned(count, count * PAGE_SIZE);
+}
+
+void *pmm_alloc_huge_1gb(void) {
+    size_t count = (size_t)1 << PMM_ORDER_1GB;
+    return pmm_alloc_frames_aligned(count, count * PAGE_SIZE);
+}
+
 void *pmm_alloc_aligned(size_t bytes, size_t alignment) {
     size_t count = bytes_to_frames_ceil(bytes);
     return pmm_alloc_frames_aligned(count, alignment);
@@ -317,6 +823,59 @@ void *pmm_alloc_aligned_zeroed(size_t bytes, size_t alignment) {
     return pmm_alloc_frames_aligned_zeroed(count, alignment);
 }
 
+bool page_put(struct page *page) {
+    if (__atomic_sub_fetch(&page->refcount, 1, __ATOMIC_ACQ_REL) != 0) return false;
+
+    size_t count = (page->flags & PG_COMPOUND) ? (size_t)1 << page->order : 1;
+    pmm_free_frames((void *)page_to_phys(page), count);
+    return true;
+}
+
+bool pmm_is_reclaimable(uint64_t phys) {
+    size_t frame = phys / PAGE_SIZE;
+    for (size_t i = 0; i < reclaim_range_count; i++) {
+        if (frame >= reclaim_ranges[i].start && frame - reclaim_ranges[i].start < reclaim_ranges[i].count) {
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t pmm_reclaim_boot_memory(void) {
+    size_t reclaimed = 0;
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+
+    for (size_t i = 0; i < reclaim_range_count; i++) {
+        size_t start = reclaim_ranges[i].start;
+        size_t count = reclaim_ranges[i].count;
+
+        // frame 0 stays reserved
+        if (start == 0) {
+            start++;
+            count--;
+        }
+        if (count == 0) continue;
+
+        // never expected, but a free frame in here would end up on the lists twice
+        if (next_free_frame(start) < start + count) {
+            serial_puts("pmm_reclaim_boot_memory: region already partly free, skipped\n");
+            continue;
+        }
+
+        reclaimed += pmm_clear_range(start, count);
+        memset(&page_array[start], 0, count * sizeof(struct page));
+        buddy_free_range(start, count);
+    }
+    reclaim_range_count = 0;
+
+    pmm_free_frames_count += reclaimed;
+    pmm_usable_frames_count += reclaimed;
+    pmm_reclaimed_frames_count += reclaimed;
+
+    spin_unlock_irqrestore(&pmm_lock, flags);
+    return reclaimed;
+}
+
 size_t pmm_get_total_frames(void) {
     return pmm_total_frames_count;
 }
@@ -325,10 +884,24 @@ size_t pmm_get_usable_frames(void) {
     return pmm_usable_frames_count;
 }
 
+// frames parked in the per-cpu caches or the zero pool still count as free
 size_t pmm_get_free_frames(void) {
-    return pmm_free_frames_count;
+    return pmm_free_frames_count + pcp_cached_frames() + zero_pool_count();
 }
 
 size_t pmm_get_used_frames(void) {
-    return pmm_used_frames_count;
-}
\ No newline at end of file
+    return pmm_used_frames_count - pcp_cached_frames() - zero_pool_count();
+}
+
+size_t pmm_get_reclaimed_frames(void) {
+    return pmm_reclaimed_frames_count;
+}
+
+uint64_t pmm_get_init_cycles(void) {
+    return pmm_init_cycles;
+}
+
+size_t pmm_get_free_blocks(unsigned order) {
+    if (order > PMM_MAX_ORDER) return 0;
+    return free_blocks_count[order];
+}
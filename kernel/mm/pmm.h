@@ -3,11 +3,19 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 
 #include <limine.h>
 
 #define PAGE_SIZE 4096ULL
 
+// largest buddy block is 2^PMM_MAX_ORDER frames (1 GiB)
+#define PMM_MAX_ORDER 18
+
+// buddy orders that back 2 MiB and 1 GiB pages
+#define PMM_ORDER_2MB 9
+#define PMM_ORDER_1GB 18
+
 void pmm_init();
 
 void* pmm_alloc(void);
@@ -20,12 +28,35 @@ void *pmm_alloc_frames_zeroed(size_t count);
 void *pmm_alloc_frames_aligned(size_t count, size_t alignment);
 void *pmm_alloc_frames_aligned_zeroed(size_t count, size_t alignment);
 
+// naturally aligned 2 MiB / 1 GiB physical blocks, free with pmm_free_frames
+void *pmm_alloc_huge_2mb(void);
+void *pmm_alloc_huge_1gb(void);
+
+// first-fit bitmap scan, used for runs bigger than a max-order block
+void *pmm_alloc_frames_linear(size_t count, size_t alignment);
+
 void pmm_free(void* phys_addr);
 void pmm_free_frames(void* phys_addr, size_t count);
 
+// single frames go through a per-cpu cache; give this cpu's back to the buddy lists
+void pmm_drain_cpu_cache(void);
+
+// bootloader- and ACPI-reclaimable memory stays used until this hands it to the allocator.
+// only call once nothing (stack, page tables, limine responses, ACPI tables) lives there anymore
+size_t pmm_reclaim_boot_memory(void);
+bool pmm_is_reclaimable(uint64_t phys);
+
 size_t pmm_get_total_frames(void);
 size_t pmm_get_free_frames(void);
 size_t pmm_get_usable_frames(void);
 size_t pmm_get_used_frames(void);
+size_t pmm_get_free_blocks(unsigned order);
+size_t pmm_get_reclaimed_frames(void);
+uint64_t pmm_get_init_cycles(void);
+
+#if ESTELLA_BENCH
+// returns the first frame of a free run of `count` frames without allocating it
+size_t pmm_bench_find_run(size_t count, bool word_scan);
+#endif
 
 #endif
\ No newline at end of file
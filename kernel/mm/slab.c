@@ -0,0 +1,390 @@
+// Slab allocator: object caches carved out of PMM frames, per-cpu magazines in front
+#include <mm/slab.h>
+#include <mm/pmm.h>
+#include <mm/page.h>
+#include <arch/x86_64/mm/vmm.h>
+#include <arch/x86_64/cpu/percpu.h>
+#include <arch/x86_64/cpu/spinlock.h>
+#include <klib/memory.h>
+#include <klib/string.h>
+#include <drivers/serial.h>
+
+#define SLAB_MAG_SIZE    12   // objects per per-cpu magazine, keeps one at 128 bytes
+#define SLAB_MAG_BATCH   6    // moved between a magazine and the slabs in one go
+#define SLAB_MIN_OBJECTS 8    // grow the slab order until at least this many fit
+#define SLAB_MAX_ORDER   3
+
+#define KMALLOC_CLASSES 8     // 16, 32, ... 2048
+
+// lives at the start of every slab
+struct slab {
+    struct slab *next;
+    struct slab *prev;
+    kmem_cache_t *cache;
+    void *free;          // free objects, linked through their first word
+    uint32_t inuse;
+    uint32_t capacity;
+};
+
+struct kmem_magazine {
+    uint32_t count;
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t hits;
+    void *objs[SLAB_MAG_SIZE];
+} __attribute__((aligned(64)));
+
+struct kmem_cache {
+    const char *name;
+    size_t object_size;     // what the user asked for
+    size_t stride;          // object_size rounded up to the alignment
+    size_t objs_offset;     // first object, right after the slab header
+    unsigned slab_order;
+    uint32_t objs_per_slab;
+
+    spinlock_t lock;        // slab lists and slab_count
+    struct slab *partial;   // some free objects
+    struct slab *full;
+    struct slab *empty;     // at most one spare slab is kept
+    size_t slab_count;
+
+    struct kmem_cache *next;
+    struct kmem_magazine mags[MAX_CPUS];
+};
+
+static spinlock_t caches_lock = SPINLOCK_INIT;
+static kmem_cache_t *caches;
+
+static kmem_cache_t *kmalloc_caches[KMALLOC_CLASSES];
+static const char *kmalloc_names[KMALLOC_CLASSES] = {
+    "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+    "kmalloc-256", "kmalloc-512", "kmalloc-1024", "kmalloc-2048",
+};
+
+static size_t align_up_size(size_t value, size_t align) {
+    return (value + align - 1) & ~(align - 1);
+}
+
+static void slab_list_add(struct slab **head, struct slab *slab) {
+    slab->prev = NULL;
+    slab->next = *head;
+    if (*head) (*head)->prev = slab;
+    *head = slab;
+}
+
+static void slab_list_remove(struct slab **head, struct slab *slab) {
+    if (slab->prev) slab->prev->next = slab->next;
+    else *head = slab->next;
+    if (slab->next) slab->next->prev = slab->prev;
+    slab->next = slab->prev = NULL;
+}
+
+static struct slab *obj_to_slab(void *obj) {
+    struct page *page = phys_to_page(virt_to_phys((uint64_t)obj));
+    return (struct slab *)page->private;
+}
+
+// cache->lock held
+static struct slab *slab_grow(kmem_cache_t *cache) {
+    size_t frames = (size_t)1 << cache->slab_order;
+    void *phys = pmm_alloc_frames(frames);
+    if (!phys) return NULL;
+
+    struct slab *slab = (struct slab *)phys_to_virt((uint64_t)phys);
+    slab->cache = cache;
+    slab->inuse = 0;
+    slab->capacity = cache->objs_per_slab;
+    slab->free = NULL;
+
+    // build the free list back to front so objects go out in address order
+    uint8_t *objs = (uint8_t *)slab + cache->objs_offset;
+    for (size_t i = cache->objs_per_slab; i > 0; i--) {
+        void **obj = (void **)(objs + (i - 1) * cache->stride);
+        *obj = slab->free;
+        slab->free = obj;
+    }
+
+    // every frame points back at the header, so any object finds its slab
+    struct page *page = phys_to_page((uint64_t)phys);
+    for (size_t i = 0; i < frames; i++) {
+        page[i].flags |= PG_KHEAP;
+        page[i].private = (uint64_t)slab;
+    }
+
+    cache->slab_count++;
+    return slab;
+}
+
+// cache->lock held
+static void slab_release(kmem_cache_t *cache, struct slab *slab) {
+    cache->slab_count--;
+    pmm_free_frames((void *)virt_to_phys((uint64_t)slab), (size_t)1 << cache->slab_order);
+}
+
+// cache->lock held
+static void *slab_take(kmem_cache_t *cache) {
+    struct slab *slab = cache->partial;
+    if (!slab) {
+        slab = cache->empty;
+        if (slab) {
+            cache->empty = NULL;
+        } else {
+            slab = slab_grow(cache);
+            if (!slab) return NULL;
+        }
+        slab_list_add(&cache->partial, slab);
+    }
+
+    void **obj = slab->free;
+    slab->free = *obj;
+    slab->inuse++;
+
+    if (!slab->free) {
+        slab_list_remove(&cache->partial, slab);
+        slab_list_add(&cache->full, slab);
+    }
+    return obj;
+}
+
+// cache->lock held
+static void slab_put(kmem_cache_t *cache, void *obj) {
+    struct slab *slab = obj_to_slab(obj);
+
+    if (!slab->free) {
+        slab_list_remove(&cache->full, slab);
+        slab_list_add(&cache->partial, slab);
+    }
+
+    *(void **)obj = slab->free;
+    slab->free = obj;
+    slab->inuse--;
+
+    if (slab->inuse == 0) {
+        slab_list_remove(&cache->partial, slab);
+        if (cache->empty) slab_release(cache, slab);
+        else cache->empty = slab;
+    }
+}
+
+// irqs off
+static void magazine_refill(kmem_cache_t *cache, struct kmem_magazine *mag) {
+    spin_lock(&cache->lock);
+    while (mag->count < SLAB_MAG_BATCH) {
+        void *obj = slab_take(cache);
+        if (!obj) break;
+        mag->objs[mag->count++] = obj;
+    }
+    spin_unlock(&cache->lock);
+}
+
+// irqs off
+static void magazine_flush(kmem_cache_t *cache, struct kmem_magazine *mag, uint32_t keep) {
+    spin_lock(&cache->lock);
+    while (mag->count > keep) {
+        slab_put(cache, mag->objs[--mag->count]);
+    }
+    spin_unlock(&cache->lock);
+}
+
+kmem_cache_t *kmem_cache_create(const char *name, size_t size, size_t align) {
+    if (size == 0 || size > KMALLOC_MAX) return NULL;
+    if (align < sizeof(void *)) align = sizeof(void *);
+    if (align & (align - 1)) return NULL;
+
+    size_t frames = (sizeof(kmem_cache_t) + PAGE_SIZE - 1) / PAGE_SIZE;
+    void *phys = pmm_alloc_frames_zeroed(frames);
+    if (!phys) return NULL;
+
+    kmem_cache_t *cache = (kmem_cache_t *)phys_to_virt((uint64_t)phys);
+    cache->name = name;
+    cache->object_size = size;
+    cache->stride = align_up_size(size, align);
+    cache->objs_offset = align_up_size(sizeof(struct slab), align);
+    cache->lock = (spinlock_t)SPINLOCK_INIT;
+
+    unsigned order = 0;
+    while (order < SLAB_MAX_ORDER
+           && ((PAGE_SIZE << order) - cache->objs_offset) / cache->stride < SLAB_MIN_OBJECTS) {
+        order++;
+    }
+    cache->slab_order = order;
+    cache->objs_per_slab = (uint32_t)(((PAGE_SIZE << order) - cache->objs_offset) / cache->stride);
+
+    uint64_t flags = spin_lock_irqsave(&caches_lock);
+    cache->next = caches;
+    caches = cache;
+    spin_unlock_irqrestore(&caches_lock, flags);
+
+    return cache;
+}
+
+// every object must have been freed; returns false (and keeps the cache) otherwise
+bool kmem_cache_destroy(kmem_cache_t *cache) {
+    struct kmem_cache_stats stats;
+    kmem_cache_get_stats(cache, &stats);
+    if (stats.in_use != 0) {
+        serial_puts("kmem_cache_destroy: objects still in use\n");
+        return false;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&caches_lock);
+    for (kmem_cache_t **link = &caches; *link; link = &(*link)->next) {
+        if (*link == cache) {
+            *link = cache->next;
+            break;
+        }
+    }
+    spin_unlock_irqrestore(&caches_lock, flags);
+
+    flags = irq_save();
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        magazine_flush(cache, &cache->mags[cpu], 0);
+    }
+    irq_restore(flags);
+
+    // all slabs are empty now, and only one empty slab is ever kept
+    if (cache->empty) slab_release(cache, cache->empty);
+
+    size_t frames = (sizeof(kmem_cache_t) + PAGE_SIZE - 1) / PAGE_SIZE;
+    pmm_free_frames((void *)virt_to_phys((uint64_t)cache), frames);
+    return true;
+}
+
+void *kmem_cache_alloc(kmem_cache_t *cache) {
+    uint64_t flags = irq_save();
+    struct kmem_magazine *mag = &cache->mags[this_cpu_id()];
+
+    void *obj = NULL;
+    if (mag->count > 0) {
+        mag->hits++;
+    } else {
+        magazine_refill(cache, mag);
+    }
+    if (mag->count > 0) {
+        obj = mag->objs[--mag->count];
+        mag->allocs++;
+    }
+
+    irq_restore(flags);
+    return obj;
+}
+
+void *kmem_cache_zalloc(kmem_cache_t *cache) {
+    void *obj = kmem_cache_alloc(cache);
+    if (obj) memset(obj, 0, cache->object_size);
+    return obj;
+}
+
+void kmem_cache_free(kmem_cache_t *cache, void *obj) {
+    if (!obj) return;
+
+    uint64_t flags = irq_save();
+    struct kmem_magazine *mag = &cache->mags[this_cpu_id()];
+
+    if (mag->count >= SLAB_MAG_SIZE) magazine_flush(cache, mag, SLAB_MAG_SIZE - SLAB_MAG_BATCH);
+    mag->objs[mag->count++] = obj;
+    mag->frees++;
+
+    irq_restore(flags);
+}
+
+void kmem_cache_get_stats(kmem_cache_t *cache, struct kmem_cache_stats *stats) {
+    uint64_t frees = 0;
+    stats->allocs = 0;
+    stats->magazine_hits = 0;
+
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        stats->allocs += cache->mags[cpu].allocs;
+        stats->magazine_hits += cache->mags[cpu].hits;
+        frees += cache->mags[cpu].frees;
+    }
+
+    stats->in_use = (size_t)(stats->allocs - frees);
+    stats->slabs = cache->slab_count;
+    stats->objects = cache->slab_count * cache->objs_per_slab;
+}
+
+static int kmalloc_class(size_t size) {
+    size_t class_size = KMALLOC_MIN;
+    for (int i = 0; i < KMALLOC_CLASSES; i++) {
+        if (size <= class_size) return i;
+        class_size <<= 1;
+    }
+    return -1;
+}
+
+void *kmalloc(size_t size) {
+    if (size == 0) return NULL;
+
+    int class = kmalloc_class(size);
+    if (class >= 0) return kmem_cache_alloc(kmalloc_caches[class]);
+
+    // big allocations: whole frames, PG_KHEAP without a slab behind it
+    size_t frames = 1;
+    while (frames * PAGE_SIZE < size) frames <<= 1;
+
+    void *phys = pmm_alloc_frames(frames);
+    if (!phys) return NULL;
+    phys_to_page((uint64_t)phys)->flags |= PG_KHEAP;
+    return (void *)phys_to_virt((uint64_t)phys);
+}
+
+void *kzalloc(size_t size) {
+    void *ptr = kmalloc(size);
+    if (ptr) memset(ptr, 0, size);
+    return ptr;
+}
+
+void kfree(void *ptr) {
+    if (!ptr) return;
+
+    struct page *page = phys_to_page(virt_to_phys((uint64_t)ptr));
+    if (!page || !(page->flags & PG_KHEAP)) {
+        serial_puts("kfree: not a kmalloc pointer\n");
+        return;
+    }
+
+    if (page->private) {
+        struct slab *slab = (struct slab *)page->private;
+        kmem_cache_free(slab->cache, ptr);
+        return;
+    }
+
+    size_t frames = (page->flags & PG_COMPOUND) ? (size_t)1 << page->order : 1;
+    pmm_free_frames((void *)virt_to_phys((uint64_t)ptr), frames);
+}
+
+void slab_init(void) {
+    size_t size = KMALLOC_MIN;
+    for (int i = 0; i < KMALLOC_CLASSES; i++) {
+        // power-of-two classes keep their natural alignment, up to a cache line
+        kmalloc_caches[i] = kmem_cache_create(kmalloc_names[i], size, size < 64 ? size : 64);
+        size <<= 1;
+    }
+    serial_puts("[slab] initialized\n");
+}
+
+void slab_dump_stats(void) {
+    char buf[32];
+    struct kmem_cache_stats stats;
+
+    for (kmem_cache_t *cache = caches; cache; cache = cache->next) {
+        kmem_cache_get_stats(cache, &stats);
+
+        serial_puts("[slab] ");
+        serial_puts(cache->name);
+        serial_puts(": ");
+        u64_to_dec(stats.in_use, buf);
+        serial_puts(buf);
+        serial_puts("/");
+        u64_to_dec(stats.objects, buf);
+        serial_puts(buf);
+        serial_puts(" objects, ");
+        u64_to_dec(stats.slabs, buf);
+        serial_puts(buf);
+        serial_puts(" slabs, ");
+        u64_to_dec(stats.allocs ? stats.magazine_hits * 100 / stats.allocs : 0, buf);
+        serial_puts(buf);
+        serial_puts("% magazine hits\n");
+    }
+}
@@ -0,0 +1,39 @@
+#ifndef ESTELLA_MM_SLAB_H
+#define ESTELLA_MM_SLAB_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// kmalloc size classes are powers of two in [KMALLOC_MIN, KMALLOC_MAX],
+// anything bigger goes straight to the PMM as whole frames
+#define KMALLOC_MIN 16
+#define KMALLOC_MAX 2048
+
+typedef struct kmem_cache kmem_cache_t;
+
+struct kmem_cache_stats {
+    size_t in_use;        // objects handed out and not freed yet
+    size_t slabs;
+    size_t objects;       // capacity of all slabs
+    uint64_t allocs;
+    uint64_t magazine_hits;  // allocs served from a per-cpu magazine
+};
+
+void slab_init(void);
+
+kmem_cache_t *kmem_cache_create(const char *name, size_t size, size_t align);
+bool kmem_cache_destroy(kmem_cache_t *cache);
+void *kmem_cache_alloc(kmem_cache_t *cache);
+void *kmem_cache_zalloc(kmem_cache_t *cache);
+void kmem_cache_free(kmem_cache_t *cache, void *obj);
+void kmem_cache_get_stats(kmem_cache_t *cache, struct kmem_cache_stats *stats);
+
+void *kmalloc(size_t size);
+void *kzalloc(size_t size);
+void kfree(void *ptr);
+
+// one line per cache on serial
+void slab_dump_stats(void);
+
+#endif
@@ -0,0 +1,52 @@
+// khugepaged-style collapsing of populated anonymous memory into 2 MiB pages
+#include <mm/thp.h>
+#include <mm/vma.h>
+#include <arch/x86_64/mm/vmm.h>
+#include <arch/x86_64/usermode/scheduler.h>
+#include <arch/x86_64/time/tsc.h>
+
+#define THP_SCAN_INTERVAL_MS 1000   // between passes
+#define THP_SCAN_BUDGET      16     // 2 MiB ranges looked at per pass
+
+static uint64_t next_scan;   // tsc
+
+size_t thp_scan(struct task *task, size_t budget) {
+    mm_t *mm = task->mm;
+    uint64_t *pml4 = (uint64_t *)phys_to_virt((uint64_t)task->pml4_phys);
+    uint64_t addr = mm->thp_cursor;
+    bool wrapped = false;
+    size_t collapsed = 0;
+
+    while (budget) {
+        struct vma *vma = mm_find_next(mm, addr);
+        if (!vma) {
+            if (wrapped) break;
+            wrapped = true;
+            addr = 0;
+            continue;
+        }
+
+        uint64_t base = addr > vma->start ? addr : vma->start;
+        base = (base + HUGE_2MB - 1) & ~(HUGE_2MB - 1);
+        if (vma->file || !(vma->prot & VMA_WRITE) || base + HUGE_2MB > vma->end) {
+            addr = vma->end;
+            continue;
+        }
+
+        budget--;
+        if (vmm_collapse_user_2mb(pml4, base)) collapsed++;
+        addr = base + HUGE_2MB;
+    }
+
+    mm->thp_cursor = addr;
+    return collapsed;
+}
+
+void thp_tick(void) {
+    // timer interrupts no longer come at a fixed rate, so go by the clock
+    uint64_t now = rdtsc();
+    if (now < __atomic_load_n(&next_scan, __ATOMIC_RELAXED)) return;
+    __atomic_store_n(&next_scan, now + tsc_frequency_hz / 1000 * THP_SCAN_INTERVAL_MS, __ATOMIC_RELAXED);
+    if (!current_task || !current_task->mm) return;
+    thp_scan(current_task, THP_SCAN_BUDGET);
+}
@@ -0,0 +1,18 @@
+#ifndef ESTELLA_MM_THP_H
+#define ESTELLA_MM_THP_H
+
+#include <stddef.h>
+
+struct task;
+
+// look at up to budget 2 MiB ranges of the task's anonymous writable vmas, starting
+// where the last pass stopped, and collapse the fully populated ones into huge pages.
+// returns how many were collapsed
+size_t thp_scan(struct task *task, size_t budget);
+
+// called by the timer on every interrupt taken in user mode; once every
+// THP_SCAN_INTERVAL_MS the interrupted task gets a scan. nothing in the kernel is
+// touching its page tables at that point
+void thp_tick(void);
+
+#endif
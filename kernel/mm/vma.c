@@ -0,0 +1,275 @@
+#include <mm/vma.h>
+#include <mm/slab.h>
+#include <drivers/serial.h>
+
+static kmem_cache_t *vma_cache;
+static kmem_cache_t *mm_cache;
+
+void vma_init(void) {
+    vma_cache = kmem_cache_create("vma", sizeof(struct vma), 8);
+    mm_cache = kmem_cache_create("mm_t", sizeof(mm_t), 8);
+    if (!vma_cache || !mm_cache) serial_puts("[vma] cache creation failed\n");
+}
+
+struct vma *vma_create(uint64_t start, uint64_t end, uint32_t prot) {
+    if (start >= end || (start | end) & 0xFFF) return NULL;
+
+    struct vma *vma = kmem_cache_zalloc(vma_cache);
+    if (!vma) return NULL;
+    vma->start = start;
+    vma->end = end;
+    vma->prot = prot;
+    return vma;
+}
+
+void vma_free(struct vma *vma) {
+    kmem_cache_free(vma_cache, vma);
+}
+
+mm_t *mm_create(void) {
+    return kmem_cache_zalloc(mm_cache);
+}
+
+void mm_destroy(mm_t *mm) {
+    struct vma *vma = mm->first;
+    while (vma) {
+        struct vma *next = vma->next;
+        vma_free(vma);
+        vma = next;
+    }
+    kmem_cache_free(mm_cache, mm);
+}
+
+static void link_vma(mm_t *mm, struct vma *prev, struct vma *vma);
+
+mm_t *mm_clone(mm_t *mm) {
+    mm_t *copy = mm_create();
+    if (!copy) return NULL;
+
+    struct vma *last = NULL;
+    for (struct vma *vma = mm->first; vma; vma = vma->next) {
+        struct vma *dup = vma_create(vma->start, vma->end, vma->prot);
+        if (!dup) {
+            mm_destroy(copy);
+            return NULL;
+        }
+        dup->file = vma->file;
+        dup->file_start = vma->file_start;
+        dup->file_size = vma->file_size;
+        link_vma(copy, last, dup);
+        last = dup;
+    }
+    copy->brk_start = mm->brk_start;
+    copy->brk = mm->brk;
+    return copy;
+}
+
+// avl tree; keys never change order relative to each other because vmas
+// don't overlap, so growing or trimming a vma in place keeps the tree valid
+
+static int height(struct vma *node) {
+    return node ? node->height : 0;
+}
+
+static void update_height(struct vma *node) {
+    int l = height(node->left), r = height(node->right);
+    node->height = (l > r ? l : r) + 1;
+}
+
+static struct vma *rotate_right(struct vma *node) {
+    struct vma *pivot = node->left;
+    node->left = pivot->right;
+    pivot->right = node;
+    update_height(node);
+    update_height(pivot);
+    return pivot;
+}
+
+static struct vma *rotate_left(struct vma *node) {
+    struct vma *pivot = node->right;
+    node->right = pivot->left;
+    pivot->left = node;
+    update_height(node);
+    update_height(pivot);
+    return pivot;
+}
+
+static struct vma *rebalance(struct vma *node) {
+    update_height(node);
+    int balance = height(node->left) - height(node->right);
+
+    if (balance > 1) {
+        if (height(node->left->left) < height(node->left->right)) node->left = rotate_left(node->left);
+        return rotate_right(node);
+    }
+    if (balance < -1) {
+        if (height(node->right->right) < height(node->right->left)) node->right = rotate_right(node->right);
+        return rotate_left(node);
+    }
+    return node;
+}
+
+static struct vma *tree_insert(struct vma *node, struct vma *vma) {
+    if (!node) {
+        vma->left = vma->right = NULL;
+        vma->height = 1;
+        return vma;
+    }
+    if (vma->start < node->start) node->left = tree_insert(node->left, vma);
+    else node->right = tree_insert(node->right, vma);
+    return rebalance(node);
+}
+
+static struct vma *tree_remove_min(struct vma *node, struct vma **min) {
+    if (!node->left) {
+        *min = node;
+        return node->right;
+    }
+    node->left = tree_remove_min(node->left, min);
+    return rebalance(node);
+}
+
+static struct vma *tree_remove(struct vma *node, struct vma *vma) {
+    if (!node) return NULL;
+
+    if (vma->start < node->start) {
+        node->left = tree_remove(node->left, vma);
+    } else if (vma->start > node->start) {
+        node->right = tree_remove(node->right, vma);
+    } else {
+        if (!node->left) return node->right;
+        if (!node->right) return node->left;
+
+        struct vma *min;
+        struct vma *right = tree_remove_min(node->right, &min);
+        min->left = node->left;
+        min->right = right;
+        node = min;
+    }
+    return rebalance(node);
+}
+
+// last vma starting at or below addr
+static struct vma *find_floor(mm_t *mm, uint64_t addr) {
+    struct vma *node = mm->root, *best = NULL;
+    while (node) {
+        if (node->start <= addr) {
+            best = node;
+            node = node->right;
+        } else {
+            node = node->left;
+        }
+    }
+    return best;
+}
+
+static void link_vma(mm_t *mm, struct vma *prev, struct vma *vma) {
+    vma->prev = prev;
+    vma->next = prev ? prev->next : mm->first;
+    if (vma->next) vma->next->prev = vma;
+    if (prev) prev->next = vma;
+    else mm->first = vma;
+
+    mm->root = tree_insert(mm->root, vma);
+    mm->vma_count++;
+}
+
+static void unlink_vma(mm_t *mm, struct vma *vma) {
+    if (vma->prev) vma->prev->next = vma->next;
+    else mm->first = vma->next;
+    if (vma->next) vma->next->prev = vma->prev;
+
+    mm->root = tree_remove(mm->root, vma);
+    mm->vma_count--;
+    if (mm->cache == vma) mm->cache = NULL;
+}
+
+// adjacent ranges with the same protection and backing can be one vma
+static bool can_merge(struct vma *a, struct vma *b) {
+    return a->end == b->start && a->prot == b->prot && a->file == b->file
+        && a->file_start == b->file_start && a->file_size == b->file_size;
+}
+
+bool mm_insert(mm_t *mm, struct vma *vma) {
+    struct vma *prev = find_floor(mm, vma->start);
+    struct vma *next = prev ? prev->next : mm->first;
+    if (prev && prev->end > vma->start) return false;
+    if (next && next->start < vma->end) return false;
+
+    if (prev && can_merge(prev, vma)) {
+        prev->end = vma->end;
+        vma_free(vma);
+        if (next && can_merge(prev, next)) {
+            prev->end = next->end;
+            unlink_vma(mm, next);
+            vma_free(next);
+        }
+        return true;
+    }
+    if (next && can_merge(vma, next)) {
+        next->start = vma->start;
+        vma_free(vma);
+        return true;
+    }
+
+    link_vma(mm, prev, vma);
+    return true;
+}
+
+struct vma *mm_find(mm_t *mm, uint64_t addr) {
+    struct vma *vma = mm->cache;
+    if (vma && vma->start <= addr && addr < vma->end) return vma;
+
+    vma = find_floor(mm, addr);
+    if (!vma || addr >= vma->end) return NULL;
+    mm->cache = vma;
+    return vma;
+}
+
+struct vma *mm_find_next(mm_t *mm, uint64_t addr) {
+    struct vma *vma = find_floor(mm, addr);
+    if (!vma) return mm->first;
+    return addr < vma->end ? vma : vma->next;
+}
+
+uint64_t mm_find_gap(mm_t *mm, uint64_t size, uint64_t low, uint64_t high) {
+    uint64_t start = low;
+    for (struct vma *vma = mm_find_next(mm, low); vma && vma->start < high; vma = vma->next) {
+        if (vma->start >= start + size) break;
+        if (vma->end > start) start = vma->end;
+    }
+    return start + size <= high ? start : 0;
+}
+
+struct vma *mm_split(mm_t *mm, struct vma *vma, uint64_t addr) {
+    if (addr <= vma->start || addr >= vma->end || (addr & 0xFFF)) return NULL;
+
+    struct vma *upper = vma_create(addr, vma->end, vma->prot);
+    if (!upper) return NULL;
+    upper->file = vma->file;
+    upper->file_start = vma->file_start;
+    upper->file_size = vma->file_size;
+
+    vma->end = addr;
+    link_vma(mm, vma, upper);
+    return upper;
+}
+
+bool mm_remove_range(mm_t *mm, uint64_t start, uint64_t end) {
+    struct vma *vma = mm_find_next(mm, start);
+
+    if (vma && vma->start < start && vma->end > start) {
+        vma = mm_split(mm, vma, start);
+        if (!vma) return false;
+    }
+
+    while (vma && vma->start < end) {
+        if (vma->end > end && !mm_split(mm, vma, end)) return false;
+
+        struct vma *next = vma->next;
+        unlink_vma(mm, vma);
+        vma_free(vma);
+        vma = next;
+    }
+    return true;
+}
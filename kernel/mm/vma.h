@@ -0,0 +1,63 @@
+#ifndef ESTELLA_MM_VMA_H
+#define ESTELLA_MM_VMA_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define VMA_READ  (1 << 0)
+#define VMA_WRITE (1 << 1)
+#define VMA_EXEC  (1 << 2)
+
+// a range of a user address space that is filled on first touch.
+// bytes [file_start, file_start + file_size) come from file, the rest is zero
+struct vma {
+    uint64_t start;          // page aligned
+    uint64_t end;            // exclusive, page aligned
+    uint32_t prot;
+    const uint8_t *file;     // NULL for anonymous memory
+    uint64_t file_start;
+    uint64_t file_size;
+
+    struct vma *left, *right;   // avl tree keyed by start
+    int height;
+    struct vma *prev, *next;    // address order
+};
+
+// the vmas of one user address space
+typedef struct mm {
+    struct vma *root;
+    struct vma *first;
+    struct vma *cache;       // last lookup hit, faults tend to cluster
+    size_t vma_count;
+    uint64_t brk_start;      // page aligned end of the loaded image
+    uint64_t brk;
+    struct elf_image *image; // shared read-only program pages, NULL if none. mm_clone leaves it out
+    uint64_t thp_cursor;     // where the next huge page scan picks up
+} mm_t;
+
+void vma_init(void);
+
+mm_t *mm_create(void);
+void mm_destroy(mm_t *mm);
+// same ranges and backing, for fork
+mm_t *mm_clone(mm_t *mm);
+
+struct vma *vma_create(uint64_t start, uint64_t end, uint32_t prot);
+void vma_free(struct vma *vma);
+
+// false (and vma left to the caller) if it overlaps an existing range; otherwise mm owns it
+// and it may be merged into a compatible neighbour, so don't use the pointer afterwards
+bool mm_insert(mm_t *mm, struct vma *vma);
+struct vma *mm_find(mm_t *mm, uint64_t addr);
+// first vma that ends above addr
+struct vma *mm_find_next(mm_t *mm, uint64_t addr);
+// lowest free, page aligned range of size bytes in [low, high), 0 if there is none
+uint64_t mm_find_gap(mm_t *mm, uint64_t size, uint64_t low, uint64_t high);
+// cut vma in two at addr, returns the upper half
+struct vma *mm_split(mm_t *mm, struct vma *vma, uint64_t addr);
+// drop [start, end) from the tree, splitting vmas that straddle the edges.
+// page tables are the caller's business
+bool mm_remove_range(mm_t *mm, uint64_t start, uint64_t end);
+
+#endif
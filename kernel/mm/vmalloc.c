@@ -0,0 +1,273 @@
+// Kernel virtual address allocator: vmalloc/vmap/ioremap over [VMALLOC_START, VMALLOC_END)
+#include <mm/vmalloc.h>
+#include <mm/pmm.h>
+#include <mm/slab.h>
+#include <arch/x86_64/cpu/spinlock.h>
+#include <mm/zeropool.h>
+#include <drivers/serial.h>
+
+#define VM_ALLOC   (1 << 0)   // the frames belong to the area and are freed with it
+#define VM_MAP     (1 << 1)
+#define VM_IOREMAP (1 << 2)
+#define VM_LAZY    (1 << 3)   // unmapped, space not reusable until the next tlb flush
+
+// this much unmapped-but-unflushed space (32 MiB) forces a purge
+#define VMALLOC_LAZY_MAX_PAGES 8192
+
+struct vm_area {
+    uint64_t start;     // reserved span, a guard page follows it
+    uint64_t size;
+    uint64_t addr;      // first mapped page, start unless ioremap aligned it
+    size_t pages;
+    uint32_t flags;
+    uint32_t purge;     // lazy and claimed by that purge, unlinked once it has flushed
+    struct vm_area *next;
+};
+
+static spinlock_t vmalloc_lock = SPINLOCK_INIT;
+static struct vm_area *areas;   // sorted by start, lazy ones included
+static size_t lazy_pages;
+static uint32_t purge_seq;
+static kmem_cache_t *area_cache;
+
+static uint64_t align_up(uint64_t value, uint64_t align) {
+    return (value + align - 1) & ~(align - 1);
+}
+
+// first fit with a guard page between areas
+static bool insert_area(struct vm_area *area, uint64_t size, uint64_t align) {
+    uint64_t flags = spin_lock_irqsave(&vmalloc_lock);
+
+    uint64_t start = align_up(VMALLOC_START, align);
+    struct vm_area **link = &areas;
+    while (*link) {
+        if (start + size + PAGE_SIZE <= (*link)->start) break;
+        start = align_up((*link)->start + (*link)->size + PAGE_SIZE, align);
+        link = &(*link)->next;
+    }
+
+    bool fits = start + size <= VMALLOC_END;
+    if (fits) {
+        area->start = start;
+        area->size = size;
+        area->next = *link;
+        *link = area;
+    }
+
+    spin_unlock_irqrestore(&vmalloc_lock, flags);
+    return fits;
+}
+
+static struct vm_area *alloc_area(uint64_t size, uint64_t align, uint32_t flags) {
+    struct vm_area *area = kmem_cache_alloc(area_cache);
+    if (!area) return NULL;
+
+    area->flags = flags;
+    area->purge = 0;
+    if (!insert_area(area, size, align)) {
+        // the space might only be held by lazily freed areas
+        vmalloc_purge_lazy();
+        if (!insert_area(area, size, align)) {
+            kmem_cache_free(area_cache, area);
+            serial_puts("vmalloc: out of virtual space\n");
+            return NULL;
+        }
+    }
+
+    area->addr = area->start;
+    area->pages = size / PAGE_SIZE;
+    return area;
+}
+
+static struct vm_area *find_area(uint64_t addr) {
+    uint64_t flags = spin_lock_irqsave(&vmalloc_lock);
+
+    struct vm_area *area = areas;
+    while (area && !(area->addr == addr && !(area->flags & VM_LAZY))) {
+        area = area->next;
+    }
+
+    spin_unlock_irqrestore(&vmalloc_lock, flags);
+    return area;
+}
+
+// entries are already cleared; the flush is deferred and batched with others
+static void release_area(struct vm_area *area) {
+    uint64_t flags = spin_lock_irqsave(&vmalloc_lock);
+    area->flags |= VM_LAZY;
+    lazy_pages += area->size / PAGE_SIZE;
+    bool purge = lazy_pages > VMALLOC_LAZY_MAX_PAGES;
+    spin_unlock_irqrestore(&vmalloc_lock, flags);
+
+    if (purge) vmalloc_purge_lazy();
+}
+
+void vmalloc_purge_lazy(void) {
+    uint64_t lo = VMALLOC_END;
+    uint64_t hi = VMALLOC_START;
+
+    // claim the lazy areas but leave them linked: their space must not be handed out
+    // again while another cpu may still hold translations for it
+    uint64_t flags = spin_lock_irqsave(&vmalloc_lock);
+    if (++purge_seq == 0) purge_seq = 1;
+    uint32_t purge = purge_seq;
+    for (struct vm_area *area = areas; area; area = area->next) {
+        if (!(area->flags & VM_LAZY) || area->purge) continue;
+        area->purge = purge;
+        if (area->start < lo) lo = area->start;
+        if (area->start + area->size > hi) hi = area->start + area->size;
+    }
+    lazy_pages = 0;
+    spin_unlock_irqrestore(&vmalloc_lock, flags);
+
+    if (lo >= hi) return;
+
+    // one flush for everything unmapped since the last purge, every cpu included
+    vmm_flush_tlb_range(lo, hi);
+
+    struct vm_area *purged = NULL;
+    flags = spin_lock_irqsave(&vmalloc_lock);
+    struct vm_area **link = &areas;
+    while (*link) {
+        struct vm_area *area = *link;
+        if (area->purge != purge) {
+            link = &area->next;
+            continue;
+        }
+        *link = area->next;
+        area->next = purged;
+        purged = area;
+    }
+    spin_unlock_irqrestore(&vmalloc_lock, flags);
+
+    while (purged) {
+        struct vm_area *next = purged->next;
+        kmem_cache_free(area_cache, purged);
+        purged = next;
+    }
+}
+
+void vmalloc_init(void) {
+    area_cache = kmem_cache_create("vm_area", sizeof(struct vm_area), 8);
+    // tasks copy the kernel half of the pml4, the window's entry has to exist before them
+    if (!area_cache || !vmm_prealloc_pml4e(VMALLOC_START)) {
+        serial_puts("[vmalloc] init failed\n");
+        return;
+    }
+    serial_puts("[vmalloc] initialized\n");
+}
+
+void *vmalloc(size_t size) {
+    if (size == 0) return NULL;
+
+    struct vm_area *area = alloc_area(align_up(size, PAGE_SIZE), PAGE_SIZE, VM_ALLOC);
+    if (!area) return NULL;
+
+    vmm_batch_t batch;
+    vmm_batch_begin(&batch, NULL);
+    for (size_t i = 0; i < area->pages; i++) {
+        void *frame = pmm_alloc();
+        if (!frame || !vmm_batch_map(&batch, area->addr + i * PAGE_SIZE, (uint64_t)frame, PTE_KERNEL_RW_NX)) {
+            if (frame) pmm_free(frame);
+            vmm_batch_end(&batch);
+            // vfree only walks what is actually mapped
+            vfree((void *)area->addr);
+            return NULL;
+        }
+    }
+    vmm_batch_end(&batch);
+    return (void *)area->addr;
+}
+
+void *vzalloc(size_t size) {
+    void *addr = vmalloc(size);
+    if (addr) zero_frames(addr, align_up(size, PAGE_SIZE) / PAGE_SIZE);
+    return addr;
+}
+
+void vfree(void *addr) {
+    if (!addr) return;
+
+    struct vm_area *area = find_area((uint64_t)addr);
+    if (!area || !(area->flags & VM_ALLOC)) {
+        serial_puts("vfree: not a vmalloc address\n");
+        return;
+    }
+
+    // frames can go back right away: nothing uses the range, the stale tlb entries
+    // only matter once the addresses are reused, and that waits for the purge
+    for (size_t i = 0; i < area->pages; i++) {
+        uint64_t phys = vmm_get_physical(area->addr + i * PAGE_SIZE);
+        if (phys) pmm_free((void *)phys);
+    }
+    vmm_unmap_range_noflush(area->addr, area->pages);
+    release_area(area);
+}
+
+void *vmap(uint64_t *frames, size_t count, uint64_t flags) {
+    if (count == 0) return NULL;
+
+    struct vm_area *area = alloc_area(count * PAGE_SIZE, PAGE_SIZE, VM_MAP);
+    if (!area) return NULL;
+
+    vmm_batch_t batch;
+    vmm_batch_begin(&batch, NULL);
+    for (size_t i = 0; i < count; i++) {
+        if (!vmm_batch_map(&batch, area->addr + i * PAGE_SIZE, frames[i], flags)) {
+            vmm_batch_end(&batch);
+            vmm_unmap_range_noflush(area->addr, i);
+            release_area(area);
+            return NULL;
+        }
+    }
+    vmm_batch_end(&batch);
+    return (void *)area->addr;
+}
+
+void vunmap(void *addr) {
+    struct vm_area *area = find_area((uint64_t)addr);
+    if (!area || !(area->flags & VM_MAP)) {
+        serial_puts("vunmap: not a vmap address\n");
+        return;
+    }
+
+    vmm_unmap_range_noflush(area->addr, area->pages);
+    release_area(area);
+}
+
+void *ioremap(uint64_t phys, size_t size, uint64_t cache) {
+    if (size == 0) return NULL;
+
+    uint64_t offset = phys & (PAGE_SIZE - 1);
+    uint64_t base = phys - offset;
+    uint64_t map_size = align_up(size + offset, PAGE_SIZE);
+
+    // keep virt congruent to phys modulo the huge page size so the middle can use huge entries
+    uint64_t huge = 0;
+    if (map_size >= HUGE_1GB && vmm_has_1gb_pages()) huge = HUGE_1GB;
+    else if (map_size >= HUGE_2MB) huge = HUGE_2MB;
+    uint64_t skew = huge ? base & (huge - 1) : 0;
+
+    struct vm_area *area = alloc_area(map_size + skew, huge ? huge : PAGE_SIZE, VM_IOREMAP);
+    if (!area) return NULL;
+    area->addr = area->start + skew;
+    area->pages = map_size / PAGE_SIZE;
+
+    if (!vmm_map_range_huge(area->addr, base, area->pages, PTE_KERNEL_RW_NX | cache)) {
+        vmm_unmap_range_noflush(area->addr, area->pages);
+        release_area(area);
+        return NULL;
+    }
+    return (void *)(area->addr + offset);
+}
+
+void iounmap(void *addr) {
+    struct vm_area *area = find_area((uint64_t)addr & ~(PAGE_SIZE - 1));
+    if (!area || !(area->flags & VM_IOREMAP)) {
+        serial_puts("iounmap: not an ioremap address\n");
+        return;
+    }
+
+    vmm_unmap_range_noflush(area->addr, area->pages);
+    release_area(area);
+}
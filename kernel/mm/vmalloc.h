@@ -0,0 +1,37 @@
+#ifndef ESTELLA_MM_VMALLOC_H
+#define ESTELLA_MM_VMALLOC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <arch/x86_64/mm/vmm.h>
+
+// one pml4 slot (512 GiB) of kernel virtual space handed out on demand
+#define VMALLOC_START 0xFFFFC00000000000ULL
+#define VMALLOC_END   0xFFFFC08000000000ULL
+
+// cache attributes for ioremap
+#define IOREMAP_WB PTE_CACHE_WB
+#define IOREMAP_WT PTE_CACHE_WT
+#define IOREMAP_UC PTE_CACHE_UC
+#define IOREMAP_WC PTE_CACHE_WC
+
+void vmalloc_init(void);
+
+// virtually contiguous, backed by individual frames
+void *vmalloc(size_t size);
+void *vzalloc(size_t size);
+void vfree(void *addr);
+
+// map existing frames contiguously; vunmap leaves the frames alone
+void *vmap(uint64_t *frames, size_t count, uint64_t flags);
+void vunmap(void *addr);
+
+// map a physical MMIO range; 2 MiB / 1 GiB entries are used where it lines up
+void *ioremap(uint64_t phys, size_t size, uint64_t cache);
+void iounmap(void *addr);
+
+// flush the TLB for everything unmapped so far and make that space reusable
+void vmalloc_purge_lazy(void);
+
+#endif
@@ -0,0 +1,97 @@
+#include <mm/zeropool.h>
+#include <mm/pmm.h>
+#include <arch/x86_64/mm/vmm.h>
+#include <arch/x86_64/cpu/spinlock.h>
+#include <drivers/serial.h>
+
+// don't keep zeroed frames around when the PMM itself is running low
+#define ZERO_POOL_MIN_FREE (ZERO_POOL_SIZE * 4)
+
+static spinlock_t pool_lock = SPINLOCK_INIT;
+static uint64_t pool_frames[ZERO_POOL_SIZE];
+static size_t pool_count;
+
+static uint64_t pool_hits;
+static uint64_t pool_misses;
+
+void zero_frames(void *virt, size_t count) {
+    void *dest = virt;
+    size_t qwords = count * PAGE_SIZE / sizeof(uint64_t);
+    asm volatile("rep stosq" : "+D"(dest), "+c"(qwords) : "a"(0ULL) : "memory");
+}
+
+size_t zero_pool_refill(size_t budget) {
+    size_t added = 0;
+
+    while (added < budget) {
+        if (pool_count >= ZERO_POOL_SIZE) break;
+        if (pmm_get_free_frames() < ZERO_POOL_MIN_FREE) break;
+
+        void *frame = pmm_alloc();
+        if (!frame) break;
+
+        // zero outside the lock, interrupts stay on
+        zero_frames((void *)phys_to_virt((uint64_t)frame), 1);
+
+        uint64_t flags = spin_lock_irqsave(&pool_lock);
+        bool stored = pool_count < ZERO_POOL_SIZE;
+        if (stored) pool_frames[pool_count++] = (uint64_t)frame;
+        spin_unlock_irqrestore(&pool_lock, flags);
+
+        if (!stored) {
+            pmm_free(frame);
+            break;
+        }
+        added++;
+    }
+
+    return added;
+}
+
+void zero_pool_init(void) {
+    zero_pool_refill(ZERO_POOL_SIZE);
+    serial_puts("[zeropool] initialized\n");
+}
+
+void *zero_pool_take(void) {
+    void *frame = NULL;
+
+    uint64_t flags = spin_lock_irqsave(&pool_lock);
+    if (pool_count > 0) {
+        frame = (void *)pool_frames[--pool_count];
+        pool_hits++;
+    } else {
+        pool_misses++;
+    }
+    spin_unlock_irqrestore(&pool_lock, flags);
+
+    return frame;
+}
+
+size_t zero_pool_drain(void) {
+    size_t drained = 0;
+
+    while (true) {
+        uint64_t flags = spin_lock_irqsave(&pool_lock);
+        uint64_t frame = pool_count > 0 ? pool_frames[--pool_count] : 0;
+        spin_unlock_irqrestore(&pool_lock, flags);
+
+        if (!frame) break;
+        pmm_free((void *)frame);
+        drained++;
+    }
+
+    return drained;
+}
+
+size_t zero_pool_count(void) {
+    return pool_count;
+}
+
+uint64_t zero_pool_hits(void) {
+    return pool_hits;
+}
+
+uint64_t zero_pool_misses(void) {
+    return pool_misses;
+}
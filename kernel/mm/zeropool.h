@@ -0,0 +1,32 @@
+#ifndef ESTELLA_MM_ZEROPOOL_H
+#define ESTELLA_MM_ZEROPOOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// frames kept zeroed ahead of time for pmm_alloc_zeroed (1 MiB)
+#define ZERO_POOL_SIZE  256
+// frames zeroed per idle pass, keeps a single pass short
+#define ZERO_POOL_BATCH 16
+
+// fill the pool up front so early page tables and task images hit it
+void zero_pool_init(void);
+
+// zero up to `budget` frames into the pool, returns how many were added
+size_t zero_pool_refill(size_t budget);
+
+// a pre-zeroed frame (physical address) or NULL if the pool is empty
+void *zero_pool_take(void);
+
+// hand every pooled frame back to the PMM, returns how many
+size_t zero_pool_drain(void);
+
+size_t zero_pool_count(void);
+uint64_t zero_pool_hits(void);
+uint64_t zero_pool_misses(void);
+
+// rep stosq over `count` frames at virtual address `virt`
+void zero_frames(void *virt, size_t count);
+
+#endif
@@ -3,6 +3,7 @@
 #include <drivers/keyboard.h>
 #include <colors.h>
 #include <generic/time.h>
+#include <arch/x86_64/cpu/idle.h>
 
 static void execute_command(const char* cmd) {
     if (!cmd || cmd[0] == '\0') return;
@@ -69,6 +70,8 @@ void launch_shell(void) {
                     fb_put_char(c, 0xAAAAAA);
                 }
             }
+        } else {
+            cpu_idle();
         }
     }
 }
\ No newline at end of file
@@ -7,6 +7,7 @@ SRC_DIR    = kernel
 ESP_DIR    = $(BUILD_DIR)/ESP
 DISK_IMG   = $(BUILD_DIR)/SonnaOS-estella.img
 IMG_SIZE_MB ?= 64
+BENCH      ?= 0
 
 KERNEL_CFLAGS = \
     -target x86_64-unknown-elf \
@@ -14,7 +15,8 @@ KERNEL_CFLAGS = \
     -fno-stack-protector -fshort-wchar -Wall -O2 \
     -I kernel -I kernel/include \
     -MMD -MP -mcmodel=kernel \
-    -fno-omit-frame-pointer -mno-sse
+    -fno-omit-frame-pointer -mno-sse \
+    -DESTELLA_BENCH=$(BENCH)
 
 KERNEL_LDFLAGS = -T x86-64.lds -nostdlib
 
@@ -28,8 +30,10 @@ USER_CFLAGS = \
 
 USER_LDFLAGS = -static -no-pie -nostdlib -T userspace/user.ld
 
+SMP ?= 4
+
 QEMU_FLAGS ?= \
-    -enable-kvm -cpu host,+invtsc \
+    -enable-kvm -cpu host,+invtsc -smp $(SMP) \
     -M q35 -m 2G -serial stdio -display gtk \
     -device VGA,xres=1920,yres=1080 \
     -no-reboot -no-shutdown
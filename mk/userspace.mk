@@ -1,4 +1,4 @@
-USER_PROGRAMS  := task_a task_b task_c
+USER_PROGRAMS  := task_a task_b task_c hog
 
 USER_LIB_SRC  := $(shell find userspace/lib -name '*.c')
 USER_LIB_OBJ  := $(patsubst userspace/lib/%.c, \
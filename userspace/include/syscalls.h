@@ -1,9 +1,43 @@
 #pragma once
 
+#define PROT_READ  0x1
+#define PROT_WRITE 0x2
+#define PROT_EXEC  0x4
+
+#define MAP_SHARED    0x01
+#define MAP_PRIVATE   0x02
+#define MAP_FIXED     0x10
+#define MAP_ANONYMOUS 0x20
+#define MAP_FAILED    ((void *)-1)
+
 #define SYS_READ 0
 #define SYS_WRITE 1
+#define SYS_OPEN 2
+#define SYS_CLOSE 3
+#define SYS_MMAP 9
+#define SYS_MPROTECT 10
+#define SYS_MUNMAP 11
+#define SYS_BRK 12
+#define SYS_NANOSLEEP 35
 #define SYS_GETPID 39
+#define SYS_FORK 57
 #define SYS_EXIT 60
+#define SYS_SETPRIORITY 141
+#define SYS_SCHED_SETSCHEDULER 144
+
+#define PRIO_PROCESS 0
+
+#define SCHED_OTHER 0
+#define SCHED_RR    2
+
+struct timespec {
+    long tv_sec;
+    long tv_nsec;   // 0..999999999
+};
+
+struct sched_param {
+    int sched_priority;     // 1..99 for SCHED_RR, higher runs first; 0 for SCHED_OTHER
+};
 
 long syscall0(long n);
 long syscall1(long n, long a1);
@@ -16,4 +50,17 @@ long syscall6(long n, long a1, long a2, long a3, long a4, long a5, long a6);
 long write(int fd, const void *buf, unsigned long count);
 long read(int fd, void *buf, unsigned long count);
 long getpid(void);
+long open(const char *path);
+long close(int fd);
+void *mmap(void *addr, unsigned long len, int prot, int flags, int fd, long offset);
+long munmap(void *addr, unsigned long len);
+long mprotect(void *addr, unsigned long len, int prot);
+void *brk(void *addr);
+long fork(void);
+// sleep for at least req; rem is left alone, nothing interrupts a sleep
+long nanosleep(const struct timespec *req, struct timespec *rem);
+// nice -20..19, lower runs first; who is 0 or the caller's own pid
+long setpriority(int which, int who, int prio);
+// SCHED_RR tasks run before every SCHED_OTHER one; pid is 0 or the caller's own
+long sched_setscheduler(int pid, int policy, const struct sched_param *param);
 void _exit(int status);
\ No newline at end of file
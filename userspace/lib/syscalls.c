@@ -23,6 +23,18 @@ long syscall1(long n, long arg1)
     return ret;
 }
 
+long syscall2(long n, long arg1, long arg2)
+{
+    long ret;
+    asm volatile(
+        "syscall\n"
+        : "=a"(ret)
+        : "a"(n), "D"(arg1), "S"(arg2)
+        : "rcx", "r11", "memory"
+    );
+    return ret;
+}
+
 long syscall3(long n, long arg1, long arg2, long arg3)
 {
     long ret;
@@ -35,6 +47,21 @@ long syscall3(long n, long arg1, long arg2, long arg3)
     return ret;
 }
 
+long syscall6(long n, long arg1, long arg2, long arg3, long arg4, long arg5, long arg6)
+{
+    long ret;
+    register long r10 asm("r10") = arg4;
+    register long r8 asm("r8") = arg5;
+    register long r9 asm("r9") = arg6;
+    asm volatile(
+        "syscall\n"
+        : "=a"(ret)
+        : "a"(n), "D"(arg1), "S"(arg2), "d"(arg3), "r"(r10), "r"(r8), "r"(r9)
+        : "rcx", "r11", "memory"
+    );
+    return ret;
+}
+
 long write(int fd, const void *buf, unsigned long count)
 {
     return syscall3(SYS_WRITE, fd, (long)buf, count);
@@ -49,6 +76,46 @@ long getpid(void) {
     return syscall0(SYS_GETPID);
 }
 
+long open(const char *path) {
+    return syscall1(SYS_OPEN, (long)path);
+}
+
+long close(int fd) {
+    return syscall1(SYS_CLOSE, fd);
+}
+
+void *mmap(void *addr, unsigned long len, int prot, int flags, int fd, long offset) {
+    return (void *)syscall6(SYS_MMAP, (long)addr, len, prot, flags, fd, offset);
+}
+
+long munmap(void *addr, unsigned long len) {
+    return syscall2(SYS_MUNMAP, (long)addr, len);
+}
+
+long mprotect(void *addr, unsigned long len, int prot) {
+    return syscall3(SYS_MPROTECT, (long)addr, len, prot);
+}
+
+long setpriority(int which, int who, int prio) {
+    return syscall3(SYS_SETPRIORITY, which, who, prio);
+}
+
+long sched_setscheduler(int pid, int policy, const struct sched_param *param) {
+    return syscall3(SYS_SCHED_SETSCHEDULER, pid, policy, (long)param);
+}
+
+void *brk(void *addr) {
+    return (void *)syscall1(SYS_BRK, (long)addr);
+}
+
+long fork(void) {
+    return syscall0(SYS_FORK);
+}
+
+long nanosleep(const struct timespec *req, struct timespec *rem) {
+    return syscall2(SYS_NANOSLEEP, (long)req, (long)rem);
+}
+
 void _exit(int status)
 {
     syscall1(SYS_EXIT, status);
@@ -0,0 +1,6 @@
+// burns cpu forever, for the scheduler fairness bench
+int main(void)
+{
+    for (;;)
+        asm volatile("");
+}
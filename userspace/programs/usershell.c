@@ -17,6 +17,9 @@ void execute_command(char *line) {
 }
 
 void main(void) {
+    // a heavy weight, so a key press preempts whatever cpu-bound task is running
+    setpriority(PRIO_PROCESS, 0, -10);
+
     printf("Welcome to Estella userspace shell! \n");
     printf("Type 'help' for commands. \n\n");
 